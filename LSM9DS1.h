@@ -0,0 +1,101 @@
+/*
+This file is part of Fågelmataren, an embedded project created to learn
+Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+Copyright (C) 2015-2017 Linus Styrén
+
+Fågelmataren is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the Licence, or
+(at your option) any later version.
+
+Fågelmataren is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public Licence for more details.
+
+You should have received a copy of the GNU General Public Licence
+along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+
+Programming definitions for the accelerometer and gyroscope of the LSM9DS1
+iNEMO inertial module (STMicroelectronics NV)
+Reference: datasheet DocID025715 Rev 3 (March 2015), www.st.com
+Very terse comments are provided in this file. See explanations in the
+datasheet. This header is specialized for Raspberry Pi sense-hat usage and
+covers only the registers used for FIFO streaming of the accelerometer; the
+magnetometer is a separate device at another slave address.
+Names used are mostly composed by prepending "LSM9DS1_" on the register and
+bitfield names used in the datasheet. Terms in ALL CAPS are the register
+designations; those with lower-case letters are data values or bitfield
+macros.
+Registers marked with the comment "//2" are register pairs, where the
+designation applies to the least significant byte and the high byte is
+addressed by adding "+1". (The data sheet uses two definitions with "_L"
+and "_H" on the end).
+For bitfields we are using function-style definitions. The ones ending in
+"_ef(v)" are for extracting field values from a register value, and the
+"_if(f)" ones are for inserting fields into a register value. Example: to
+select 238 Hz and +-2 g for the accelerometer, use this expression:
+LSM9DS1_CTRL_REG6_XL_ODR_XL_if(4)|LSM9DS1_CTRL_REG6_XL_FS_XL_if(0)
+Field length in bits is shown by comments such as  //2b
+Note that these macros do not check for inappropriate submitted values.
+Note well, regarding register addresses not mentioned herein: from the
+datasheet, "Registers marked as Reserved must not be changed. Writing to
+those registers may cause permanent damage to the device."
+*/
+/* Notes on Raspberry Pi sense-hat use
+The accelerometer/gyroscope answers at 0x6a and the magnetometer at 0x1c.
+Interrupt lines INT1_A/G and INT2_A/G are not routed to the Pi, so the FIFO
+status has to be polled over the bus.
+*/
+#define LSM9DS1_SAD          0x6a  // slave address of accelerometer/gyro
+#define LSM9DS1_WHO_AM_I     0x0f  // read this to get--
+#define LSM9DS1_who_am_i     0x68  //   this device identifier
+
+// gyroscope output data rate and full scale, ODR_G=0 is power-down which
+// leaves the accelerometer running on its own at ODR_XL
+#define LSM9DS1_CTRL_REG1_G  0x10
+#define LSM9DS1_CTRL_REG1_G_ODR_G_if(f) ((f)<<5)  //3b data rate, 0= off
+#define LSM9DS1_CTRL_REG1_G_FS_G_if(f) ((f)<<3)   //2b full scale
+#define LSM9DS1_CTRL_REG1_G_BW_G_if(f) (f)        //2b bandwidth
+
+#define LSM9DS1_STATUS_REG   0x27
+#define LSM9DS1_STATUS_REG_XLDA_ef(v) ((v)&1)     //1b new accel. avail.
+
+#define LSM9DS1_CTRL_REG5_XL 0x1f
+#define LSM9DS1_CTRL_REG5_XL_DEC_if(f) ((f)<<6)   //2b decimation
+#define LSM9DS1_CTRL_REG5_XL_Zen_XL_if(f) ((f)<<5) //1b enable Z axis
+#define LSM9DS1_CTRL_REG5_XL_Yen_XL_if(f) ((f)<<4) //1b enable Y axis
+#define LSM9DS1_CTRL_REG5_XL_Xen_XL_if(f) ((f)<<3) //1b enable X axis
+
+// accelerometer data rate: 1= 10 Hz, 2= 50, 3= 119, 4= 238, 5= 476, 6= 952
+// full scale: 0= +-2 g, 1= +-16 g, 2= +-4 g, 3= +-8 g
+#define LSM9DS1_CTRL_REG6_XL 0x20
+#define LSM9DS1_CTRL_REG6_XL_ODR_XL_if(f) ((f)<<5) //3b data rate
+#define LSM9DS1_CTRL_REG6_XL_FS_XL_if(f) ((f)<<3)  //2b full scale
+#define LSM9DS1_CTRL_REG6_XL_BW_SCAL_ODR_if(f) ((f)<<2) //1b BW from BW_XL
+#define LSM9DS1_CTRL_REG6_XL_BW_XL_if(f) (f)       //2b anti-aliasing BW
+
+#define LSM9DS1_CTRL_REG8    0x22
+#define LSM9DS1_CTRL_REG8_BOOT_if(f) ((f)<<7)     //1b 1= reboot memory content
+#define LSM9DS1_CTRL_REG8_BDU_if(f) ((f)<<6)      //1b 0= continuous update
+#define LSM9DS1_CTRL_REG8_IF_ADD_INC_if(f) ((f)<<2) //1b auto-increment
+#define LSM9DS1_CTRL_REG8_SW_RESET_if(f) (f)      //1b 1= software reset
+
+#define LSM9DS1_CTRL_REG9    0x23
+#define LSM9DS1_CTRL_REG9_FIFO_EN_if(f) ((f)<<1)  //1b enable FIFO
+#define LSM9DS1_CTRL_REG9_STOP_ON_FTH_if(f) (f)   //1b limit depth to FTH
+
+#define LSM9DS1_OUT_X_XL     0x28  //2  accelerometer X data out
+#define LSM9DS1_OUT_Y_XL     0x2a  //2  accelerometer Y data out
+#define LSM9DS1_OUT_Z_XL     0x2c  //2  accelerometer Z data out
+
+// FIFO mode: 0= bypass, 1= FIFO (stop when full), 6= continuous (overwrite
+// oldest). The FIFO holds 32 samples.
+#define LSM9DS1_FIFO_CTRL    0x2e
+#define LSM9DS1_FIFO_CTRL_FMODE_if(f) ((f)<<5)    //3b FIFO mode
+#define LSM9DS1_FIFO_CTRL_FTH_if(f) (f)           //5b threshold level
+
+#define LSM9DS1_FIFO_SRC     0x2f
+#define LSM9DS1_FIFO_SRC_FTH_ef(v) (((v)>>7)&1)   //1b threshold reached
+#define LSM9DS1_FIFO_SRC_OVRN_ef(v) (((v)>>6)&1)  //1b FIFO overrun
+#define LSM9DS1_FIFO_SRC_FSS_ef(v) ((v)&0x3f)     //6b unread samples
@@ -0,0 +1,289 @@
+/*
+ *  acquire.c
+ *    Per-channel acquisition scheduler that samples each channel at its own
+ *    cadence and merges due reads into as few bus transactions as possible
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "acquire.h"
+#include "i2cbus.h"
+#include "common.h"
+#include "log.h"
+
+static void acquire_cb (uint64_t, void *);
+
+int64_t
+acquire_deadline (const struct acquisition *acq, unsigned due, int64_t now)
+{
+    int64_t period = INT64_MAX;
+    int ch;
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if ((due & SENSOR_BIT(ch)) && acq->ch[ch].cur_period &&
+            acq->ch[ch].cur_period < period)
+            period = acq->ch[ch].cur_period;
+      }
+
+    return period == INT64_MAX ? 0 : now + period;
+}
+
+int64_t
+acquire_next_due (const struct acquisition *acq)
+{
+    int64_t first;
+    int ch;
+
+    first = INT64_MAX;
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (acq->ch[ch].cur_period && acq->ch[ch].next_due < first)
+            first = acq->ch[ch].next_due;
+      }
+
+    return first;
+}
+
+/* Schedule a wake up for the channel that is due first */
+static void
+acquire_arm (struct acquisition *acq)
+{
+    int64_t first;
+
+    first = acquire_next_due (acq);
+    if (first == INT64_MAX)
+        return;
+
+    /* Deadlines are absolute, a deadline already passed expires at once */
+    evcore_timer_set (&acq->timer, first, 0);
+}
+
+int
+acquire_init (struct acquisition *acq, struct evcore *core)
+{
+    memset (acq, 0, sizeof (*acq));
+
+    return evcore_timer_init (&acq->timer, core, acquire_cb, acq);
+}
+
+void
+acquire_free (struct acquisition *acq)
+{
+    evcore_source_free (&acq->timer);
+}
+
+/* Take over periods changed by acquire_set_period */
+static void
+sync_periods (struct acquisition *acq, int64_t now)
+{
+    struct acq_channel *c;
+    int64_t period;
+    int ch;
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        c = &acq->ch[ch];
+        period = atomic_load_explicit (&c->period, memory_order_relaxed);
+        if (period == c->cur_period)
+            continue;
+
+        /* Pull the next read in if the cadence was made faster */
+        c->cur_period = period;
+        if (!c->next_due || c->next_due > now + period)
+            c->next_due = now + period;
+      }
+}
+
+void
+acquire_set_period (struct acquisition *acq, enum sensor_channel channel,
+                    int64_t period)
+{
+    int64_t now;
+
+    atomic_store (&acq->ch[channel].period, period);
+
+    /* The acquisition thread picks the new period up on its next wake up */
+    if (acq->threaded)
+        return;
+
+    now = clock_ns (CLOCK_MONOTONIC);
+    sync_periods (acq, now);
+    acquire_arm (acq);
+}
+
+unsigned
+acquire_due (struct acquisition *acq, int64_t now)
+{
+    struct acq_channel *c;
+    unsigned due;
+    int ch;
+
+    sync_periods (acq, now);
+
+    due = 0;
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        c = &acq->ch[ch];
+        if (!c->cur_period || c->next_due > now + ACQ_MERGE_NS)
+            continue;
+
+        due |= SENSOR_BIT(ch);
+
+        /* Advance on the channel's own grid, skip reads we missed */
+        c->next_due += c->cur_period;
+        if (c->next_due <= now)
+            c->next_due = now + c->cur_period;
+      }
+
+    return due;
+}
+
+void
+acquire_store (struct acquisition *acq, const struct SensorSample *sample)
+{
+    struct acq_channel *c;
+    int64_t now = 0;
+    int ch, i;
+
+    if (acq->rollup)
+        now = clock_ns (CLOCK_REALTIME);
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (!(sample->mask & SENSOR_BIT(ch)))
+            continue;
+
+        if (acq->rollup)
+            rollup_add (acq->rollup, ch, sensors_convert (ch, sample->raw[ch]),
+                        now);
+
+        c = &acq->ch[ch];
+        c->last = sample->raw[ch];
+        c->samples++;
+        if (c->shift && ++c->skip < (1 << c->shift))
+            continue;
+        c->skip = 0;
+
+        /* Halve the rate rather than dropping the oldest samples, so the
+           median still covers the whole period when it is long */
+        if (c->n == ACQ_WINDOW_MAX)
+          {
+            for (i = 0; i < ACQ_WINDOW_MAX / 2; i++)
+                c->window[i] = c->window[2 * i];
+            c->n = ACQ_WINDOW_MAX / 2;
+            c->shift++;
+          }
+        c->window[c->n++] = sample->raw[ch];
+      }
+}
+
+int
+acquire_read_now (struct acquisition *acq, unsigned mask,
+                  struct SensorSample *sample)
+{
+    struct acq_channel *c;
+    int ch;
+
+    if (sensors_sample (mask, sample) < 0)
+        return -1;
+    acquire_store (acq, sample);
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        c = &acq->ch[ch];
+        if ((mask & SENSOR_BIT(ch)) && !(sample->mask & SENSOR_BIT(ch)) &&
+            c->n)
+          {
+            sample->raw[ch] = c->last;
+            sample->mask |= SENSOR_BIT(ch);
+          }
+      }
+
+    return 0;
+}
+
+static void
+acquire_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct acquisition *acq = arg;
+    struct SensorSample sample;
+    unsigned due;
+    int64_t now;
+
+    now = clock_ns (CLOCK_MONOTONIC);
+
+    due = acquire_due (acq, now);
+    if (due)
+      {
+        acq->transactions++;
+        if (sensors_sample_by (due, &sample,
+                               acquire_deadline (acq, due, now)) < 0)
+            acq->errors++;
+        else
+            acquire_store (acq, &sample);
+      }
+
+    acquire_arm (acq);
+}
+
+unsigned
+acquire_publish (struct acquisition *acq, struct SensorData *data)
+{
+    struct acq_channel *c;
+    float value, sd;
+    __s32 raw;
+    unsigned mask;
+    int ch;
+
+    i2c_trace_mark (I2C_MARK_PUBLISH, 0);
+
+    mask = 0;
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        c = &acq->ch[ch];
+        if (sensors_aggregate (ch, c->window, c->n, &raw, &value, &sd) < 0)
+            continue;
+        c->n = 0;
+        c->shift = 0;
+        c->skip = 0;
+        mask |= SENSOR_BIT(ch);
+        data->raw[ch] = raw;
+
+        switch (ch)
+          {
+            case SENSOR_PRESSURE:
+                data->pressure = value;
+                data->pressure_sd = sd;
+                break;
+            case SENSOR_TEMPERATURE:
+                data->temperature = value;
+                data->temperature_sd = sd;
+                break;
+            case SENSOR_HUMIDITY:
+                data->humidity = value;
+                data->humidity_sd = sd;
+                break;
+          }
+      }
+
+    return mask;
+}
@@ -0,0 +1,108 @@
+/*
+ *  acquire.h
+ *    Per-channel acquisition scheduler that samples each channel at its own
+ *    cadence and merges due reads into as few bus transactions as possible
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _ACQUIRE_H_
+#define _ACQUIRE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#include "sensors.h"
+#include "rollup.h"
+#include "evcore.h"
+
+/* Maximum number of samples kept per channel between two reports. That is
+   every sample at the fastest cadence (80 ms) over the default period;
+   longer periods are decimated to fit, see acquire_store */
+#define ACQ_WINDOW_MAX 128
+
+/* Reads due within this many nanoseconds are merged into the same bus
+   transaction instead of waking up again */
+#define ACQ_MERGE_NS (20 * NSEC_PER_MSEC)
+
+/*
+ * The period may be changed from the event loop while the acquisition
+ * thread runs the schedule, so it is atomic. cur_period and next_due belong
+ * to whoever runs the schedule.
+ */
+struct acq_channel {
+    _Atomic int64_t period; /* nanoseconds, 0 disables the channel */
+    int64_t  cur_period;    /* period next_due was calculated from */
+    int64_t  next_due;      /* CLOCK_MONOTONIC, nanoseconds */
+    __s32    window[ACQ_WINDOW_MAX];
+    int      n;
+    int      shift;         /* window keeps one sample in 1 << shift */
+    int      skip;          /* samples passed over since the last kept */
+    __s32    last;          /* latest sample, kept or not */
+    uint64_t samples;
+};
+
+struct acquisition {
+    struct evcore_source timer;
+    bool               threaded;    /* schedule run by acquisition thread */
+    struct acq_channel ch[SENSOR_CHANNELS];
+    struct rollup_set *rollup;      /* fed with every sample if set */
+    uint64_t           transactions;
+    uint64_t           errors;
+};
+
+extern int acquire_init (struct acquisition *, struct evcore *);
+
+extern void acquire_free (struct acquisition *);
+
+/* Change the cadence of a channel, takes effect from the next read */
+extern void acquire_set_period (struct acquisition *, enum sensor_channel,
+                                int64_t);
+
+/* Return the channels that are due at now and advance their deadlines */
+extern unsigned acquire_due (struct acquisition *, int64_t);
+
+/* Time by which the read of the due channels must be done, before the
+   fastest of them is due again */
+extern int64_t acquire_deadline (const struct acquisition *, unsigned,
+                                 int64_t);
+
+/* Earliest deadline of all channels, INT64_MAX if all are disabled */
+extern int64_t acquire_next_due (const struct acquisition *);
+
+/* Append a sample to the windows of the channels it has data for. A full
+   window drops every other sample and keeps only every second one from
+   then on, so it still spans the whole report period. */
+extern void acquire_store (struct acquisition *, const struct SensorSample *);
+
+/* Read the channels in mask right away, from the event loop. The sample
+   goes into the windows like a scheduled one, so the conversions it takes
+   away from the next scheduled read still make it into the report.
+   Channels without a new conversion come back with their latest sample. */
+extern int acquire_read_now (struct acquisition *, unsigned,
+                             struct SensorSample *);
+
+/* Aggregate the samples collected since the last call into data and start a
+   new window. Returns a mask of the channels that had samples. */
+extern unsigned acquire_publish (struct acquisition *, struct SensorData *);
+
+#endif /* _ACQUIRE_H_ */
@@ -0,0 +1,182 @@
+/*
+ *  adaptive.c
+ *    Adaptive sampling controller that scales the cadence and on-chip
+ *    averaging of each channel with its observed variance
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "adaptive.h"
+
+/*
+ * Sampling levels per channel ordered from cheapest to most expensive. The
+ * averaging modes of level 2 are what sensors_init configures. Pressure is
+ * sampled fast to catch transients from door slams and wind, at most at the
+ * ODR of 12.5 Hz. The HTS221 is slow to respond so humidity and temperature
+ * are read less often.
+ */
+static const struct adaptive_params levels[SENSOR_CHANNELS][ADAPTIVE_LEVELS] = {
+    [SENSOR_PRESSURE]    = { { 1000, 0 }, {  400, 1 }, {  200, 3 }, {   80, 3 } },
+    [SENSOR_TEMPERATURE] = { { 5000, 1 }, { 2000, 2 }, { 1000, 3 }, {  500, 4 } },
+    [SENSOR_HUMIDITY]    = { {10000, 1 }, { 5000, 2 }, { 2500, 3 }, { 1000, 4 } }
+};
+
+/*
+ * Thresholds per channel. A window whose noise exceeds noise_thr or whose
+ * median moves more than change_thr is considered active. Values are chosen
+ * from the sensor accuracy in the datasheets: LPS25H ±0.2 hPa (DM00116291
+ * table 3), HTS221 ±0.5 °C and ±3.5 %rH (DM00066332 table 3).
+ */
+static const struct {
+    float noise_thr;
+    float change_thr;
+} thresholds[SENSOR_CHANNELS] = {
+    [SENSOR_PRESSURE]    = { 0.05f, 0.15f },  /* hPa */
+    [SENSOR_TEMPERATURE] = { 0.10f, 0.20f },  /* °C */
+    [SENSOR_HUMIDITY]    = { 0.40f, 1.00f }   /* %rH */
+};
+
+void
+adaptive_init (struct adaptive_ctl *ctl)
+{
+    int ch;
+
+    memset (ctl, 0, sizeof (*ctl));
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+        ctl->ch[ch].level = ADAPTIVE_DEFAULT_LEVEL;
+}
+
+/* Calculate activity score of a channel from its newest window */
+static float
+channel_score (struct adaptive_channel *ch, int channel, float value,
+               float sd)
+{
+    float mean, var, delta;
+    int ii, last;
+
+    if (ch->n_history == 0)
+        ch->noise = sd;
+    else
+        ch->noise = ch->noise * 0.75f + sd * 0.25f;
+
+    delta = 0.0f;
+    if (ch->n_history > 0)
+      {
+        last = (ch->next + ADAPTIVE_HISTORY - 1) % ADAPTIVE_HISTORY;
+        delta = fabsf (value - ch->history[last]);
+      }
+
+    ch->history[ch->next] = value;
+    ch->next = (ch->next + 1) % ADAPTIVE_HISTORY;
+    if (ch->n_history < ADAPTIVE_HISTORY)
+        ch->n_history++;
+
+    /* Variance of the window medians, captures slow trends that never show
+       up as a big change between two consecutive windows */
+    mean = 0.0f;
+    for (ii = 0; ii < ch->n_history; ii++)
+        mean += ch->history[ii];
+    mean /= ch->n_history;
+    var = 0.0f;
+    for (ii = 0; ii < ch->n_history; ii++)
+        var += (ch->history[ii] - mean) * (ch->history[ii] - mean);
+    if (ch->n_history > 1)
+        var /= ch->n_history - 1;
+
+    ch->score = fmaxf (ch->noise / thresholds[channel].noise_thr,
+                       fmaxf (sqrtf (var), delta) /
+                       thresholds[channel].change_thr);
+    return ch->score;
+}
+
+/* Step up immediately when something happens, jump straight to the highest
+   level if it is a large change. Step down slowly. */
+static bool
+channel_level (struct adaptive_channel *ch, float score)
+{
+    int old_level = ch->level;
+
+    if (score > 2.0f)
+      {
+        ch->level = ADAPTIVE_LEVELS - 1;
+        ch->stable_windows = 0;
+      }
+    else if (score > 1.0f)
+      {
+        if (ch->level < ADAPTIVE_LEVELS - 1)
+            ch->level++;
+        ch->stable_windows = 0;
+      }
+    else if (score < 0.5f)
+      {
+        if (++ch->stable_windows >= ADAPTIVE_STABLE_WINDOWS)
+          {
+            if (ch->level > 0)
+                ch->level--;
+            ch->stable_windows = 0;
+          }
+      }
+    else
+      {
+        ch->stable_windows = 0;
+      }
+
+    return ch->level != old_level;
+}
+
+unsigned
+adaptive_update (struct adaptive_ctl *ctl, const struct SensorData *data,
+                 unsigned mask)
+{
+    const float value[SENSOR_CHANNELS] = {
+        [SENSOR_PRESSURE]    = data->pressure,
+        [SENSOR_TEMPERATURE] = data->temperature,
+        [SENSOR_HUMIDITY]    = data->humidity
+    };
+    const float sd[SENSOR_CHANNELS] = {
+        [SENSOR_PRESSURE]    = data->pressure_sd,
+        [SENSOR_TEMPERATURE] = data->temperature_sd,
+        [SENSOR_HUMIDITY]    = data->humidity_sd
+    };
+    unsigned changed;
+    float score;
+    int ch;
+
+    changed = 0;
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (!(mask & SENSOR_BIT(ch)))
+            continue;
+
+        score = channel_score (&ctl->ch[ch], ch, value[ch], sd[ch]);
+        if (channel_level (&ctl->ch[ch], score))
+            changed |= SENSOR_BIT(ch);
+      }
+
+    return changed;
+}
+
+const struct adaptive_params *
+adaptive_params (const struct adaptive_ctl *ctl, enum sensor_channel channel)
+{
+    return &levels[channel][ctl->ch[channel].level];
+}
@@ -0,0 +1,76 @@
+/*
+ *  adaptive.h
+ *    Adaptive sampling controller that scales the cadence and on-chip
+ *    averaging of each channel with its observed variance
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _ADAPTIVE_H_
+#define _ADAPTIVE_H_
+
+#include <stdbool.h>
+
+#include "sensors.h"
+
+/* Number of sampling levels, level 0 is the cheapest and the last level
+   samples most often with the highest on-chip averaging */
+#define ADAPTIVE_LEVELS 4
+
+/* Level used until enough windows have been observed */
+#define ADAPTIVE_DEFAULT_LEVEL 2
+
+/* Number of recent window medians the variance is calculated over */
+#define ADAPTIVE_HISTORY 6
+
+/* Number of consecutive stable windows required before stepping down */
+#define ADAPTIVE_STABLE_WINDOWS 6
+
+/* Per-channel state tracked over recent windows */
+struct adaptive_channel {
+    int   level;
+    int   stable_windows;
+    float history[ADAPTIVE_HISTORY];
+    int   n_history;
+    int   next;
+    float noise;        /* EWMA of within-window standard deviation */
+    float score;        /* activity score of the latest window */
+};
+
+struct adaptive_ctl {
+    struct adaptive_channel ch[SENSOR_CHANNELS];
+};
+
+/* Sampling parameters that belong to a level of a channel */
+struct adaptive_params {
+    int period_ms;
+    int avg;    /* on-chip averaging mode, AVGP, AVGT or AVGH */
+};
+
+extern void adaptive_init (struct adaptive_ctl *);
+
+/* Feed the result of a window to the controller, mask tells which channels
+   had samples. Returns a mask of the channels whose level changed. */
+extern unsigned adaptive_update (struct adaptive_ctl *,
+                                 const struct SensorData *, unsigned);
+
+extern const struct adaptive_params *adaptive_params (
+                        const struct adaptive_ctl *, enum sensor_channel);
+
+#endif /* _ADAPTIVE_H_ */
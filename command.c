@@ -0,0 +1,102 @@
+/*
+ *  command.c
+ *    Commands from the master, handed from the fgevents thread to the event
+ *    loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "command.h"
+#include "log.h"
+
+int
+command_queue_init (struct command_queue *q, struct evcore *core,
+                    evcore_cb cb, void *arg)
+{
+    memset (q, 0, sizeof (*q));
+    pthread_mutex_init (&q->lock, NULL);
+
+    return evcore_wakeup_init (&q->wake, core, cb, arg);
+}
+
+void
+command_queue_free (struct command_queue *q)
+{
+    if (!q->wake.ev)
+        return;
+
+    evcore_source_free (&q->wake);
+    pthread_mutex_destroy (&q->lock);
+}
+
+int
+command_queue_push (struct command_queue *q, const struct fgevent *fgev)
+{
+    struct slave_command *cmd;
+    int ii;
+
+    if (!q->wake.ev)
+      {
+        errno = EAGAIN;
+        return -1;
+      }
+
+    pthread_mutex_lock (&q->lock);
+    if (q->n == COMMAND_QUEUE_SIZE)
+      {
+        q->dropped++;
+        pthread_mutex_unlock (&q->lock);
+        errno = ENOBUFS;
+        return -1;
+      }
+
+    cmd = &q->cmd[(q->head + q->n) % COMMAND_QUEUE_SIZE];
+    cmd->id = fgev->id;
+    cmd->n = fgev->length < COMMAND_MAX_ARGS ? fgev->length : COMMAND_MAX_ARGS;
+    if (cmd->n < 0)
+        cmd->n = 0;
+    for (ii = 0; ii < cmd->n; ii++)
+        cmd->args[ii] = fgev->payload[ii];
+    q->n++;
+    pthread_mutex_unlock (&q->lock);
+
+    evcore_wakeup (&q->wake);
+    return 0;
+}
+
+bool
+command_queue_pop (struct command_queue *q, struct slave_command *cmd)
+{
+    bool res = false;
+
+    pthread_mutex_lock (&q->lock);
+    if (q->n)
+      {
+        *cmd = q->cmd[q->head];
+        q->head = (q->head + 1) % COMMAND_QUEUE_SIZE;
+        q->n--;
+        res = true;
+      }
+    pthread_mutex_unlock (&q->lock);
+
+    return res;
+}
@@ -0,0 +1,124 @@
+/*
+ *  command.h
+ *    Commands from the master, handed from the fgevents thread to the event
+ *    loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+#include <fgevents.h>
+
+#include "evcore.h"
+
+/*
+ * Command events sent by the master to a slave. They are defined here
+ * until events.h has them.
+ *   FG_SLAVE_BURST       [seconds, period ms] sample every channel at period
+ *                        (0 = fastest) for seconds, 0 seconds ends a burst
+ *   FG_SLAVE_SET_PERIOD  [seconds] report period
+ *   FG_SLAVE_SET_WINDOW  [channel, period ms]... sample cadence within the
+ *                        report window, 0 hands the channel back to the
+ *                        adaptive controller
+ *   FG_SLAVE_READ_NOW    [] take a reading and send it right away
+ *   FG_SLAVE_SUBSCRIBE   [channel, period ms]... channels the master wants
+ *                        reported with the longest sample period it accepts,
+ *                        0 for any and -1 to unsubscribe, channel 3 being
+ *                        the outdoor temperature
+ *   FG_SLAVE_HISTORY     [channel, tier, n] the latest n (at most
+ *                        COMMAND_MAX_HISTORY) rollup buckets of a channel,
+ *                        tier 0 being seconds, 1 minutes and 2 hours,
+ *                        answered with FG_SENSOR_HISTORY events
+ *
+ * FG_SENSOR_HISTORY carries [channel, tier, buckets in this event, buckets
+ * in the events still to come] followed by start (CLOCK_REALTIME seconds),
+ * min, mean and max in tenths of the unit of each bucket, oldest first.
+ */
+#ifndef FG_SLAVE_BURST
+#define FG_SLAVE_BURST 65
+#endif
+#ifndef FG_SLAVE_SET_PERIOD
+#define FG_SLAVE_SET_PERIOD 66
+#endif
+#ifndef FG_SLAVE_SET_WINDOW
+#define FG_SLAVE_SET_WINDOW 67
+#endif
+#ifndef FG_SLAVE_READ_NOW
+#define FG_SLAVE_READ_NOW 68
+#endif
+#ifndef FG_SLAVE_SUBSCRIBE
+#define FG_SLAVE_SUBSCRIBE 72
+#endif
+#ifndef FG_SLAVE_HISTORY
+#define FG_SLAVE_HISTORY 73
+#endif
+#ifndef FG_SENSOR_HISTORY
+#define FG_SENSOR_HISTORY 74
+#endif
+
+/* Limits applied to command arguments */
+#define COMMAND_MIN_PERIOD_MS    80     /* fastest output data rate */
+#define COMMAND_MAX_BURST_S      600
+#define COMMAND_MAX_REPORT_S     3600
+#define COMMAND_MAX_HISTORY      24     /* buckets, eight events */
+
+/* Buckets in a FG_SENSOR_HISTORY event */
+#define HISTORY_PER_EVENT 3
+
+#define COMMAND_QUEUE_SIZE 16
+#define COMMAND_MAX_ARGS   8      /* a subscription to every channel */
+
+struct slave_command {
+    int32_t id;
+    int     n;
+    int32_t args[COMMAND_MAX_ARGS];
+};
+
+/* Commands are queued by the fgevents thread and the loop is woken up to
+   run them, so none of the loop's state is touched from another thread */
+struct command_queue {
+    pthread_mutex_t      lock;
+    struct slave_command cmd[COMMAND_QUEUE_SIZE];
+    int                  head;
+    int                  n;
+    struct evcore_source wake;
+    uint64_t             dropped;
+};
+
+extern int command_queue_init (struct command_queue *, struct evcore *,
+                               evcore_cb, void *);
+
+extern void command_queue_free (struct command_queue *);
+
+/* Queue a command event, may be called from any thread */
+extern int command_queue_push (struct command_queue *,
+                               const struct fgevent *);
+
+/* Take the oldest queued command, returns false if there is none */
+extern bool command_queue_pop (struct command_queue *,
+                               struct slave_command *);
+
+#endif /* _COMMAND_H_ */
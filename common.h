@@ -30,9 +30,12 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <errno.h>
+#include <time.h>
 
 #include <fgevents.h>
 
+#include "vclock.h"
+
 /* Define _GNU_SOURCE for pthread_timedjoin_np and asprintf */
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
@@ -45,6 +48,9 @@
 
 #define MAX_TEMP_AGE 10
 
+#define NSEC_PER_SEC INT64_C(1000000000)
+#define NSEC_PER_MSEC INT64_C(1000000)
+
 /* Temporary defs before config file is setup */
 #define MASTER_IP "10.0.1.1"
 #define MASTER_PORT 1337
@@ -53,12 +59,17 @@
    To be initialized by main(). */
 extern const char *__progname;
 
-/* Common data structure used by threads */
-struct thread_data {
-    struct fg_events_data etdata;
-    bool 				  valid_temp;
-    int32_t				  fetched_temp;
-    size_t 				  c_invalidate_temp;
-};
+/* Read a clock in nanoseconds, in virtual time after vclock_start */
+static inline int64_t
+clock_ns (clockid_t clk)
+{
+    struct timespec ts;
+
+    if (vclock_enabled)
+        return vclock_now (clk);
+
+    clock_gettime (clk, &ts);
+    return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
 #endif /* _COMMON_H_ */
\ No newline at end of file
@@ -0,0 +1,305 @@
+/*
+ *  emubus.c
+ *    Emulated LPS25H and HTS221 answering in place of the i2c bus, for
+ *    running the full report cycle without a sense-hat
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "LPS25H.h"
+#include "HTS221.h"
+#include "emubus.h"
+
+/* Both sensors auto-increment with the same bit and use 7 bit registers */
+#define EMU_REG_AUTO 0x80
+#define EMU_REGS     0x80
+
+struct emu_dev {
+    int     addr;
+    uint8_t reg;        /* register pointer */
+    bool    autoinc;
+    uint8_t regs[EMU_REGS];
+};
+
+struct emu_fd {
+    int  fd;            /* -1 when the slot is free */
+    int  addr;
+    bool failing;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    bool            ready;
+    unsigned        fail_opens;
+    unsigned        seed;
+    int32_t         pressure, temperature, humidity;   /* true values */
+    struct emu_dev  dev[2];
+    struct emu_fd   fds[EMUBUS_MAX_FDS];
+} emu = { PTHREAD_MUTEX_INITIALIZER, false, 0, 1, 0, 0, 0, { { 0 } },
+          { { 0 } } };
+
+static void
+put_le16 (uint8_t *p, int32_t v)
+{
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+/* Power-on state, caller holds emu.lock */
+static void
+emu_reset (void)
+{
+    struct emu_dev *lps = &emu.dev[0], *hts = &emu.dev[1];
+    int ii;
+
+    memset (emu.dev, 0, sizeof (emu.dev));
+    for (ii = 0; ii < EMUBUS_MAX_FDS; ii++)
+        emu.fds[ii].fd = -1;
+
+    lps->addr = LPS25H_SAD;
+    lps->regs[LPS25H_WHO_AM_I] = LPS25H_who_am_i;
+
+    /* 10 and 30 degC at 0 and 1000 counts, 20 and 70 %rH at 0 and 10000 */
+    hts->addr = HTS221_SAD;
+    hts->regs[HTS221_WHO_AM_I] = HTS221_who_am_i;
+    hts->regs[HTS221_CAL_H0_rH_x2] = 40;
+    hts->regs[HTS221_CAL_H1_rH_x2] = 140;
+    hts->regs[HTS221_CAL_T0_degC_x8] = 80;
+    hts->regs[HTS221_CAL_T1_degC_x8] = 240;
+    hts->regs[HTS221_CAL_T1_T0_msb] = 0;
+    put_le16 (&hts->regs[HTS221_CAL_H0_T0_OUT], 0);
+    put_le16 (&hts->regs[HTS221_CAL_H1_T0_OUT], 10000);
+    put_le16 (&hts->regs[HTS221_CAL_T0_OUT], 0);
+    put_le16 (&hts->regs[HTS221_CAL_T1_OUT], 1000);
+
+    emu.pressure = 1013 * 4096;
+    emu.temperature = 500;
+    emu.humidity = 6000;
+    emu.ready = true;
+}
+
+/* Conversion noise within step counts of v */
+static int32_t
+jitter (int32_t v, int step)
+{
+    return v + (int32_t) (rand_r (&emu.seed) % (2 * step + 1)) - step;
+}
+
+/* A new conversion on every read of the output registers while powered up,
+   both sensors have the power bit in the same place */
+static void
+emu_convert (struct emu_dev *dev)
+{
+    int32_t p;
+
+    if (!(dev->regs[LPS25H_CTRL_REG1] & LPS25H_CTRL_REG1_PD_if(1)))
+      {
+        dev->regs[LPS25H_STATUS_REG] = 0;
+        return;
+      }
+
+    if (dev->addr == LPS25H_SAD)
+      {
+        p = jitter (emu.pressure, 40);
+        dev->regs[LPS25H_STATUS_REG] = 0x03;
+        dev->regs[LPS25H_PRESS_POUT] = (uint8_t) p;
+        dev->regs[LPS25H_PRESS_POUT + 1] = (uint8_t) (p >> 8);
+        dev->regs[LPS25H_PRESS_POUT + 2] = (uint8_t) (p >> 16);
+      }
+    else
+      {
+        dev->regs[HTS221_STATUS_REG] = 0x03;
+        put_le16 (&dev->regs[HTS221_HUMIDITY_OUT], jitter (emu.humidity, 5));
+        put_le16 (&dev->regs[HTS221_TEMP_OUT], jitter (emu.temperature, 3));
+      }
+}
+
+/* Caller holds emu.lock */
+static struct emu_fd *
+emu_fd (int fd)
+{
+    int ii;
+
+    for (ii = 0; emu.ready && fd >= 0 && ii < EMUBUS_MAX_FDS; ii++)
+      {
+        if (emu.fds[ii].fd == fd)
+            return &emu.fds[ii];
+      }
+
+    errno = EBADF;
+    return NULL;
+}
+
+/* Device addressed on fd or NULL with errno set, caller holds emu.lock */
+static struct emu_dev *
+emu_dev (int fd)
+{
+    struct emu_fd *f;
+    int ii;
+
+    if (!(f = emu_fd (fd)))
+        return NULL;
+
+    for (ii = 0; !f->failing && ii < 2; ii++)
+      {
+        if (emu.dev[ii].addr == f->addr)
+            return &emu.dev[ii];
+      }
+
+    errno = EREMOTEIO;
+    return NULL;
+}
+
+void
+emubus_fail_opens (unsigned n)
+{
+    pthread_mutex_lock (&emu.lock);
+    emu.fail_opens = n;
+    pthread_mutex_unlock (&emu.lock);
+}
+
+int
+emubus_open (void)
+{
+    struct emu_fd *f = NULL;
+    int fd, ii;
+
+    fd = open ("/dev/null", O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock (&emu.lock);
+    if (!emu.ready)
+        emu_reset ();
+    for (ii = 0; !f && ii < EMUBUS_MAX_FDS; ii++)
+      {
+        if (emu.fds[ii].fd < 0)
+            f = &emu.fds[ii];
+      }
+    if (!f)
+      {
+        pthread_mutex_unlock (&emu.lock);
+        close (fd);
+        errno = EMFILE;
+        return -1;
+      }
+    f->fd = fd;
+    f->addr = -1;
+    f->failing = emu.fail_opens > 0;
+    if (f->failing)
+        emu.fail_opens--;
+    pthread_mutex_unlock (&emu.lock);
+
+    return fd;
+}
+
+int
+emubus_set_slave (int fd, int addr)
+{
+    struct emu_fd *f;
+
+    pthread_mutex_lock (&emu.lock);
+    if ((f = emu_fd (fd)))
+        f->addr = addr;
+    pthread_mutex_unlock (&emu.lock);
+
+    return f ? 0 : -1;
+}
+
+ssize_t
+emubus_write (int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    struct emu_dev *dev;
+    size_t ii;
+
+    if (len == 0)
+        return 0;
+
+    pthread_mutex_lock (&emu.lock);
+    if (!(dev = emu_dev (fd)))
+      {
+        pthread_mutex_unlock (&emu.lock);
+        return -1;
+      }
+
+    /* The first byte sets the register pointer, the rest are stored */
+    dev->autoinc = (p[0] & EMU_REG_AUTO) != 0;
+    dev->reg = p[0] & ~EMU_REG_AUTO;
+    for (ii = 1; ii < len; ii++)
+      {
+        dev->regs[dev->reg] = p[ii];
+        if (dev->autoinc)
+            dev->reg = (dev->reg + 1) % EMU_REGS;
+      }
+    pthread_mutex_unlock (&emu.lock);
+
+    return (ssize_t) len;
+}
+
+ssize_t
+emubus_read (int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    struct emu_dev *dev;
+    size_t ii;
+
+    pthread_mutex_lock (&emu.lock);
+    if (!(dev = emu_dev (fd)))
+      {
+        pthread_mutex_unlock (&emu.lock);
+        return -1;
+      }
+
+    /* Output registers start right after status at 0x28 on both */
+    if (dev->reg <= LPS25H_PRESS_POUT && dev->reg + len > LPS25H_PRESS_POUT)
+        emu_convert (dev);
+
+    for (ii = 0; ii < len; ii++)
+      {
+        p[ii] = dev->regs[dev->reg];
+        if (dev->autoinc)
+            dev->reg = (dev->reg + 1) % EMU_REGS;
+      }
+    pthread_mutex_unlock (&emu.lock);
+
+    return (ssize_t) len;
+}
+
+int
+emubus_close (int fd)
+{
+    struct emu_fd *f;
+
+    pthread_mutex_lock (&emu.lock);
+    if ((f = emu_fd (fd)))
+        f->fd = -1;
+    pthread_mutex_unlock (&emu.lock);
+
+    return close (fd);
+}
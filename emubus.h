@@ -0,0 +1,52 @@
+/*
+ *  emubus.h
+ *    Emulated LPS25H and HTS221 answering in place of the i2c bus, for
+ *    running the full report cycle without a sense-hat
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _EMUBUS_H_
+#define _EMUBUS_H_
+
+#include <sys/types.h>
+
+/* Descriptors that can be open on the emulated bus at the same time, far
+   more than the sensors need so that leaked ones pile up */
+#define EMUBUS_MAX_FDS 1024
+
+/*
+ * Each descriptor is backed by a real one so that leaks show up like they
+ * would on the device. The sensors keep their register contents across
+ * opens. Readings are noisy but steady at 1013 hPa, 20 degC and 50 %rH,
+ * and the status registers always report new data.
+ */
+
+/* Let the sensors NACK everything on the next n descriptors opened, as
+   they do when the sense-hat is not seated properly */
+extern void emubus_fail_opens (unsigned);
+
+/* Same semantics as the i2c_* calls in i2cbus.h */
+extern int emubus_open (void);
+extern int emubus_set_slave (int, int);
+extern ssize_t emubus_write (int, const void *, size_t);
+extern ssize_t emubus_read (int, void *, size_t);
+extern int emubus_close (int);
+
+#endif /* _EMUBUS_H_ */
@@ -0,0 +1,366 @@
+/*
+ *  evcore.c
+ *    Event core that multiplexes signals, timers and cross-thread wakeups as
+ *    signalfd, timerfd and eventfd sources on the event loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "evcore.h"
+#include "common.h"
+#include "log.h"
+
+static const char *kind_names[EVCORE_KINDS] = {
+    [EVCORE_SIGNAL] = "signal",
+    [EVCORE_TIMER]  = "timer",
+    [EVCORE_WAKEUP] = "wakeup"
+};
+
+/* Read whatever woke the source up and hand it to the callback */
+static void
+source_cb (evutil_socket_t fd, short UNUSED(what), void *arg)
+{
+    struct evcore_source *src = arg;
+    struct signalfd_siginfo si;
+    uint64_t n;
+
+    if (src->kind == EVCORE_SIGNAL)
+      {
+        if (read (fd, &si, sizeof (si)) != sizeof (si))
+            return;
+        n = si.ssi_signo;
+      }
+    else if (read (fd, &n, sizeof (n)) != sizeof (n))
+      {
+        /* Someone else already consumed it, or a timer was re-armed */
+        if (errno != EAGAIN)
+            log_error ("read event source failed");
+        return;
+      }
+
+    src->core->total.dispatched[src->kind]++;
+    src->cb (n, src->arg);
+}
+
+static int
+source_init (struct evcore_source *src, struct evcore *core,
+             enum evcore_kind kind, int fd, evcore_cb cb, void *arg)
+{
+    memset (src, 0, sizeof (*src));
+    src->core = core;
+    src->kind = kind;
+    src->fd = fd;
+    src->cb = cb;
+    src->arg = arg;
+
+    if (fd < 0)
+      {
+        log_error ("could not create event source");
+        return -1;
+      }
+
+    src->ev = event_new (core->base, fd, EV_READ | EV_PERSIST, source_cb, src);
+    if (!src->ev || event_add (src->ev, NULL) < 0)
+      {
+        log_error ("could not create/add event source");
+        evcore_source_free (src);
+        return -1;
+      }
+
+    return 0;
+}
+
+void
+evcore_source_free (struct evcore_source *src)
+{
+    struct evcore_source **pp;
+
+    /* A zeroed source was never set up, its fd 0 is not ours */
+    if (!src->core)
+        return;
+
+    if (src->kind == EVCORE_TIMER)
+      {
+        for (pp = &src->core->timers; *pp; pp = &(*pp)->next)
+          {
+            if (*pp == src)
+              {
+                *pp = src->next;
+                break;
+              }
+          }
+      }
+
+    if (src->ev)
+        event_free (src->ev);
+    if (src->fd >= 0)
+        close (src->fd);
+    src->ev = NULL;
+    src->fd = -1;
+    src->core = NULL;
+}
+
+int
+evcore_signals (struct evcore_source *src, struct evcore *core, evcore_cb cb,
+                void *arg)
+{
+    static const int signals[] = { SIGINT, SIGHUP, SIGTERM };
+    struct sigaction old_action;
+    sigset_t mask;
+    size_t ii;
+
+    /* Handle termination signals but avoid handling signals previously set
+       to be ignored */
+    sigemptyset (&mask);
+    for (ii = 0; ii < sizeof (signals) / sizeof (signals[0]); ii++)
+      {
+        sigaction (signals[ii], NULL, &old_action);
+        if (old_action.sa_handler != SIG_IGN)
+            sigaddset (&mask, signals[ii]);
+      }
+
+    /* Blocked signals stay pending until read from the signalfd, threads
+       created later inherit the mask so none of them is interrupted */
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+    return source_init (src, core, EVCORE_SIGNAL,
+                        signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC), cb,
+                        arg);
+}
+
+int
+evcore_timer_init (struct evcore_source *src, struct evcore *core,
+                   evcore_cb cb, void *arg)
+{
+    if (source_init (src, core, EVCORE_TIMER,
+                     timerfd_create (CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC), cb, arg) < 0)
+        return -1;
+
+    src->next = core->timers;
+    core->timers = src;
+    return 0;
+}
+
+int
+evcore_timer_set (struct evcore_source *src, int64_t first, int64_t interval)
+{
+    struct itimerspec its;
+
+    src->deadline = first;
+    src->interval = interval;
+
+    /* The loop fires it when virtual time gets there */
+    if (vclock_enabled)
+        return 0;
+
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = first / NSEC_PER_SEC;
+    its.it_value.tv_nsec = first % NSEC_PER_SEC;
+    its.it_interval.tv_sec = interval / NSEC_PER_SEC;
+    its.it_interval.tv_nsec = interval % NSEC_PER_SEC;
+
+    /* A deadline of exactly 0 would disarm the timer, make it expire */
+    if (first && !its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+
+    if (timerfd_settime (src->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      {
+        log_error ("timerfd_settime failed");
+        return -1;
+      }
+
+    return 0;
+}
+
+int
+evcore_wakeup_init (struct evcore_source *src, struct evcore *core,
+                    evcore_cb cb, void *arg)
+{
+    return source_init (src, core, EVCORE_WAKEUP,
+                        eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC), cb, arg);
+}
+
+void
+evcore_wakeup (struct evcore_source *src)
+{
+    uint64_t one = 1;
+    int save_errno = errno;
+
+    /* Posts made before the loop gets to run add up in the counter and are
+       delivered as one callback */
+    __atomic_fetch_add (&src->core->total.posted, 1, __ATOMIC_RELAXED);
+    if (write (src->fd, &one, sizeof (one)) < 0)
+      {
+        /* Only fails if the counter is saturated, which wakes us anyway */
+      }
+    errno = save_errno;
+}
+
+static void
+stats_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct evcore *core = arg;
+    struct evcore_stats *t = &core->total, *l = &core->last;
+    uint64_t posted;
+
+    posted = __atomic_load_n (&t->posted, __ATOMIC_RELAXED);
+    _log_debug ("wakeups in the last %d s: %" PRIu64 " (%s %" PRIu64
+                ", %s %" PRIu64 ", %s %" PRIu64 " for %" PRIu64 " posts)\n",
+                EVCORE_STATS_INTERVAL, t->loops - l->loops,
+                kind_names[EVCORE_TIMER],
+                t->dispatched[EVCORE_TIMER] - l->dispatched[EVCORE_TIMER],
+                kind_names[EVCORE_SIGNAL],
+                t->dispatched[EVCORE_SIGNAL] - l->dispatched[EVCORE_SIGNAL],
+                kind_names[EVCORE_WAKEUP],
+                t->dispatched[EVCORE_WAKEUP] - l->dispatched[EVCORE_WAKEUP],
+                posted - l->posted);
+
+    *l = *t;
+    l->posted = posted;
+}
+
+/* Only there to get the loop going again, see evcore_release */
+static void
+resume_cb (uint64_t UNUSED(n), void *UNUSED(arg))
+{
+}
+
+int
+evcore_init (struct evcore *core, struct event_base *base)
+{
+    int64_t interval = EVCORE_STATS_INTERVAL * NSEC_PER_SEC;
+
+    memset (core, 0, sizeof (*core));
+    core->base = base;
+
+    if (evcore_timer_init (&core->stats_timer, core, stats_cb, core) < 0 ||
+        evcore_wakeup_init (&core->resume, core, resume_cb, core) < 0)
+        return -1;
+
+    return evcore_timer_set (&core->stats_timer,
+                             clock_ns (CLOCK_MONOTONIC) + interval, interval);
+}
+
+void
+evcore_free (struct evcore *core)
+{
+    evcore_source_free (&core->stats_timer);
+    evcore_source_free (&core->resume);
+}
+
+void
+evcore_set_horizon (struct evcore *core, int64_t t)
+{
+    core->horizon = t;
+}
+
+void
+evcore_hold (struct evcore *core)
+{
+    atomic_fetch_add (&core->holds, 1);
+}
+
+void
+evcore_release (struct evcore *core)
+{
+    /* The loop may be blocked waiting for the holder */
+    if (atomic_fetch_sub (&core->holds, 1) == 1)
+        evcore_wakeup (&core->resume);
+}
+
+/* Advance virtual time to the first timer due and run it. Returns false
+   if there is none before the horizon. */
+static bool
+fire_timer (struct evcore *core)
+{
+    struct evcore_source *src, *first = NULL;
+    uint64_t n;
+    int64_t now;
+
+    for (src = core->timers; src; src = src->next)
+      {
+        if (src->deadline && (!first || src->deadline < first->deadline))
+            first = src;
+      }
+    if (!first || (core->horizon && first->deadline > core->horizon))
+        return false;
+
+    vclock_advance (first->deadline);
+    now = clock_ns (CLOCK_MONOTONIC);
+
+    /* Expirations missed while a callback moved time further count too */
+    n = 1;
+    if (first->interval)
+      {
+        n = (now - first->deadline) / first->interval + 1;
+        first->deadline += n * first->interval;
+      }
+    else
+        first->deadline = 0;
+
+    core->total.dispatched[EVCORE_TIMER]++;
+    first->cb (n, first->arg);
+    return true;
+}
+
+void
+evcore_dispatch (struct evcore *core)
+{
+    int res;
+
+    /* Every return from the loop is one wakeup of the process, whatever
+       source caused it, including timers of libevent itself */
+    while (!event_base_got_exit (core->base) &&
+           !event_base_got_break (core->base))
+      {
+        /* Only block for real while waiting for another thread */
+        if (vclock_enabled && !atomic_load (&core->holds))
+          {
+            if (event_base_loop (core->base, EVLOOP_NONBLOCK) < 0)
+              {
+                log_error ("event loop failed");
+                break;
+              }
+            core->total.loops++;
+            if (!event_base_got_exit (core->base) &&
+                !event_base_got_break (core->base) && !fire_timer (core))
+                break;
+            continue;
+          }
+
+        res = event_base_loop (core->base, EVLOOP_ONCE);
+        if (res < 0)
+          {
+            log_error ("event loop failed");
+            break;
+          }
+        /* No events left */
+        if (res == 1)
+            break;
+        core->total.loops++;
+      }
+}
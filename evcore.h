@@ -0,0 +1,127 @@
+/*
+ *  evcore.h
+ *    Event core that multiplexes signals, timers and cross-thread wakeups as
+ *    signalfd, timerfd and eventfd sources on the event loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _EVCORE_H_
+#define _EVCORE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+/* Report wakeup statistics every this many seconds */
+#define EVCORE_STATS_INTERVAL 60
+
+enum evcore_kind {
+    EVCORE_SIGNAL,
+    EVCORE_TIMER,
+    EVCORE_WAKEUP,
+    EVCORE_KINDS
+};
+
+/*
+ * Called with the number of expirations of a timer, the number of wakeups
+ * posted since the last call for a wakeup source (several posts coalesce
+ * into a single call) or the signal number for a signal source.
+ */
+typedef void (*evcore_cb) (uint64_t, void *);
+
+struct evcore;
+
+struct evcore_source {
+    struct evcore   *core;
+    enum evcore_kind kind;
+    int              fd;
+    struct event    *ev;
+    evcore_cb        cb;
+    void            *arg;
+    int64_t          deadline;  /* timers, 0 = disarmed */
+    int64_t          interval;
+    struct evcore_source *next; /* timers of the core */
+};
+
+struct evcore_stats {
+    uint64_t loops;                     /* returns from epoll_wait */
+    uint64_t dispatched[EVCORE_KINDS];  /* callbacks of our sources */
+    uint64_t posted;                    /* evcore_wakeup calls */
+};
+
+struct evcore {
+    struct event_base   *base;
+    struct evcore_source stats_timer;
+    struct evcore_source resume;        /* posted when the last hold goes */
+    struct evcore_stats  total;
+    struct evcore_stats  last;          /* total at the previous report */
+    struct evcore_source *timers;
+    atomic_int           holds;         /* see evcore_hold */
+    int64_t              horizon;       /* virtual time to stop at */
+};
+
+extern int evcore_init (struct evcore *, struct event_base *);
+
+extern void evcore_free (struct evcore *);
+
+/*
+ * Run the event loop until it is told to exit, counting every wakeup. In
+ * virtual time (see vclock.h) the loop handles whatever is ready and then
+ * advances the clock straight to the first timer due, until no timer is
+ * due before the horizon.
+ */
+extern void evcore_dispatch (struct evcore *);
+
+/* Exit the loop rather than advance virtual time past CLOCK_MONOTONIC t */
+extern void evcore_set_horizon (struct evcore *, int64_t);
+
+/* Keep virtual time from advancing while another thread works on something
+   the loop has to see first, until the matching evcore_release */
+extern void evcore_hold (struct evcore *);
+extern void evcore_release (struct evcore *);
+
+/*
+ * Deliver SIGINT, SIGHUP and SIGTERM through a signalfd, signals set to be
+ * ignored stay ignored. The signals are blocked in the calling thread, so
+ * this has to be called before any other thread is created.
+ */
+extern int evcore_signals (struct evcore_source *, struct evcore *,
+                           evcore_cb, void *);
+
+extern int evcore_timer_init (struct evcore_source *, struct evcore *,
+                              evcore_cb, void *);
+
+/* Expire at the absolute CLOCK_MONOTONIC time first and then every
+   interval nanoseconds. A first of 0 disarms the timer. */
+extern int evcore_timer_set (struct evcore_source *, int64_t, int64_t);
+
+extern int evcore_wakeup_init (struct evcore_source *, struct evcore *,
+                               evcore_cb, void *);
+
+/* Wake up the loop to run the callback of a wakeup source, may be called
+   from any thread */
+extern void evcore_wakeup (struct evcore_source *);
+
+/* Safe on a zeroed source and on one freed before */
+extern void evcore_source_free (struct evcore_source *);
+
+#endif /* _EVCORE_H_ */
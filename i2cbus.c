@@ -0,0 +1,1037 @@
+/*
+ *  i2cbus.c
+ *    Thin layer over i2c-dev that schedules the drivers sharing the bus, can
+ *    record every transaction to a compact binary trace and replay a trace
+ *    instead of touching the bus
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "i2cbus.h"
+#include "emubus.h"
+#include "sensors.h"
+#include "common.h"
+#include "log.h"
+
+/* Handle given out for the bus while replaying */
+#define I2C_REPLAY_FD INT_MAX
+
+/* Marks from other threads held back while the bus owner records */
+#define I2C_TRACE_PENDING 8
+
+enum i2c_mode {
+    I2C_MODE_DEV,
+    I2C_MODE_RECORD,
+    I2C_MODE_REPLAY,
+    I2C_MODE_EMULATE
+};
+
+static struct {
+    enum i2c_mode          mode;
+    pthread_mutex_t        lock;    /* marks come from several threads */
+    FILE                  *out;
+    unsigned char         *buf;     /* replayed trace */
+    size_t                 len;
+    size_t                 pos;
+    bool                   realtime;
+    int64_t                last;    /* time of previous record */
+    struct i2c_trace_stats stats;
+    FILE                  *file;    /* out while written through a ring */
+    struct uring          *ring;
+    struct uring_file      async;
+    bool                   owned;   /* the bus has an owner */
+    pthread_t              owner;
+    int                    n_pending;
+    struct {
+        enum i2c_trace_op mark;
+        uint32_t          arg;
+    } pending[I2C_TRACE_PENDING];
+    pthread_cond_t         flushed; /* the owner wrote the pending marks */
+} trace = { I2C_MODE_DEV, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0,
+            false, 0, { 0, 0, 0 }, NULL, NULL, { 0 }, false, 0, 0,
+            { { 0, 0 } }, PTHREAD_COND_INITIALIZER };
+
+/* Ring the bus owner runs transactions through, NULL for blocking calls */
+static struct uring *bus_ring;
+
+static void trace_set_owner (bool);
+
+/* ---------------------------------------------------------------------- */
+/*                             Bus scheduler                              */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * The bus may be shared between the event loop, the real-time acquisition
+ * thread and any number of drivers. Whoever owns the bus holds bus_lock.
+ * Waiters queue in order of priority and deadline. Only the head of the
+ * queue blocks on bus_lock, so priority inheritance still keeps a real-time
+ * head from waiting behind a preempted owner. The others wait on the
+ * condition until they are at the head.
+ */
+struct bus_waiter {
+    enum i2c_prio      prio;
+    int64_t            deadline;
+    struct bus_waiter *next;
+};
+
+static pthread_mutex_t bus_lock;
+static pthread_once_t bus_lock_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    pthread_mutex_t      lock;      /* protects everything below */
+    pthread_cond_t       cond;
+    struct bus_waiter   *queue;     /* best first */
+    bool                 claimed;   /* head is blocked on bus_lock */
+    int64_t              start;     /* first use of the bus */
+    int64_t              owned;     /* when the owner got the bus */
+    struct i2c_bus_usage usage;
+    struct {
+        int fd;
+        int addr;                   /* selected slave address, -1 unknown */
+    } selected[I2C_BUS_MAX_FDS];
+} sched = { .lock = PTHREAD_MUTEX_INITIALIZER,
+            .cond = PTHREAD_COND_INITIALIZER };
+
+static void
+bus_lock_init (void)
+{
+    pthread_mutexattr_t attr;
+    int ii;
+
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setprotocol (&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init (&bus_lock, &attr);
+    pthread_mutexattr_destroy (&attr);
+
+    for (ii = 0; ii < I2C_BUS_MAX_FDS; ii++)
+        sched.selected[ii].fd = -1;
+    sched.start = clock_ns (CLOCK_MONOTONIC);
+}
+
+static bool
+waiter_before (const struct bus_waiter *a, const struct bus_waiter *b)
+{
+    if (a->prio != b->prio)
+        return a->prio < b->prio;
+    return a->deadline < b->deadline;
+}
+
+void
+i2c_bus_acquire (enum i2c_prio prio, int64_t deadline)
+{
+    struct bus_waiter w, **pp;
+    struct i2c_bus_usage *u = &sched.usage;
+    int64_t t0, now;
+
+    pthread_once (&bus_lock_once, bus_lock_init);
+
+    t0 = clock_ns (CLOCK_MONOTONIC);
+    w.prio = prio;
+    w.deadline = deadline ? deadline : t0;
+
+    /* Nobody gets ahead of a head that is already taking the bus */
+    pthread_mutex_lock (&sched.lock);
+    pp = &sched.queue;
+    if (sched.claimed)
+        pp = &(*pp)->next;
+    while (*pp && !waiter_before (&w, *pp))
+        pp = &(*pp)->next;
+    w.next = *pp;
+    *pp = &w;
+
+    while (sched.queue != &w || sched.claimed)
+        pthread_cond_wait (&sched.cond, &sched.lock);
+    sched.claimed = true;
+    pthread_mutex_unlock (&sched.lock);
+
+    pthread_mutex_lock (&bus_lock);
+
+    now = clock_ns (CLOCK_MONOTONIC);
+    pthread_mutex_lock (&sched.lock);
+    sched.queue = w.next;
+    sched.claimed = false;
+    sched.owned = now;
+    u->requests[prio]++;
+    u->wait_ns[prio] += now - t0;
+    if ((uint64_t) (now - t0) > u->max_wait_ns[prio])
+        u->max_wait_ns[prio] = now - t0;
+    if (deadline && now > deadline)
+        u->late++;
+    pthread_cond_broadcast (&sched.cond);
+    pthread_mutex_unlock (&sched.lock);
+
+    trace_set_owner (true);
+}
+
+void
+i2c_bus_release (void)
+{
+    trace_set_owner (false);
+
+    pthread_mutex_lock (&sched.lock);
+    sched.usage.busy_ns += clock_ns (CLOCK_MONOTONIC) - sched.owned;
+    pthread_mutex_unlock (&sched.lock);
+
+    pthread_mutex_unlock (&bus_lock);
+}
+
+void
+i2c_bus_lock (void)
+{
+    i2c_bus_acquire (I2C_PRIO_CONFIG, 0);
+}
+
+void
+i2c_bus_unlock (void)
+{
+    i2c_bus_release ();
+}
+
+/* Slot remembering the address selected on fd, caller holds sched.lock.
+   Returns NULL if all slots are taken by other descriptors. */
+static int *
+selected_addr (int fd)
+{
+    int ii, slot = -1;
+
+    for (ii = 0; ii < I2C_BUS_MAX_FDS; ii++)
+      {
+        if (sched.selected[ii].fd == fd)
+            return &sched.selected[ii].addr;
+        if (slot < 0 && sched.selected[ii].fd < 0)
+            slot = ii;
+      }
+    if (slot < 0)
+        return NULL;
+
+    sched.selected[slot].fd = fd;
+    sched.selected[slot].addr = -1;
+    return &sched.selected[slot].addr;
+}
+
+/* A descriptor number that is opened or closed starts with no address */
+static void
+forget_selected (int fd)
+{
+    int ii;
+
+    pthread_once (&bus_lock_once, bus_lock_init);
+
+    pthread_mutex_lock (&sched.lock);
+    for (ii = 0; ii < I2C_BUS_MAX_FDS; ii++)
+      {
+        if (sched.selected[ii].fd == fd)
+            sched.selected[ii].fd = -1;
+      }
+    pthread_mutex_unlock (&sched.lock);
+}
+
+int
+i2c_bus_select (int fd, int addr)
+{
+    int *sel;
+    int res;
+
+    pthread_mutex_lock (&sched.lock);
+    sel = selected_addr (fd);
+    if (sel && *sel == addr)
+      {
+        sched.usage.switches_saved++;
+        pthread_mutex_unlock (&sched.lock);
+        return 0;
+      }
+    pthread_mutex_unlock (&sched.lock);
+
+    res = i2c_set_slave (fd, addr);
+
+    pthread_mutex_lock (&sched.lock);
+    sched.usage.switches++;
+    sel = selected_addr (fd);
+    if (sel)
+        *sel = res < 0 ? -1 : addr;
+    pthread_mutex_unlock (&sched.lock);
+
+    return res < 0 ? -1 : 0;
+}
+
+static ssize_t
+run_txn (int fd, struct i2c_txn *t)
+{
+    uint8_t buf[I2C_TXN_MAX + 1];
+    ssize_t res;
+
+    buf[0] = t->reg;
+    if (t->write)
+      {
+        memcpy (buf + 1, t->buf, t->len);
+        res = i2c_write (fd, buf, t->len + 1);
+        return res == (ssize_t) t->len + 1 ? (ssize_t) t->len : -1;
+      }
+
+    res = i2c_write (fd, buf, 1);
+    if (res != 1)
+        return -1;
+    return i2c_read (fd, t->buf, t->len);
+}
+
+/* Next transaction to run: the first one for addr, or the first one left */
+static int
+next_txn (const struct i2c_request *req, const bool *done, int addr)
+{
+    int ii, first = -1;
+
+    for (ii = 0; ii < req->n; ii++)
+      {
+        if (done[ii])
+            continue;
+        if (req->txn[ii].addr == addr)
+            return ii;
+        if (first < 0)
+            first = ii;
+      }
+
+    return first;
+}
+
+/*
+ * Run the transactions of a request for one slave address after another,
+ * the register writes and data transfers of each address linked into one
+ * chain and submitted in a single system call. A failed step cancels the
+ * rest of its chain. Selecting the address stays a call of its own,
+ * io_uring has no ioctl. Transactions that do not fit in the ring run with
+ * plain calls. Returns the number of failed transactions.
+ */
+static int
+run_chains (struct i2c_request *req, bool *done, int addr, uint64_t *bytes)
+{
+    uint8_t out[I2C_BUS_MAX_TXNS][I2C_TXN_MAX + 1];
+    struct uring_op op[I2C_BUS_MAX_TXNS][2];
+    int chain[I2C_BUS_MAX_TXNS];
+    struct i2c_txn *t;
+    unsigned link;
+    int ii, jj, n, queued, left, failed = 0;
+
+    for (left = req->n; left > 0; left -= n)
+      {
+        addr = req->txn[next_txn (req, done, addr)].addr;
+        for (ii = n = 0; ii < req->n; ii++)
+          {
+            if (!done[ii] && req->txn[ii].addr == addr)
+              {
+                done[ii] = true;
+                chain[n++] = ii;
+              }
+          }
+
+        memset (op, 0, sizeof (op));
+        for (jj = 0; jj < n; jj++)
+          {
+            op[jj][0].res = op[jj][1].res = -ECANCELED;
+            req->txn[chain[jj]].res = -1;
+          }
+        if (i2c_bus_select (req->fd, addr) < 0)
+          {
+            failed += n;
+            continue;
+          }
+
+        /* A register write queued without its read is run again below */
+        for (queued = 0; queued < n; queued++)
+          {
+            t = &req->txn[chain[queued]];
+            link = queued + 1 < n ? IOSQE_IO_LINK : 0;
+            out[queued][0] = t->reg;
+            if (t->write)
+              {
+                memcpy (out[queued] + 1, t->buf, t->len);
+                if (uring_prep (bus_ring, &op[queued][0], IORING_OP_WRITE,
+                                req->fd, out[queued], t->len + 1, link) < 0)
+                    break;
+              }
+            else if (uring_prep (bus_ring, &op[queued][0], IORING_OP_WRITE,
+                                 req->fd, out[queued], 1,
+                                 IOSQE_IO_LINK) < 0 ||
+                     uring_prep (bus_ring, &op[queued][1], IORING_OP_READ,
+                                 req->fd, t->buf, t->len, link) < 0)
+                break;
+          }
+        /* Nothing queued on a ring the kernel refuses is ever submitted */
+        if (queued && uring_run (bus_ring) < 0)
+          {
+            bus_ring = NULL;
+            queued = 0;
+          }
+
+        for (jj = 0; jj < n; jj++)
+          {
+            t = &req->txn[chain[jj]];
+            if (jj >= queued)
+                t->res = run_txn (req->fd, t);
+            else if (t->write && op[jj][0].res == (int) t->len + 1)
+                t->res = t->len;
+            else if (!t->write && op[jj][0].res == 1 && op[jj][1].res >= 0)
+                t->res = op[jj][1].res;
+
+            if (t->res != (ssize_t) t->len)
+              {
+                if (jj < queued)
+                    errno = op[jj][0].res < 0 ? -op[jj][0].res :
+                            op[jj][1].res < 0 ? -op[jj][1].res : EIO;
+                failed++;
+              }
+            else
+                *bytes += t->len;
+          }
+      }
+
+    return failed;
+}
+
+int
+i2c_bus_submit (struct i2c_request *req)
+{
+    bool done[I2C_BUS_MAX_TXNS] = { false };
+    struct i2c_txn *t;
+    uint64_t bytes;
+    int *sel, addr, ii, left, failed;
+
+    if (req->n < 0 || req->n > I2C_BUS_MAX_TXNS)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+    for (ii = 0; ii < req->n; ii++)
+      {
+        if (req->txn[ii].len > I2C_TXN_MAX)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+      }
+
+    i2c_bus_acquire (req->prio, req->deadline);
+    if (req->mark >= 0)
+        i2c_trace_mark (req->mark, req->mark_arg);
+
+    pthread_mutex_lock (&sched.lock);
+    sel = selected_addr (req->fd);
+    addr = sel ? *sel : -1;
+    pthread_mutex_unlock (&sched.lock);
+
+    bytes = 0;
+    failed = 0;
+    if (bus_ring && trace.mode == I2C_MODE_DEV)
+        failed = run_chains (req, done, addr, &bytes);
+    else
+      {
+        for (left = req->n; left > 0; left--)
+          {
+            ii = next_txn (req, done, addr);
+            done[ii] = true;
+            t = &req->txn[ii];
+            addr = t->addr;
+
+            t->res = -1;
+            if (i2c_bus_select (req->fd, addr) == 0)
+                t->res = run_txn (req->fd, t);
+            if (t->res != (ssize_t) t->len)
+                failed++;
+            else
+                bytes += t->len;
+          }
+      }
+
+    pthread_mutex_lock (&sched.lock);
+    sched.usage.transactions += req->n;
+    sched.usage.bytes += bytes;
+    pthread_mutex_unlock (&sched.lock);
+
+    i2c_bus_release ();
+    return failed ? -1 : 0;
+}
+
+void
+i2c_bus_use_uring (struct uring *ring)
+{
+    bus_ring = ring;
+}
+
+void
+i2c_bus_get_usage (struct i2c_bus_usage *usage)
+{
+    pthread_once (&bus_lock_once, bus_lock_init);
+
+    pthread_mutex_lock (&sched.lock);
+    *usage = sched.usage;
+    usage->elapsed_ns = clock_ns (CLOCK_MONOTONIC) - sched.start;
+    pthread_mutex_unlock (&sched.lock);
+}
+
+/* ---------------------------------------------------------------------- */
+/*                              Recording                                 */
+/* ---------------------------------------------------------------------- */
+
+static void
+put_varint (uint64_t v)
+{
+    while (v >= 0x80)
+      {
+        fputc ((int) (v & 0x7f) | 0x80, trace.out);
+        v >>= 7;
+      }
+    fputc ((int) v, trace.out);
+}
+
+static void
+put_zigzag (int64_t v)
+{
+    put_varint (((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+/* Start a record, caller holds trace.lock */
+static void
+put_header (enum i2c_trace_op op)
+{
+    int64_t now = clock_ns (CLOCK_MONOTONIC);
+
+    fputc (op, trace.out);
+    put_varint (trace.last ? (uint64_t) (now - trace.last) / 1000 : 0);
+    trace.last = now;
+    trace.stats.records++;
+}
+
+static int64_t
+result_of (ssize_t res)
+{
+    return res < 0 ? -errno : res;
+}
+
+int
+i2c_trace_record (const char *path)
+{
+    trace.out = fopen (path, "wb");
+    if (!trace.out)
+      {
+        log_error ("could not open i2c trace for writing");
+        return -1;
+      }
+
+    fwrite (I2C_TRACE_MAGIC, 1, strlen (I2C_TRACE_MAGIC), trace.out);
+    trace.mode = I2C_MODE_RECORD;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/*                               Replaying                                */
+/* ---------------------------------------------------------------------- */
+
+static int
+get_varint (uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (trace.pos < trace.len && shift < 64)
+      {
+        unsigned char b = trace.buf[trace.pos++];
+
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+        shift += 7;
+      }
+
+    return -1;
+}
+
+static int
+get_zigzag (int64_t *v)
+{
+    uint64_t u;
+
+    if (get_varint (&u) < 0)
+        return -1;
+    *v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return 0;
+}
+
+/* Read the header of the next record, sleeping out the recorded delay when
+   replaying in real time. Returns the op or -1 at end of trace. */
+static int
+get_header (void)
+{
+    uint64_t dt;
+    int op;
+
+    if (trace.pos >= trace.len)
+        return -1;
+
+    op = trace.buf[trace.pos++];
+    if (get_varint (&dt) < 0)
+        return -1;
+
+    if (trace.realtime && dt)
+        vclock_sleep ((int64_t) dt * 1000);
+
+    trace.stats.records++;
+    return op;
+}
+
+/* Peek at the op of the next record without consuming it */
+static int
+peek_op (void)
+{
+    return trace.pos < trace.len ? trace.buf[trace.pos] : -1;
+}
+
+/* Turn a recorded result into a return value */
+static ssize_t
+replay_result (int64_t res)
+{
+    if (res < 0)
+      {
+        errno = (int) -res;
+        return -1;
+      }
+    return (ssize_t) res;
+}
+
+static void
+diverged (const char *what)
+{
+    trace.stats.divergences++;
+    _log_debug ("replay diverged from trace at offset %zu: %s\n", trace.pos,
+                what);
+}
+
+/* Consume the next record which has to be of type op */
+static int
+expect_op (enum i2c_trace_op op)
+{
+    if (peek_op () != (int) op)
+      {
+        diverged ("unexpected operation");
+        errno = EIO;
+        return -1;
+      }
+
+    return get_header ();
+}
+
+int
+i2c_trace_replay (const char *path, bool realtime)
+{
+    size_t magic_len = strlen (I2C_TRACE_MAGIC);
+    FILE *in;
+    long size;
+
+    in = fopen (path, "rb");
+    if (!in)
+      {
+        log_error ("could not open i2c trace for reading");
+        return -1;
+      }
+
+    /* The whole trace is kept in memory so that replay speed is not bound
+       by file I/O */
+    fseek (in, 0, SEEK_END);
+    size = ftell (in);
+    rewind (in);
+    if (size < (long) magic_len)
+      {
+        fclose (in);
+        errno = EINVAL;
+        log_error ("i2c trace too short");
+        return -1;
+      }
+
+    trace.buf = malloc (size);
+    if (!trace.buf || fread (trace.buf, 1, size, in) != (size_t) size)
+      {
+        log_error ("could not read i2c trace");
+        free (trace.buf);
+        trace.buf = NULL;
+        fclose (in);
+        return -1;
+      }
+    fclose (in);
+
+    if (memcmp (trace.buf, I2C_TRACE_MAGIC, magic_len) != 0)
+      {
+        errno = EINVAL;
+        log_error ("not an i2c trace");
+        free (trace.buf);
+        trace.buf = NULL;
+        return -1;
+      }
+
+    trace.len = size;
+    trace.pos = magic_len;
+    trace.realtime = realtime;
+    trace.mode = I2C_MODE_REPLAY;
+    return 0;
+}
+
+void
+i2c_trace_rewind (void)
+{
+    trace.pos = strlen (I2C_TRACE_MAGIC);
+}
+
+bool
+i2c_trace_replaying (void)
+{
+    return trace.mode == I2C_MODE_REPLAY;
+}
+
+int
+i2c_trace_next_mark (uint32_t *arg)
+{
+    uint64_t v;
+    int op;
+
+    while ((op = peek_op ()) >= 0 && op < I2C_MARK_INIT)
+      {
+        /* Bus traffic outside any marked call, nothing to replay it with */
+        diverged ("operation outside of a call");
+        return -1;
+      }
+
+    op = get_header ();
+    if (op < 0 || get_varint (&v) < 0)
+        return -1;
+
+    *arg = (uint32_t) v;
+    return op;
+}
+
+void
+i2c_bus_emulate (void)
+{
+    trace.mode = I2C_MODE_EMULATE;
+}
+
+void
+i2c_trace_use_uring (struct uring *ring)
+{
+    FILE *stream;
+
+    pthread_mutex_lock (&trace.lock);
+    if (ring && trace.mode == I2C_MODE_RECORD && !trace.file &&
+        fflush (trace.out) == 0 &&
+        uring_file_init (&trace.async, ring, fileno (trace.out)) == 0)
+      {
+        stream = uring_file_stream (&trace.async);
+        if (stream)
+          {
+            trace.file = trace.out;
+            trace.out = stream;
+            trace.ring = ring;
+          }
+        else
+            uring_file_free (&trace.async);
+      }
+    else if (!ring && trace.file)
+      {
+        /* Hand on what the stream holds and wait for all of it */
+        fclose (trace.out);
+        trace.out = trace.file;
+        trace.file = NULL;
+        uring_run (trace.ring);
+        uring_file_free (&trace.async);
+        trace.ring = NULL;
+      }
+    pthread_mutex_unlock (&trace.lock);
+}
+
+void
+i2c_trace_close (void)
+{
+    i2c_trace_use_uring (NULL);
+
+    if (trace.out)
+        fclose (trace.out);
+    free (trace.buf);
+    trace.out = NULL;
+    trace.buf = NULL;
+    trace.mode = I2C_MODE_DEV;
+}
+
+/* Caller holds trace.lock */
+static void
+put_mark (enum i2c_trace_op mark, uint32_t arg)
+{
+    put_header (mark);
+    put_varint (arg);
+    /* Keep what we have on disk at each report in case the unit dies */
+    if (mark == I2C_MARK_PUBLISH)
+        fflush (trace.out);
+}
+
+/*
+ * Replay expects the calls of a transaction one after the other, so marks
+ * of threads that do not own the bus are written once the owner is done.
+ */
+static void
+trace_set_owner (bool owned)
+{
+    int ii;
+
+    if (trace.mode != I2C_MODE_RECORD)
+        return;
+
+    pthread_mutex_lock (&trace.lock);
+    trace.owned = owned;
+    trace.owner = pthread_self ();
+    for (ii = 0; !owned && ii < trace.n_pending; ii++)
+        put_mark (trace.pending[ii].mark, trace.pending[ii].arg);
+    if (!owned)
+      {
+        trace.n_pending = 0;
+        pthread_cond_broadcast (&trace.flushed);
+      }
+    pthread_mutex_unlock (&trace.lock);
+}
+
+void
+i2c_trace_mark (enum i2c_trace_op mark, uint32_t arg)
+{
+    if (trace.mode != I2C_MODE_RECORD)
+        return;
+
+    pthread_mutex_lock (&trace.lock);
+    /* With no room left wait for the owner, a mark written now would go
+       in the middle of its request and ahead of those pending */
+    while (trace.owned && !pthread_equal (trace.owner, pthread_self ()) &&
+           trace.n_pending == I2C_TRACE_PENDING)
+        pthread_cond_wait (&trace.flushed, &trace.lock);
+    if (trace.owned && !pthread_equal (trace.owner, pthread_self ()))
+      {
+        trace.pending[trace.n_pending].mark = mark;
+        trace.pending[trace.n_pending].arg = arg;
+        trace.n_pending++;
+      }
+    else
+        put_mark (mark, arg);
+    pthread_mutex_unlock (&trace.lock);
+}
+
+void
+i2c_trace_get_stats (struct i2c_trace_stats *stats)
+{
+    pthread_mutex_lock (&trace.lock);
+    *stats = trace.stats;
+    pthread_mutex_unlock (&trace.lock);
+}
+
+/* ---------------------------------------------------------------------- */
+/*                             Bus operations                             */
+/* ---------------------------------------------------------------------- */
+
+int
+i2c_open (const char *path)
+{
+    int64_t res;
+    int fd;
+
+    switch (trace.mode)
+      {
+        case I2C_MODE_REPLAY:
+            if (expect_op (I2C_OP_OPEN) < 0 || get_zigzag (&res) < 0)
+                return -1;
+            if (res < 0)
+                return replay_result (res);
+            forget_selected (I2C_REPLAY_FD);
+            return I2C_REPLAY_FD;
+        case I2C_MODE_RECORD:
+            fd = open (path, O_RDWR);
+            if (fd >= 0)
+                forget_selected (fd);
+            res = fd < 0 ? -errno : 0;
+            pthread_mutex_lock (&trace.lock);
+            put_header (I2C_OP_OPEN);
+            put_zigzag (res);
+            pthread_mutex_unlock (&trace.lock);
+            errno = res < 0 ? (int) -res : errno;
+            return fd;
+        case I2C_MODE_EMULATE:
+            fd = emubus_open ();
+            if (fd >= 0)
+                forget_selected (fd);
+            return fd;
+        default:
+            fd = open (path, O_RDWR);
+            if (fd >= 0)
+                forget_selected (fd);
+            return fd;
+      }
+}
+
+int
+i2c_set_slave (int fd, int addr)
+{
+    int64_t res;
+    int r;
+
+    switch (trace.mode)
+      {
+        case I2C_MODE_REPLAY:
+            if (expect_op (I2C_OP_SLAVE) < 0 || trace.pos >= trace.len)
+                return -1;
+            if (trace.buf[trace.pos++] != addr)
+                diverged ("different slave address");
+            if (get_zigzag (&res) < 0)
+                return -1;
+            return (int) replay_result (res);
+        case I2C_MODE_RECORD:
+            r = ioctl (fd, I2C_SLAVE, addr);
+            res = result_of (r);
+            pthread_mutex_lock (&trace.lock);
+            put_header (I2C_OP_SLAVE);
+            fputc (addr, trace.out);
+            put_zigzag (res);
+            pthread_mutex_unlock (&trace.lock);
+            errno = res < 0 ? (int) -res : errno;
+            return r;
+        case I2C_MODE_EMULATE:
+            return emubus_set_slave (fd, addr);
+        default:
+            return ioctl (fd, I2C_SLAVE, addr);
+      }
+}
+
+ssize_t
+i2c_write (int fd, const void *buf, size_t len)
+{
+    uint64_t n;
+    int64_t res;
+    ssize_t r;
+
+    switch (trace.mode)
+      {
+        case I2C_MODE_REPLAY:
+            if (expect_op (I2C_OP_WRITE) < 0 || get_varint (&n) < 0 ||
+                trace.pos + n > trace.len)
+                return -1;
+            if (n != len || memcmp (trace.buf + trace.pos, buf, len) != 0)
+                diverged ("different bytes written");
+            trace.pos += n;
+            if (get_zigzag (&res) < 0)
+                return -1;
+            if (res > 0)
+                trace.stats.bytes += res;
+            return replay_result (res);
+        case I2C_MODE_RECORD:
+            r = write (fd, buf, len);
+            res = result_of (r);
+            pthread_mutex_lock (&trace.lock);
+            put_header (I2C_OP_WRITE);
+            put_varint (len);
+            fwrite (buf, 1, len, trace.out);
+            put_zigzag (res);
+            if (r > 0)
+                trace.stats.bytes += r;
+            pthread_mutex_unlock (&trace.lock);
+            errno = res < 0 ? (int) -res : errno;
+            return r;
+        case I2C_MODE_EMULATE:
+            return emubus_write (fd, buf, len);
+        default:
+            return write (fd, buf, len);
+      }
+}
+
+ssize_t
+i2c_read (int fd, void *buf, size_t len)
+{
+    uint64_t n;
+    int64_t res;
+    ssize_t r;
+
+    switch (trace.mode)
+      {
+        case I2C_MODE_REPLAY:
+            if (expect_op (I2C_OP_READ) < 0 || get_varint (&n) < 0 ||
+                get_zigzag (&res) < 0)
+                return -1;
+            if (n != len)
+                diverged ("different read length");
+            if (res > 0)
+              {
+                if (trace.pos + res > trace.len || (size_t) res > len)
+                  {
+                    errno = EIO;
+                    return -1;
+                  }
+                memcpy (buf, trace.buf + trace.pos, res);
+                trace.pos += res;
+                trace.stats.bytes += res;
+              }
+            return replay_result (res);
+        case I2C_MODE_RECORD:
+            r = read (fd, buf, len);
+            res = result_of (r);
+            pthread_mutex_lock (&trace.lock);
+            put_header (I2C_OP_READ);
+            put_varint (len);
+            put_zigzag (res);
+            if (r > 0)
+              {
+                fwrite (buf, 1, r, trace.out);
+                trace.stats.bytes += r;
+              }
+            pthread_mutex_unlock (&trace.lock);
+            errno = res < 0 ? (int) -res : errno;
+            return r;
+        case I2C_MODE_EMULATE:
+            return emubus_read (fd, buf, len);
+        default:
+            return read (fd, buf, len);
+      }
+}
+
+int
+i2c_close (int fd)
+{
+    forget_selected (fd);
+
+    switch (trace.mode)
+      {
+        case I2C_MODE_REPLAY:
+            if (peek_op () == I2C_OP_CLOSE)
+                get_header ();
+            return 0;
+        case I2C_MODE_RECORD:
+            pthread_mutex_lock (&trace.lock);
+            put_header (I2C_OP_CLOSE);
+            pthread_mutex_unlock (&trace.lock);
+            return close (fd);
+        case I2C_MODE_EMULATE:
+            return emubus_close (fd);
+        default:
+            return close (fd);
+      }
+}
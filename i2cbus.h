@@ -0,0 +1,192 @@
+/*
+ *  i2cbus.h
+ *    Thin layer over i2c-dev that schedules the drivers sharing the bus, can
+ *    record every transaction to a compact binary trace and replay a trace
+ *    instead of touching the bus
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _I2CBUS_H_
+#define _I2CBUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "uring.h"
+
+/*
+ * Trace file layout: an 8 byte magic followed by records. Each record
+ * starts with the op byte and the time since the previous record in
+ * microseconds as a varint. Then, depending on op:
+ *   OPEN, SLAVE   zigzag varint result (SLAVE is followed by address byte)
+ *   WRITE         varint length, the bytes written, zigzag varint result
+ *   READ          varint length, zigzag varint result, the bytes read
+ *   CLOSE         nothing
+ *   MARK_*        varint argument
+ * Results are the return value of the call or -errno on failure. The first
+ * byte written is the register address so every transaction on the bus is
+ * recorded with address, register, data and timing.
+ *
+ * The marks record calls into sensors.c and acquire.c so that a replay can
+ * drive the acquisition code through exactly the same sequence of calls.
+ */
+#define I2C_TRACE_MAGIC "FGI2CTR1"
+
+enum i2c_trace_op {
+    I2C_OP_OPEN,
+    I2C_OP_SLAVE,
+    I2C_OP_WRITE,
+    I2C_OP_READ,
+    I2C_OP_CLOSE,
+    I2C_MARK_INIT,
+    I2C_MARK_AVERAGING,     /* argument is avgp | avgt << 8 | avgh << 16 */
+    I2C_MARK_SAMPLE,        /* argument is the channel mask */
+    I2C_MARK_PUBLISH,
+    I2C_MARK_POWER          /* argument is the channel mask */
+};
+
+struct i2c_trace_stats {
+    uint64_t records;
+    uint64_t bytes;         /* data bytes transferred on the bus */
+    uint64_t divergences;   /* replayed calls that differ from the trace */
+};
+
+/* Bus users in order of precedence when several wait for the bus */
+enum i2c_prio {
+    I2C_PRIO_STREAM,        /* FIFO drains that overrun if kept waiting */
+    I2C_PRIO_SAMPLE,        /* scheduled sensor reads */
+    I2C_PRIO_CONFIG,        /* bring-up, reconfiguration and trace marks */
+    I2C_PRIO_LEVELS
+};
+
+/* Most transactions in one request and data bytes in one transaction */
+#define I2C_BUS_MAX_TXNS 8
+#define I2C_TXN_MAX 32
+
+/* File descriptors the selected slave address is remembered for */
+#define I2C_BUS_MAX_FDS 4
+
+/* One register access: the register address is written, then len bytes
+   are written from or read into buf. res is set to the number of data
+   bytes transferred or -1. */
+struct i2c_txn {
+    int            addr;
+    uint8_t        reg;
+    bool           write;
+    uint8_t       *buf;
+    size_t         len;
+    ssize_t        res;
+};
+
+struct i2c_request {
+    int             fd;
+    struct i2c_txn *txn;
+    int             n;
+    enum i2c_prio   prio;
+    int64_t         deadline;   /* CLOCK_MONOTONIC, 0 = as soon as possible */
+    int             mark;       /* trace mark recorded first, -1 for none */
+    uint32_t        mark_arg;
+};
+
+struct i2c_bus_usage {
+    uint64_t elapsed_ns;        /* since the bus was first used */
+    uint64_t busy_ns;           /* the bus had an owner */
+    uint64_t transactions;
+    uint64_t bytes;
+    uint64_t switches;          /* I2C_SLAVE ioctls issued */
+    uint64_t switches_saved;    /* skipped, address already selected */
+    uint64_t late;              /* got the bus after their deadline */
+    uint64_t requests[I2C_PRIO_LEVELS];
+    uint64_t wait_ns[I2C_PRIO_LEVELS];
+    uint64_t max_wait_ns[I2C_PRIO_LEVELS];
+};
+
+/*
+ * Take the bus for a sequence of calls. Owners are served in order of
+ * priority and then deadline (CLOCK_MONOTONIC, 0 = now). Trace marks of
+ * other threads wait for the owner to release the bus, so they never split
+ * a request.
+ */
+extern void i2c_bus_acquire (enum i2c_prio, int64_t);
+extern void i2c_bus_release (void);
+
+/* Own the bus at configuration priority, for bring-up sequences */
+extern void i2c_bus_lock (void);
+extern void i2c_bus_unlock (void);
+
+/* Select the slave address on fd unless it already is, call while owning
+   the bus */
+extern int i2c_bus_select (int, int);
+
+/*
+ * Run the transactions of a request in one ownership of the bus. They are
+ * coalesced per slave address, starting with the address selected on fd,
+ * so a request never switches to an address twice. Returns -1 if any of
+ * them failed.
+ */
+extern int i2c_bus_submit (struct i2c_request *);
+
+/* Run the transactions of requests through ring, NULL to go back. The
+   submitting thread still waits for them, in one system call per slave
+   address instead of two per transaction. Only used on the device itself,
+   not with traces or the emulated bus. */
+extern void i2c_bus_use_uring (struct uring *);
+
+extern void i2c_bus_get_usage (struct i2c_bus_usage *);
+
+/* Record all following bus traffic to file */
+extern int i2c_trace_record (const char *);
+
+/* Write the trace being recorded through ring rather than blocking the bus
+   owner on the disk, NULL waits for the writes and goes back */
+extern void i2c_trace_use_uring (struct uring *);
+
+/* Serve all following bus traffic from a trace. With realtime set the
+   recorded timing is reproduced, otherwise it runs at full speed. */
+extern int i2c_trace_replay (const char *, bool);
+
+/* Serve all following bus traffic from the sensors in emubus.c */
+extern void i2c_bus_emulate (void);
+
+/* Start over from the beginning of the replayed trace */
+extern void i2c_trace_rewind (void);
+
+extern void i2c_trace_close (void);
+
+extern bool i2c_trace_replaying (void);
+
+/* Record a mark when recording, from any thread. The bus owner's own marks
+   go in right away, those of others after its request. */
+extern void i2c_trace_mark (enum i2c_trace_op, uint32_t);
+
+/* When replaying, skip to the next mark and return it, -1 at end of trace */
+extern int i2c_trace_next_mark (uint32_t *);
+
+extern void i2c_trace_get_stats (struct i2c_trace_stats *);
+
+/* Same semantics as open, ioctl (I2C_SLAVE), write, read and close */
+extern int i2c_open (const char *);
+extern int i2c_set_slave (int, int);
+extern ssize_t i2c_write (int, const void *, size_t);
+extern ssize_t i2c_read (int, void *, size_t);
+extern int i2c_close (int);
+
+#endif /* _I2CBUS_H_ */
@@ -0,0 +1,472 @@
+/*
+ *  iio.c
+ *    Acquisition backend using the kernel IIO drivers for HTS221 and LPS25H
+ *    with triggered buffers read in batches from /dev/iio:deviceN
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iio.h"
+#include "sensors.h"
+#include "common.h"
+#include "log.h"
+
+#define IIO_DEVICES_DIR "/sys/bus/iio/devices"
+
+/* The drivers we know and the channels we want from them. unit converts
+   the IIO unit (kPa, milli °C, milli %rH) to the unit we report in. */
+static const struct {
+    const char *name;
+    struct {
+        const char *el;
+        int         channel;
+        float       unit;
+    } ch[IIO_MAX_ELEMENTS];
+} known[IIO_MAX_DEVICES] = {
+    { "hts221", { { "in_temp", SENSOR_TEMPERATURE, 0.001f },
+                  { "in_humidityrelative", SENSOR_HUMIDITY, 0.001f } } },
+    { "lps25h", { { "in_pressure", SENSOR_PRESSURE, 10.0f },
+                  { NULL, 0, 0.0f } } }
+};
+
+static void iio_read_cb (evutil_socket_t, short, void *);
+
+static int
+sysfs_write (const char *dir, const char *attr, const char *value)
+{
+    char path[PATH_MAX];
+    int fd, res;
+
+    snprintf (path, sizeof (path), "%s/%s", dir, attr);
+    fd = open (path, O_WRONLY | O_TRUNC);
+    if (fd < 0)
+        return -1;
+
+    res = write (fd, value, strlen (value));
+    close (fd);
+    return res < 0 ? -1 : 0;
+}
+
+static int
+sysfs_read (const char *dir, const char *attr, char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    ssize_t res;
+    char *p;
+    int fd;
+
+    snprintf (path, sizeof (path), "%s/%s", dir, attr);
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    res = read (fd, buf, len - 1);
+    close (fd);
+    if (res < 0)
+        return -1;
+
+    buf[res] = '\0';
+    p = strchr (buf, '\n');
+    if (p)
+        *p = '\0';
+    return 0;
+}
+
+/* Parse "le:s16/16>>0" style type attribute */
+static int
+parse_type (struct iio_element *el, const char *type)
+{
+    unsigned bits, storage, shift;
+    char endian, sign;
+
+    if (sscanf (type, "%ce:%c%u/%u>>%u", &endian, &sign, &bits, &storage,
+                &shift) != 5 || storage % 8 || storage / 8 > 8 ||
+        bits > storage)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+
+    el->be = endian == 'b';
+    el->is_signed = sign == 's';
+    el->bits = bits;
+    el->bytes = storage / 8;
+    el->shift = shift;
+    return 0;
+}
+
+static int
+compare_index (const void *a, const void *b)
+{
+    return ((const struct iio_element *) a)->index -
+           ((const struct iio_element *) b)->index;
+}
+
+/* Disable every scan element, enable ours and work out the scan layout */
+static int
+setup_scan (struct iio_device *dev, int k)
+{
+    char dir[PATH_MAX], attr[64], buf[64];
+    struct iio_element *el;
+    struct dirent *de;
+    size_t len, offset, align;
+    DIR *d;
+    int ii;
+
+    if (snprintf (dir, sizeof (dir), "%s/scan_elements", dev->sysfs) >=
+        (int) sizeof (dir))
+      {
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+    d = opendir (dir);
+    if (!d)
+        return -1;
+    while ((de = readdir (d)) != NULL)
+      {
+        len = strlen (de->d_name);
+        if (len > 3 && strcmp (de->d_name + len - 3, "_en") == 0)
+            sysfs_write (dir, de->d_name, "0");
+      }
+    closedir (d);
+
+    dev->n_el = 0;
+    for (ii = 0; ii < IIO_MAX_ELEMENTS && known[k].ch[ii].el; ii++)
+      {
+        el = &dev->el[dev->n_el];
+        snprintf (el->name, sizeof (el->name), "%s", known[k].ch[ii].el);
+        el->channel = known[k].ch[ii].channel;
+        el->unit = known[k].ch[ii].unit;
+
+        snprintf (attr, sizeof (attr), "%s_en", el->name);
+        if (sysfs_write (dir, attr, "1") < 0)
+            return -1;
+        snprintf (attr, sizeof (attr), "%s_index", el->name);
+        if (sysfs_read (dir, attr, buf, sizeof (buf)) < 0)
+            return -1;
+        el->index = atoi (buf);
+        snprintf (attr, sizeof (attr), "%s_type", el->name);
+        if (sysfs_read (dir, attr, buf, sizeof (buf)) < 0 ||
+            parse_type (el, buf) < 0)
+            return -1;
+
+        dev->n_el++;
+      }
+
+    /* Elements are laid out in index order, each aligned to its own size,
+       and the scan is padded to the size of its largest element */
+    qsort (dev->el, dev->n_el, sizeof (dev->el[0]), compare_index);
+    offset = 0;
+    align = 1;
+    for (ii = 0; ii < dev->n_el; ii++)
+      {
+        el = &dev->el[ii];
+        offset = (offset + el->bytes - 1) / el->bytes * el->bytes;
+        el->offset = offset;
+        offset += el->bytes;
+        if ((size_t) el->bytes > align)
+            align = el->bytes;
+      }
+    dev->scan_size = (offset + align - 1) / align * align;
+    if (dev->scan_size > IIO_MAX_SCAN_SIZE)
+      {
+        errno = E2BIG;
+        return -1;
+      }
+
+    return 0;
+}
+
+/* Take conversion of each channel from the scale and offset attributes */
+static void
+setup_conversion (struct iio_device *dev)
+{
+    char attr[64], buf[64];
+    float scale, offset;
+    int ii;
+
+    for (ii = 0; ii < dev->n_el; ii++)
+      {
+        scale = 1.0f;
+        offset = 0.0f;
+        snprintf (attr, sizeof (attr), "%s_scale", dev->el[ii].name);
+        if (sysfs_read (dev->sysfs, attr, buf, sizeof (buf)) == 0)
+            scale = strtof (buf, NULL);
+        snprintf (attr, sizeof (attr), "%s_offset", dev->el[ii].name);
+        if (sysfs_read (dev->sysfs, attr, buf, sizeof (buf)) == 0)
+            offset = strtof (buf, NULL);
+
+        sensors_set_conversion (dev->el[ii].channel,
+                                scale * dev->el[ii].unit, offset);
+      }
+}
+
+static int
+setup_device (struct iio_device *dev, int k, const char *root,
+              const char *devname, const char *trigger)
+{
+    char buf[16];
+
+    dev->fd = -1;
+
+    /* The buffer cannot be reconfigured while it is enabled */
+    sysfs_write (dev->sysfs, "buffer/enable", "0");
+
+    if (setup_scan (dev, k) < 0)
+      {
+        log_error ("could not set up IIO scan elements");
+        return -1;
+      }
+    setup_conversion (dev);
+
+    if (trigger && sysfs_write (dev->sysfs, "trigger/current_trigger",
+                                trigger) < 0)
+      {
+        log_error ("could not set IIO trigger");
+        return -1;
+      }
+
+    snprintf (buf, sizeof (buf), "%d", IIO_BUFFER_LENGTH);
+    sysfs_write (dev->sysfs, "buffer/length", buf);
+    /* Older kernels have no watermark, we then wake up for every scan */
+    snprintf (buf, sizeof (buf), "%d", IIO_WATERMARK);
+    sysfs_write (dev->sysfs, "buffer/watermark", buf);
+
+    if (sysfs_write (dev->sysfs, "buffer/enable", "1") < 0)
+      {
+        log_error ("could not enable IIO buffer");
+        return -1;
+      }
+
+    snprintf (dev->node, sizeof (dev->node), "%s/dev/%s", root, devname);
+    dev->fd = open (dev->node, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (dev->fd < 0)
+      {
+        log_error ("could not open IIO device node");
+        return -1;
+      }
+
+    return 0;
+}
+
+int
+iio_open (struct iio_backend *iio, const char *root, const char *trigger)
+{
+    char dir[PATH_MAX], name[32];
+    struct iio_device *dev;
+    struct dirent *de;
+    DIR *d;
+    int k;
+
+    memset (iio, 0, sizeof (*iio));
+
+    snprintf (dir, sizeof (dir), "%s%s", root, IIO_DEVICES_DIR);
+    d = opendir (dir);
+    if (!d)
+      {
+        log_error ("could not open IIO devices directory");
+        return -1;
+      }
+
+    while ((de = readdir (d)) != NULL && iio->n_dev < IIO_MAX_DEVICES)
+      {
+        if (strncmp (de->d_name, "iio:device", 10) != 0)
+            continue;
+
+        dev = &iio->dev[iio->n_dev];
+        if (snprintf (dev->sysfs, sizeof (dev->sysfs), "%s/%s", dir,
+                      de->d_name) >= (int) sizeof (dev->sysfs) ||
+            sysfs_read (dev->sysfs, "name", name, sizeof (name)) < 0)
+            continue;
+
+        for (k = 0; k < IIO_MAX_DEVICES; k++)
+          {
+            if (strcmp (name, known[k].name) != 0)
+                continue;
+
+            if (setup_device (dev, k, root, de->d_name, trigger) < 0)
+              {
+                closedir (d);
+                iio_close (iio);
+                return -1;
+              }
+            _log_debug ("using IIO device %s (%s)\n", de->d_name, name);
+            iio->n_dev++;
+            break;
+          }
+      }
+    closedir (d);
+
+    if (!iio->n_dev)
+      {
+        errno = ENODEV;
+        log_error ("no supported IIO devices found");
+        return -1;
+      }
+
+    return 0;
+}
+
+int
+iio_start (struct iio_backend *iio, struct event_base *base,
+           struct acquisition *acq)
+{
+    struct timeval tv = { IIO_POLL_MS / 1000, (IIO_POLL_MS % 1000) * 1000 };
+    struct iio_device *dev;
+    int ii;
+
+    iio->acq = acq;
+    for (ii = 0; ii < iio->n_dev; ii++)
+      {
+        dev = &iio->dev[ii];
+        dev->ev = event_new (base, dev->fd, EV_READ | EV_PERSIST, iio_read_cb,
+                             iio);
+        if (dev->ev && event_add (dev->ev, NULL) == 0)
+            continue;
+
+        /* epoll refuses regular files, fall back to polling them */
+        if (dev->ev)
+            event_free (dev->ev);
+        dev->ev = event_new (base, -1, EV_PERSIST, iio_read_cb, iio);
+        if (!dev->ev || event_add (dev->ev, &tv) < 0)
+          {
+            log_error ("could not create/add IIO event");
+            return -1;
+          }
+      }
+
+    iio->active = true;
+    return 0;
+}
+
+void
+iio_close (struct iio_backend *iio)
+{
+    struct iio_device *dev;
+    int ii;
+
+    for (ii = 0; ii < iio->n_dev; ii++)
+      {
+        dev = &iio->dev[ii];
+        if (dev->ev)
+            event_free (dev->ev);
+        if (dev->fd >= 0)
+          {
+            close (dev->fd);
+            sysfs_write (dev->sysfs, "buffer/enable", "0");
+          }
+        dev->ev = NULL;
+        dev->fd = -1;
+      }
+    iio->n_dev = 0;
+    iio->active = false;
+}
+
+/* Extract an element from a scan */
+static __s32
+element_value (const struct iio_element *el, const unsigned char *scan)
+{
+    const unsigned char *p = scan + el->offset;
+    uint64_t v = 0;
+    int ii;
+
+    for (ii = 0; ii < el->bytes; ii++)
+        v |= (uint64_t) p[el->be ? el->bytes - 1 - ii : ii] << (8 * ii);
+
+    v >>= el->shift;
+    if (el->bits < 64)
+      {
+        v &= (UINT64_C(1) << el->bits) - 1;
+        if (el->is_signed && (v & (UINT64_C(1) << (el->bits - 1))))
+            v |= ~((UINT64_C(1) << el->bits) - 1);
+      }
+
+    return (__s32) (int64_t) v;
+}
+
+static void
+drain_device (struct iio_backend *iio, struct iio_device *dev)
+{
+    struct SensorSample sample;
+    size_t off;
+    ssize_t res;
+    int ii;
+
+    /* One read returns every scan buffered since we last woke up */
+    while ((res = read (dev->fd, dev->buf + dev->fill,
+                        sizeof (dev->buf) - dev->fill)) > 0)
+      {
+        iio->reads++;
+        dev->fill += res;
+
+        for (off = 0; off + dev->scan_size <= dev->fill; off += dev->scan_size)
+          {
+            sample.mask = 0;
+            for (ii = 0; ii < dev->n_el; ii++)
+              {
+                sample.raw[dev->el[ii].channel] =
+                                    element_value (&dev->el[ii], dev->buf + off);
+                sample.mask |= SENSOR_BIT(dev->el[ii].channel);
+              }
+            acquire_store (iio->acq, &sample);
+            iio->scans++;
+          }
+
+        /* Keep a partial scan for the next read */
+        memmove (dev->buf, dev->buf + off, dev->fill - off);
+        dev->fill -= off;
+      }
+
+    if (res < 0 && errno != EAGAIN)
+        log_error ("read IIO device failed");
+}
+
+void
+iio_drain (struct iio_backend *iio)
+{
+    int ii;
+
+    for (ii = 0; ii < iio->n_dev; ii++)
+        drain_device (iio, &iio->dev[ii]);
+}
+
+static void
+iio_read_cb (evutil_socket_t fd, short UNUSED(what), void *arg)
+{
+    struct iio_backend *iio = arg;
+    int ii;
+
+    if (fd < 0)
+      {
+        iio_drain (iio);
+        return;
+      }
+
+    for (ii = 0; ii < iio->n_dev; ii++)
+      {
+        if (iio->dev[ii].fd == fd)
+            drain_device (iio, &iio->dev[ii]);
+      }
+}
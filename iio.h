@@ -0,0 +1,102 @@
+/*
+ *  iio.h
+ *    Acquisition backend using the kernel IIO drivers for HTS221 and LPS25H
+ *    with triggered buffers read in batches from /dev/iio:deviceN
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _IIO_H_
+#define _IIO_H_
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#include "acquire.h"
+
+#define IIO_MAX_DEVICES  2
+#define IIO_MAX_ELEMENTS 2
+
+/* Scans the kernel buffers, and we wake up once this many are buffered */
+#define IIO_BUFFER_LENGTH 128
+#define IIO_WATERMARK     16
+
+/* Largest scan we expect: two 32 bit elements and a 64 bit timestamp */
+#define IIO_MAX_SCAN_SIZE 16
+
+/* Poll interval for device nodes that do not support poll, which is the
+   case for the plain files of a directory tree standing in for devfs */
+#define IIO_POLL_MS 1000
+
+/* Scan element as described by scan_elements/<name>_type */
+struct iio_element {
+    char     name[32];      /* e.g. "in_temp" */
+    int      channel;       /* enum sensor_channel */
+    float    unit;          /* IIO unit to the unit of the channel */
+    int      index;
+    int      bytes;         /* storage bytes */
+    int      bits;          /* real bits */
+    int      shift;
+    bool     is_signed;
+    bool     be;
+    int      offset;        /* byte offset within a scan */
+};
+
+struct iio_device {
+    char               sysfs[PATH_MAX];
+    char               node[PATH_MAX];
+    int                fd;
+    struct event      *ev;
+    struct iio_element el[IIO_MAX_ELEMENTS];
+    int                n_el;
+    size_t             scan_size;
+    unsigned char      buf[IIO_BUFFER_LENGTH * IIO_MAX_SCAN_SIZE];
+    size_t             fill;
+};
+
+struct iio_backend {
+    struct iio_device   dev[IIO_MAX_DEVICES];
+    int                 n_dev;
+    struct acquisition *acq;
+    bool                active;
+    uint64_t            reads;
+    uint64_t            scans;
+};
+
+/*
+ * Find the hts221 and lps25h IIO devices below root (empty string for the
+ * real /sys and /dev), configure scan elements, trigger and buffer and
+ * enable the buffers. The conversion of each channel is taken from the
+ * scale and offset attributes.
+ */
+extern int iio_open (struct iio_backend *, const char *, const char *);
+
+/* Start reading batches of scans into the windows of acq */
+extern int iio_start (struct iio_backend *, struct event_base *,
+                      struct acquisition *);
+
+/* Read the scans buffered so far without waiting for the watermark */
+extern void iio_drain (struct iio_backend *);
+
+extern void iio_close (struct iio_backend *);
+
+#endif /* _IIO_H_ */
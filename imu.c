@@ -0,0 +1,199 @@
+/*
+ *  imu.c
+ *    Streaming of the LSM9DS1 accelerometer FIFO into the perch landing
+ *    detector
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <asm/types.h>
+
+#include "LSM9DS1.h"  // LSM9DS1 accelerometer and gyroscope
+#include "imu.h"
+#include "sensors.h"
+#include "i2cbus.h"
+#include "common.h"
+#include "log.h"
+
+static void imu_drain_cb (uint64_t, void *);
+
+/*
+ * The IMU has a file descriptor of its own. Its reads go to the bus
+ * scheduler as a stream so they are served before slower sensor reads and
+ * the FIFO does not overrun while they wait.
+ */
+static int
+imu_read (struct imu_stream *imu, __u8 reg, __u8 *buf, size_t len)
+{
+    struct i2c_txn txn = { LSM9DS1_SAD, reg, false, buf, len, 0 };
+    struct i2c_request req = { imu->fd, &txn, 1, I2C_PRIO_STREAM, 0, -1, 0 };
+
+    return i2c_bus_submit (&req);
+}
+
+static int
+imu_write (struct imu_stream *imu, __u8 reg, __u8 value)
+{
+    struct i2c_txn txn = { LSM9DS1_SAD, reg, true, &value, 1, 0 };
+    struct i2c_request req = { imu->fd, &txn, 1, I2C_PRIO_CONFIG, 0, -1, 0 };
+
+    return i2c_bus_submit (&req);
+}
+
+static int
+imu_setup (struct imu_stream *imu)
+{
+    __u8 id;
+
+    if (imu_read (imu, LSM9DS1_WHO_AM_I, &id, 1) < 0)
+        return -1;
+    if (id != LSM9DS1_who_am_i)
+      {
+        errno = ENODEV;
+        log_error ("unexpected LSM9DS1 id");
+        return -1;
+      }
+
+    /* Restart from a known state, the FIFO is emptied by going through
+       bypass mode before continuous mode is selected */
+    if (imu_write (imu, LSM9DS1_CTRL_REG8,
+                   LSM9DS1_CTRL_REG8_BDU_if(1) |
+                   LSM9DS1_CTRL_REG8_IF_ADD_INC_if(1)) < 0 ||
+        imu_write (imu, LSM9DS1_CTRL_REG1_G,
+                   LSM9DS1_CTRL_REG1_G_ODR_G_if(0)) < 0 ||
+        imu_write (imu, LSM9DS1_CTRL_REG5_XL,
+                   LSM9DS1_CTRL_REG5_XL_Zen_XL_if(1) |
+                   LSM9DS1_CTRL_REG5_XL_Yen_XL_if(1) |
+                   LSM9DS1_CTRL_REG5_XL_Xen_XL_if(1)) < 0 ||
+        imu_write (imu, LSM9DS1_CTRL_REG6_XL,
+                   LSM9DS1_CTRL_REG6_XL_ODR_XL_if(IMU_ODR_XL) |
+                   LSM9DS1_CTRL_REG6_XL_FS_XL_if(IMU_FS_XL)) < 0 ||
+        imu_write (imu, LSM9DS1_FIFO_CTRL,
+                   LSM9DS1_FIFO_CTRL_FMODE_if(0)) < 0 ||
+        imu_write (imu, LSM9DS1_CTRL_REG9,
+                   LSM9DS1_CTRL_REG9_FIFO_EN_if(1)) < 0 ||
+        imu_write (imu, LSM9DS1_FIFO_CTRL,
+                   LSM9DS1_FIFO_CTRL_FMODE_if(6)) < 0)
+        return -1;
+
+    return 0;
+}
+
+int
+imu_init (struct imu_stream *imu, struct evcore *core, imu_landing_cb cb,
+          void *arg)
+{
+    int64_t interval = IMU_DRAIN_MS * NSEC_PER_MSEC;
+
+    memset (imu, 0, sizeof (*imu));
+    imu->fd = -1;
+    imu->cb = cb;
+    imu->arg = arg;
+    perch_init (&imu->det, IMU_ODR_HZ, IMU_UG_PER_COUNT);
+
+    imu->fd = i2c_open (DEVPATH_I2C);
+    if (imu->fd < 0)
+      {
+        log_error ("could not open i2c bus for LSM9DS1");
+        return -1;
+      }
+
+    if (imu_setup (imu) < 0)
+      {
+        log_error ("could not set up LSM9DS1");
+        imu_free (imu);
+        return -1;
+      }
+
+    if (evcore_timer_init (&imu->timer, core, imu_drain_cb, imu) < 0 ||
+        evcore_timer_set (&imu->timer, clock_ns (CLOCK_MONOTONIC) + interval,
+                          interval) < 0)
+      {
+        imu_free (imu);
+        return -1;
+      }
+
+    return 0;
+}
+
+void
+imu_free (struct imu_stream *imu)
+{
+    if (imu->timer.ev)
+      {
+        evcore_source_free (&imu->timer);
+        _log_debug ("imu: %" PRIu64 " samples in %" PRIu64 " bursts, "
+                    "%" PRIu64 " overruns, %" PRIu64 " errors, %u landings, "
+                    "%u rejected\n", imu->samples, imu->bursts,
+                    imu->overruns, imu->errors, imu->det.landings,
+                    imu->det.rejected);
+      }
+    if (imu->fd >= 0)
+      {
+        /* Leave the accelerometer powered down */
+        imu_write (imu, LSM9DS1_CTRL_REG6_XL,
+                   LSM9DS1_CTRL_REG6_XL_ODR_XL_if(0));
+        i2c_close (imu->fd);
+      }
+    imu->fd = -1;
+}
+
+static void
+imu_drain_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct imu_stream *imu = arg;
+    struct perch_landing landing;
+    __u8 src, buf[6];
+    int16_t a[3];
+    int64_t now;
+    int ii, n;
+
+    now = clock_ns (CLOCK_REALTIME);
+    if (imu_read (imu, LSM9DS1_FIFO_SRC, &src, 1) < 0)
+      {
+        imu->errors++;
+        return;
+      }
+
+    n = LSM9DS1_FIFO_SRC_FSS_ef(src);
+    if (LSM9DS1_FIFO_SRC_OVRN_ef(src))
+        imu->overruns++;
+    imu->bursts++;
+
+    /* Samples come out oldest first, the newest was taken about now */
+    for (ii = 0; ii < n; ii++)
+      {
+        if (imu_read (imu, LSM9DS1_OUT_X_XL, buf, sizeof (buf)) < 0)
+          {
+            imu->errors++;
+            return;
+          }
+        a[0] = (int16_t) (buf[0] | buf[1] << 8);
+        a[1] = (int16_t) (buf[2] | buf[3] << 8);
+        a[2] = (int16_t) (buf[4] | buf[5] << 8);
+        imu->samples++;
+
+        if (perch_update (&imu->det, a, now - (n - 1 - ii) * NSEC_PER_SEC /
+                          IMU_ODR_HZ, &landing))
+            imu->cb (&landing, imu->arg);
+      }
+}
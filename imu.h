@@ -0,0 +1,71 @@
+/*
+ *  imu.h
+ *    Streaming of the LSM9DS1 accelerometer FIFO into the perch landing
+ *    detector
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _IMU_H_
+#define _IMU_H_
+
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#include "perch.h"
+#include "evcore.h"
+
+/* Accelerometer only at 238 Hz and +-2 g, the gyroscope is powered down */
+#define IMU_ODR_XL       4
+#define IMU_ODR_HZ       238
+#define IMU_FS_XL        0
+#define IMU_UG_PER_COUNT 61
+
+/* The FIFO holds 32 samples, 134 ms at IMU_ODR_HZ. Drain it in bursts well
+   before it fills so no sample is lost to the continuous mode overwriting
+   the oldest ones. */
+#define IMU_FIFO_DEPTH 32
+#define IMU_DRAIN_MS   50
+
+typedef void (*imu_landing_cb) (const struct perch_landing *, void *);
+
+struct imu_stream {
+    int                   fd;
+    struct evcore_source  timer;
+    struct perch_detector det;
+    imu_landing_cb        cb;
+    void                 *arg;
+    uint64_t              samples;
+    uint64_t              bursts;
+    uint64_t              overruns;     /* bursts that found the FIFO full */
+    uint64_t              errors;
+};
+
+/*
+ * Bring up the accelerometer with its FIFO in continuous mode and start
+ * draining it from the event loop. cb is called from the loop for every
+ * landing detected.
+ */
+extern int imu_init (struct imu_stream *, struct evcore *, imu_landing_cb,
+                     void *);
+
+extern void imu_free (struct imu_stream *);
+
+#endif /* _IMU_H_ */
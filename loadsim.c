@@ -0,0 +1,728 @@
+/*
+ *  loadsim.c
+ *    Load generator running many emulated slaves against a local master
+ *    stand-in, for throughput, latency and reconnect storm measurements
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/thread.h>
+
+#include "loadsim.h"
+#include "acquire.h"
+#include "common.h"
+#include "log.h"
+
+/* Samples each emulated slave collects per report */
+#define LOADSIM_SAMPLES 4
+
+/* Accepts after a storm are counted in buckets of this many nanoseconds */
+#define LOADSIM_BUCKET (100 * NSEC_PER_MSEC)
+
+/* Time the clients are given to connect before the first report */
+#define LOADSIM_SETTLE NSEC_PER_SEC
+
+struct loadsim;
+
+struct sim_client {
+    struct loadsim        *sim;
+    struct fg_events_data  etdata;
+    struct acquisition     acq;         /* only the windows are used */
+    __s32                  raw[SENSOR_CHANNELS];
+    unsigned               seed;
+    bool                   connected;
+    atomic_bool            lost;        /* set from the fgevents thread */
+};
+
+struct sim_conn {
+    struct sim_master  *m;
+    struct bufferevent *bev;
+    int64_t             period;     /* last period a read was timed in */
+    struct sim_conn    *prev, *next;
+};
+
+struct sim_storm {
+    int64_t at;         /* nanoseconds since the first report boundary */
+    int     dropped;
+    int     accepted;
+    int64_t recovered;  /* until as many accepts as dropped, -1 if never */
+    int64_t bucket;
+    int     in_bucket;
+    int     peak;       /* most accepts within one bucket */
+};
+
+/* Master stand-in, everything is touched from its own thread only */
+struct sim_master {
+    struct event_base     *base;
+    struct evconnlistener *listener;
+    struct event          *storm_ev;
+    pthread_t              thread;
+    int                    port;
+    int64_t                start;
+    int64_t                period;
+    struct sim_conn       *conns;
+    int                    n_conns;
+    uint64_t               accepts;
+    uint64_t               bytes;
+    int64_t               *latency;
+    size_t                 n_latency, max_latency;
+    struct sim_storm       storms[LOADSIM_MAX_STORMS];
+    int                    n_storms;
+    bool                   storming;
+};
+
+struct sim_worker {
+    struct loadsim    *sim;
+    struct sim_client *clients;
+    int                n_clients;
+    pthread_t          thread;
+    int64_t           *send_ns;
+    size_t             n_send, max_send;
+    uint64_t           sent;
+    uint64_t           errors;
+    uint64_t           attempts;
+    uint64_t           failed;
+};
+
+struct loadsim {
+    const struct loadsim_config *cfg;
+    loadsim_send_fn       send;
+    int64_t               start;    /* CLOCK_MONOTONIC, first boundary */
+    int64_t               period;
+    int                   periods;
+    atomic_uint_least64_t lost;
+    struct sim_master     master;
+    struct sim_worker     workers[LOADSIM_THREADS];
+    int                   n_workers;
+};
+
+/* Clients are shut down while their fgevents threads may still report the
+   closed connection, so this must not live in the freed clients */
+static atomic_bool stopping;
+
+static char master_addr[] = "127.0.0.1";
+
+static int
+client_event (void *arg, struct fgevent *fgev,
+              struct fgevent * UNUSED(ansev))
+{
+    struct sim_client *c = arg;
+
+    if (fgev != NULL || atomic_load (&stopping))
+        return 0;
+
+    atomic_store (&c->lost, true);
+    atomic_fetch_add (&c->sim->lost, 1);
+    return 0;
+}
+
+/* Random walk around typical readings, a few samples per report */
+static unsigned
+client_sample (struct sim_client *c, struct SensorData *data)
+{
+    static const int step[SENSOR_CHANNELS] = { 40, 3, 5 };
+    struct SensorSample sample;
+    int ii, ch;
+
+    sample.mask = SENSOR_ALL;
+    for (ii = 0; ii < LOADSIM_SAMPLES; ii++)
+      {
+        for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+          {
+            c->raw[ch] += (int) (rand_r (&c->seed) % (2 * step[ch] + 1))
+                          - step[ch];
+            sample.raw[ch] = c->raw[ch];
+          }
+        acquire_store (&c->acq, &sample);
+      }
+
+    return acquire_publish (&c->acq, data);
+}
+
+static void
+client_init (struct loadsim *sim, struct sim_client *c, unsigned seed)
+{
+    memset (c, 0, sizeof (*c));
+    c->sim = sim;
+    c->seed = seed;
+    c->raw[SENSOR_PRESSURE] = 1013 * 4096 + (int) (rand_r (&c->seed) % 40960);
+    c->raw[SENSOR_TEMPERATURE] = 1500 + (int) (rand_r (&c->seed) % 1000);
+    c->raw[SENSOR_HUMIDITY] = 4000 + (int) (rand_r (&c->seed) % 3000);
+    atomic_init (&c->lost, false);
+}
+
+static void
+client_connect (struct sim_worker *w, struct sim_client *c)
+{
+    int s;
+
+    if (atomic_exchange (&c->lost, false) && c->connected)
+      {
+        fg_events_client_shutdown (&c->etdata);
+        c->connected = false;
+      }
+    if (c->connected)
+        return;
+
+    w->attempts++;
+    s = fg_events_client_init_inet (&c->etdata, &client_event, NULL, c,
+                                    master_addr, w->sim->master.port,
+                                    FG_SLAVE);
+    if (s != 0)
+      {
+        w->failed++;
+        return;
+      }
+    c->connected = true;
+}
+
+static void *
+worker_thread (void *arg)
+{
+    struct sim_worker *w = arg;
+    struct loadsim *sim = w->sim;
+    struct sim_client *c;
+    struct SensorData data;
+    struct timespec ts;
+    int64_t deadline, t0, t1;
+    unsigned mask;
+    int k, ii;
+
+    for (ii = 0; ii < w->n_clients; ii++)
+        client_connect (w, &w->clients[ii]);
+
+    for (k = 0; k < sim->periods; k++)
+      {
+        deadline = sim->start + k * sim->period;
+        ts.tv_sec = deadline / NSEC_PER_SEC;
+        ts.tv_nsec = deadline % NSEC_PER_SEC;
+        while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                NULL) == EINTR);
+
+        for (ii = 0; ii < w->n_clients; ii++)
+          {
+            c = &w->clients[ii];
+            client_connect (w, c);
+            if (!c->connected)
+                continue;
+
+            mask = client_sample (c, &data);
+            t0 = clock_ns (CLOCK_MONOTONIC);
+            if (sim->send (&c->etdata, &data, mask, true,
+                           (int32_t) (data.temperature * 10.0f) - 50) < 0)
+              {
+                w->errors++;
+                continue;
+              }
+            t1 = clock_ns (CLOCK_MONOTONIC);
+
+            w->sent++;
+            if (w->n_send < w->max_send)
+                w->send_ns[w->n_send++] = t1 - t0;
+          }
+      }
+
+    return NULL;
+}
+
+static void
+conn_free (struct sim_conn *conn)
+{
+    struct sim_master *m = conn->m;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        m->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    m->n_conns--;
+
+    bufferevent_free (conn->bev);
+    free (conn);
+}
+
+/* Time the first bytes of every period against the boundary the clients
+   woke up on, which does not depend on the framing of the reports */
+static void
+conn_read_cb (struct bufferevent *bev, void *arg)
+{
+    struct sim_conn *conn = arg;
+    struct sim_master *m = conn->m;
+    struct evbuffer *input = bufferevent_get_input (bev);
+    int64_t now, k;
+    size_t len;
+
+    now = clock_ns (CLOCK_MONOTONIC);
+    len = evbuffer_get_length (input);
+    m->bytes += len;
+    evbuffer_drain (input, len);
+
+    /* A stand-in started on its own only counts bytes */
+    if (!m->period || now < m->start)
+        return;
+
+    k = (now - m->start) / m->period;
+    if (k == conn->period)
+        return;
+    conn->period = k;
+
+    if (m->n_latency < m->max_latency)
+        m->latency[m->n_latency++] = now - m->start - k * m->period;
+}
+
+static void
+conn_event_cb (struct bufferevent * UNUSED(bev), short events, void *arg)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        conn_free (arg);
+}
+
+static void
+storm_accept (struct sim_master *m, int64_t now)
+{
+    struct sim_storm *st = &m->storms[m->n_storms - 1];
+    int64_t since = now - m->start - st->at;
+
+    if (since / LOADSIM_BUCKET != st->bucket)
+      {
+        st->bucket = since / LOADSIM_BUCKET;
+        st->in_bucket = 0;
+      }
+    if (++st->in_bucket > st->peak)
+        st->peak = st->in_bucket;
+
+    if (++st->accepted >= st->dropped)
+      {
+        st->recovered = since;
+        m->storming = false;
+      }
+}
+
+static void
+accept_cb (struct evconnlistener * UNUSED(listener), evutil_socket_t fd,
+           struct sockaddr * UNUSED(addr), int UNUSED(len), void *arg)
+{
+    struct sim_master *m = arg;
+    struct sim_conn *conn;
+
+    conn = calloc (1, sizeof (*conn));
+    if (!conn)
+      {
+        log_error ("calloc failed for simulated connection");
+        evutil_closesocket (fd);
+        return;
+      }
+
+    conn->bev = bufferevent_socket_new (m->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!conn->bev)
+      {
+        log_error ("could not create bufferevent for simulated connection");
+        evutil_closesocket (fd);
+        free (conn);
+        return;
+      }
+    conn->m = m;
+    conn->period = -1;
+    bufferevent_setcb (conn->bev, conn_read_cb, NULL, conn_event_cb, conn);
+    bufferevent_enable (conn->bev, EV_READ);
+
+    conn->next = m->conns;
+    if (m->conns)
+        m->conns->prev = conn;
+    m->conns = conn;
+    m->n_conns++;
+    m->accepts++;
+
+    if (m->storming)
+        storm_accept (m, clock_ns (CLOCK_MONOTONIC));
+}
+
+/* Drop every connection at once, as a restarting master would */
+static void
+storm_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void *arg)
+{
+    struct sim_master *m = arg;
+    struct sim_storm *st;
+
+    if (m->n_storms == LOADSIM_MAX_STORMS)
+        return;
+
+    st = &m->storms[m->n_storms++];
+    memset (st, 0, sizeof (*st));
+    st->at = clock_ns (CLOCK_MONOTONIC) - m->start;
+    st->dropped = m->n_conns;
+    st->recovered = -1;
+    m->storming = st->dropped > 0;
+
+    while (m->conns)
+        conn_free (m->conns);
+}
+
+static void *
+master_thread (void *arg)
+{
+    struct sim_master *m = arg;
+
+    event_base_dispatch (m->base);
+    return NULL;
+}
+
+static int
+master_start (struct sim_master *m, int storm)
+{
+    struct sockaddr_in sin;
+    socklen_t len;
+    int s;
+
+    m->base = event_base_new ();
+    if (!m->base)
+      {
+        log_error ("could not create event base for master stand-in");
+        return -1;
+      }
+
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    m->listener = evconnlistener_new_bind (m->base, accept_cb, m,
+                                           LEV_OPT_CLOSE_ON_FREE |
+                                           LEV_OPT_REUSEABLE, -1,
+                                           (struct sockaddr *) &sin,
+                                           sizeof (sin));
+    if (!m->listener)
+      {
+        log_error_en (errno, "could not listen for simulated slaves");
+        return -1;
+      }
+
+    len = sizeof (sin);
+    if (getsockname (evconnlistener_get_fd (m->listener),
+                     (struct sockaddr *) &sin, &len) < 0)
+      {
+        log_error_en (errno, "getsockname failed on master stand-in");
+        return -1;
+      }
+    m->port = ntohs (sin.sin_port);
+
+    if (storm > 0)
+      {
+        struct timeval tv = { storm, 0 };
+
+        m->storm_ev = event_new (m->base, -1, EV_PERSIST, storm_cb, m);
+        if (!m->storm_ev || event_add (m->storm_ev, &tv) < 0)
+          {
+            log_error ("could not schedule reconnect storms");
+            return -1;
+          }
+      }
+
+    s = pthread_create (&m->thread, NULL, master_thread, m);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create master stand-in thread");
+        return -1;
+      }
+
+    return 0;
+}
+
+static void
+master_free (struct sim_master *m)
+{
+    while (m->conns)
+        conn_free (m->conns);
+    if (m->storm_ev)
+        event_free (m->storm_ev);
+    if (m->listener)
+        evconnlistener_free (m->listener);
+    if (m->base)
+        event_base_free (m->base);
+    free (m->latency);
+}
+
+struct sim_master *
+loadsim_master_start (void)
+{
+    struct sim_master *m;
+
+    m = calloc (1, sizeof (*m));
+    if (!m)
+      {
+        log_error ("calloc failed for master stand-in");
+        return NULL;
+      }
+
+    evthread_use_pthreads ();
+    if (master_start (m, 0) < 0)
+      {
+        master_free (m);
+        free (m);
+        return NULL;
+      }
+
+    return m;
+}
+
+int
+loadsim_master_port (const struct sim_master *m)
+{
+    return m->port;
+}
+
+uint64_t
+loadsim_master_stop (struct sim_master *m)
+{
+    uint64_t bytes;
+
+    event_base_loopexit (m->base, NULL);
+    pthread_join (m->thread, NULL);
+
+    bytes = m->bytes;
+    master_free (m);
+    free (m);
+    return bytes;
+}
+
+static int
+compare_s64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+print_distribution (const char *name, int64_t *v, size_t n)
+{
+    static const double pct[] = { 0.0, 50.0, 90.0, 99.0, 99.9, 100.0 };
+    size_t ii, idx;
+
+    printf ("%-10s", name);
+    if (n == 0)
+      {
+        printf (" no samples\n");
+        return;
+      }
+
+    qsort (v, n, sizeof (int64_t), compare_s64);
+    for (ii = 0; ii < sizeof (pct) / sizeof (pct[0]); ii++)
+      {
+        idx = (size_t) (pct[ii] / 100.0 * (n - 1) + 0.5);
+        printf (" %9.1f", (double) v[idx] / 1000.0);
+      }
+    printf ("\n");
+}
+
+static void
+print_results (struct loadsim *sim)
+{
+    struct sim_master *m = &sim->master;
+    struct sim_storm *st;
+    uint64_t sent, errors, attempts, failed;
+    int64_t *send_ns;
+    size_t n_send;
+    double elapsed;
+    int ii;
+
+    sent = errors = attempts = failed = 0;
+    n_send = 0;
+    for (ii = 0; ii < sim->n_workers; ii++)
+        n_send += sim->workers[ii].n_send;
+    send_ns = malloc (sizeof (int64_t) * (n_send ? n_send : 1));
+
+    n_send = 0;
+    for (ii = 0; ii < sim->n_workers; ii++)
+      {
+        struct sim_worker *w = &sim->workers[ii];
+
+        sent += w->sent;
+        errors += w->errors;
+        attempts += w->attempts;
+        failed += w->failed;
+        if (send_ns)
+            memcpy (send_ns + n_send, w->send_ns, sizeof (int64_t) * w->n_send);
+        n_send += w->n_send;
+      }
+
+    elapsed = (double) sim->periods * sim->period / NSEC_PER_SEC;
+    printf ("%d clients, %d ms period, %d threads, %.1f s\n",
+            sim->cfg->clients, sim->cfg->period_ms, sim->n_workers, elapsed);
+    printf ("sent %" PRIu64 " reports (%.1f/s), %" PRIu64 " send errors\n",
+            sent, sent / elapsed, errors);
+    printf ("master received %" PRIu64 " bytes (%.1f/s) on %" PRIu64
+            " connections\n", m->bytes, m->bytes / elapsed, m->accepts);
+    printf ("%-10s %9s %9s %9s %9s %9s %9s  (us)\n", "latency", "min", "p50",
+            "p90", "p99", "p99.9", "max");
+    print_distribution ("arrival", m->latency, m->n_latency);
+    if (send_ns)
+        print_distribution ("send", send_ns, n_send);
+    printf ("connects: %" PRIu64 " attempts, %" PRIu64 " failed, %" PRIu64
+            " connections lost\n", attempts, failed, atomic_load (&sim->lost));
+
+    for (ii = 0; ii < m->n_storms; ii++)
+      {
+        st = &m->storms[ii];
+        printf ("storm at %.1f s: %d dropped, ",
+                (double) st->at / NSEC_PER_SEC, st->dropped);
+        if (st->recovered >= 0)
+            printf ("back in %.1f ms", (double) st->recovered / NSEC_PER_MSEC);
+        else
+            printf ("%d of them back", st->accepted);
+        printf (", peak %d accepts per 100 ms\n", st->peak);
+      }
+
+    free (send_ns);
+}
+
+/* Every simulated slave needs a socket on both ends */
+static void
+raise_fd_limit (int clients)
+{
+    struct rlimit rl;
+
+    if (getrlimit (RLIMIT_NOFILE, &rl) < 0)
+        return;
+    if (rl.rlim_cur >= (rlim_t) clients * 2 + 64)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit (RLIMIT_NOFILE, &rl) < 0 ||
+        rl.rlim_cur < (rlim_t) clients * 2 + 64)
+        log_error ("file descriptor limit too low for all simulated slaves");
+}
+
+int
+loadsim_run (const struct loadsim_config *cfg, loadsim_send_fn send)
+{
+    struct loadsim *sim;
+    struct sim_client *clients;
+    struct sim_worker *w;
+    size_t per_worker;
+    int ii, first, n, s, ret = -1;
+
+    if (cfg->clients < 1 || cfg->duration < 1 || cfg->period_ms < 1)
+        return -1;
+
+    sim = calloc (1, sizeof (*sim));
+    clients = calloc (cfg->clients, sizeof (*clients));
+    if (!sim || !clients)
+      {
+        log_error ("calloc failed for load simulation");
+        free (sim);
+        free (clients);
+        return -1;
+      }
+
+    evthread_use_pthreads ();
+    raise_fd_limit (cfg->clients);
+
+    /* The emulated readings are plain fixed point, no calibration */
+    sensors_set_conversion (SENSOR_PRESSURE, 1.0f / 4096.0f, 0.0f);
+    sensors_set_conversion (SENSOR_TEMPERATURE, 0.01f, 0.0f);
+    sensors_set_conversion (SENSOR_HUMIDITY, 0.01f, 0.0f);
+
+    sim->cfg = cfg;
+    sim->send = send;
+    sim->period = cfg->period_ms * NSEC_PER_MSEC;
+    sim->periods = (int) ((int64_t) cfg->duration * NSEC_PER_SEC / sim->period);
+    if (sim->periods < 1)
+        sim->periods = 1;
+    atomic_init (&sim->lost, 0);
+    atomic_store (&stopping, false);
+
+    for (ii = 0; ii < cfg->clients; ii++)
+        client_init (sim, &clients[ii], (unsigned) ii * 2654435761u + 1);
+
+    sim->start = clock_ns (CLOCK_MONOTONIC) + LOADSIM_SETTLE;
+    sim->master.start = sim->start;
+    sim->master.period = sim->period;
+    sim->master.max_latency = (size_t) cfg->clients * (sim->periods + 1);
+    sim->master.latency = malloc (sizeof (int64_t) * sim->master.max_latency);
+    if (!sim->master.latency)
+      {
+        log_error ("malloc failed for latency samples");
+        goto out;
+      }
+
+    if (master_start (&sim->master, cfg->storm) < 0)
+        goto out;
+
+    /* Split the clients as evenly as possible over the workers */
+    sim->n_workers = cfg->clients < LOADSIM_THREADS ? cfg->clients
+                                                    : LOADSIM_THREADS;
+    for (ii = 0, first = 0; ii < sim->n_workers; ii++, first += n)
+      {
+        n = cfg->clients / sim->n_workers +
+            (ii < cfg->clients % sim->n_workers);
+        w = &sim->workers[ii];
+        w->sim = sim;
+        w->clients = clients + first;
+        w->n_clients = n;
+        per_worker = (size_t) n * sim->periods;
+        w->send_ns = malloc (sizeof (int64_t) * per_worker);
+        w->max_send = w->send_ns ? per_worker : 0;
+      }
+
+    for (ii = 0; ii < sim->n_workers; ii++)
+      {
+        s = pthread_create (&sim->workers[ii].thread, NULL, worker_thread,
+                            &sim->workers[ii]);
+        if (s != 0)
+          {
+            log_error_en (s, "could not create load simulation thread");
+            sim->n_workers = ii;
+            break;
+          }
+      }
+    for (ii = 0; ii < sim->n_workers; ii++)
+        pthread_join (sim->workers[ii].thread, NULL);
+
+    atomic_store (&stopping, true);
+    for (ii = 0; ii < cfg->clients; ii++)
+        if (clients[ii].connected)
+            fg_events_client_shutdown (&clients[ii].etdata);
+
+    event_base_loopexit (sim->master.base, NULL);
+    pthread_join (sim->master.thread, NULL);
+
+    print_results (sim);
+    ret = 0;
+
+  out:
+    for (ii = 0; ii < LOADSIM_THREADS; ii++)
+        free (sim->workers[ii].send_ns);
+    master_free (&sim->master);
+    free (clients);
+    free (sim);
+    return ret;
+}
@@ -0,0 +1,74 @@
+/*
+ *  loadsim.h
+ *    Load generator running many emulated slaves against a local master
+ *    stand-in, for throughput, latency and reconnect storm measurements
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _LOADSIM_H_
+#define _LOADSIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <fgevents.h>
+
+#include "sensors.h"
+
+/* Threads the simulated slaves are spread over */
+#define LOADSIM_THREADS 8
+
+#define LOADSIM_DEFAULT_DURATION 60
+
+/* Reconnect storms recorded in the summary */
+#define LOADSIM_MAX_STORMS 32
+
+struct loadsim_config {
+    int clients;        /* number of simulated FG_SLAVE connections */
+    int duration;       /* seconds to run */
+    int period_ms;      /* report period of every client */
+    int storm;          /* seconds between dropping all connections, 0 = never */
+};
+
+/* Builds and sends one report the way the slave does, < 0 on failure */
+typedef int (*loadsim_send_fn) (struct fg_events_data *,
+                                 const struct SensorData *, unsigned, bool,
+                                 int32_t);
+
+/*
+ * Run cfg->clients emulated slaves in this process, each reporting through
+ * send every period to a master stand-in listening on the loopback. Prints
+ * send throughput, latency percentiles and how quickly the clients came back
+ * after each storm. Returns -1 if the run could not be set up.
+ */
+extern int loadsim_run (const struct loadsim_config *, loadsim_send_fn);
+
+struct sim_master;
+
+/* Master stand-in on its own that accepts FG_SLAVE connections on the
+   loopback and discards what they send, NULL if it could not listen */
+extern struct sim_master *loadsim_master_start (void);
+
+extern int loadsim_master_port (const struct sim_master *);
+
+/* Stop the stand-in, returns the number of bytes it received */
+extern uint64_t loadsim_master_stop (struct sim_master *);
+
+#endif /* _LOADSIM_H_ */
@@ -24,22 +24,106 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "log.h"
+#include "uring.h"
+
+/* Files stdout and stderr are written through while a ring is set */
+static struct {
+    pthread_rwlock_t  lock;     /* held for reading while writing */
+    struct uring     *ring;
+    struct uring_file out;
+    struct uring_file err;
+} async = { PTHREAD_RWLOCK_INITIALIZER, NULL, { 0 }, { 0 } };
+
+static void
+log_vprintf (FILE *stream, const char *format, va_list args)
+{
+    struct uring_file *f = NULL;
+    int len, save_errno = errno;
+    char *line;
+
+    pthread_rwlock_rdlock (&async.lock);
+    if (async.ring)
+        f = stream == stdout ? &async.out : stream == stderr ? &async.err :
+            NULL;
+
+    /* A whole line in one write, lines from other threads stay intact */
+    if (!f)
+        vfprintf (stream, format, args);
+    else if ((len = vasprintf (&line, format, args)) >= 0)
+      {
+        uring_file_write (f, line, len);
+        free (line);
+      }
+    pthread_rwlock_unlock (&async.lock);
+
+    errno = save_errno;
+}
+
+void
+log_printf (FILE *stream, const char *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    log_vprintf (stream, format, args);
+    va_end (args);
+}
 
 /* This function is prints a debug message with timestamp */
 void
 log_debug (const char *format, ...)
 {
     char *timestamp = fetch_timestamp ();
+    char *msg;
+    va_list args;
+    int len;
+
+    va_start (args, format);
+    len = vasprintf (&msg, format, args);
+    va_end (args);
+    if (len < 0)
+        msg = NULL;
+
     if (timestamp)
+        log_printf (stdout, "[DEBUG: %s] %s", timestamp, msg ? msg : format);
+    else
+        log_printf (stdout, "%s", msg ? msg : format);
+
+    free (timestamp);
+    free (msg);
+}
+
+void
+log_use_uring (struct uring *ring)
+{
+    struct uring *old;
+
+    pthread_rwlock_wrlock (&async.lock);
+    old = async.ring;
+    if (ring && !old)
       {
-		    fprintf (stdout, "[DEBUG: %s] ", timestamp);		
-        free (timestamp);
+        fflush (stdout);
+        fflush (stderr);
+        uring_file_init (&async.out, ring, STDOUT_FILENO);
+        uring_file_init (&async.err, ring, STDERR_FILENO);
+        async.ring = ring;
       }
+    else if (!ring)
+        async.ring = NULL;
+    pthread_rwlock_unlock (&async.lock);
 
-    va_list args;
-    va_start (args, format);		
-    vfprintf (stdout, format, args);
-    va_end (args);
-}
\ No newline at end of file
+    if (ring || !old)
+        return;
+
+    /* Nobody writes to the files any more */
+    uring_run (old);
+    if (async.out.dropped + async.err.dropped)
+        fprintf (stderr, "%s: %" PRIu64 " bytes of log lost\n", __progname,
+                 async.out.dropped + async.err.dropped);
+    uring_file_free (&async.out);
+    uring_file_free (&async.err);
+}
@@ -31,8 +31,18 @@
 
 #include "common.h"
 
+struct uring;
+
 extern void log_debug (const char *, ...);
 
+/* fprintf to stdout or stderr, through the ring given to log_use_uring */
+extern void log_printf (FILE *, const char *, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/* Write the log through ring so that no thread blocks on a slow terminal
+   or disk, NULL waits for what is in flight and goes back to stdio */
+extern void log_use_uring (struct uring *);
+
 /* If _DEBUG is not defined, we simply replace all _log_debug with nothing */
 #ifndef _DEBUG
 #define _log_debug(format, ...)
@@ -41,8 +51,8 @@ extern void log_debug (const char *, ...);
 #endif
 
 #define log_error_no_timestamp(msg)\
-          fprintf (stderr, "%s: %s: %d: %s: %s\n", __progname,\
-                   __FILE__, __LINE__, msg, strerror (errno))
+          log_printf (stderr, "%s: %s: %d: %s: %s\n", __progname,\
+                      __FILE__, __LINE__, msg, strerror (errno))
 
 /* The do { ... } while(0) part is a workaround for the issue of using these
    macros on a single line if statement without a body */
@@ -54,9 +64,9 @@ extern void log_debug (const char *, ...);
             char *timestamp = fetch_timestamp ();\
             if (timestamp)\
               {\
-                fprintf (stderr, "[%s] %s: %s: %d: %s: %s\n", timestamp,\
-                         __progname, __FILE__, __LINE__, msg,\
-                         strerror (errno));\
+                log_printf (stderr, "[%s] %s: %s: %d: %s: %s\n",\
+                            timestamp, __progname, __FILE__, __LINE__, msg,\
+                            strerror (errno));\
                 free (timestamp);\
               }\
             else\
@@ -82,7 +92,7 @@ fetch_timestamp ()
         time_t ltime;
         char *p;
 
-        ltime = time (NULL);
+        ltime = (time_t) (clock_ns (CLOCK_REALTIME) / NSEC_PER_SEC);
         localtime_r (&ltime, &result);
         asctime_r (&result, stime);
 
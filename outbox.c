@@ -0,0 +1,485 @@
+/*
+ *  outbox.c
+ *    Bounded queue of events for the master, sent from a thread of its own
+ *    so a slow master or network cannot stall reporting or grow memory
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "outbox.h"
+#include "common.h"
+#include "log.h"
+
+static struct outbox_msg *
+msg_at (struct outbox *ob, int pos)
+{
+    return &ob->ring[(ob->head + pos) % ob->capacity];
+}
+
+static void
+msg_set (struct outbox_msg *m, const struct fgevent *fgev, unsigned flags)
+{
+    m->id = fgev->id;
+    m->receiver = fgev->receiver;
+    m->writeback = fgev->writeback;
+    m->length = fgev->length;
+    m->flags = (int32_t) flags;
+    if (fgev->length)
+        memcpy (m->payload, fgev->payload, sizeof (int32_t) * fgev->length);
+}
+
+/* Remove the event pos places from the oldest, the older ones move up */
+static void
+ring_remove (struct outbox *ob, int pos)
+{
+    for (; pos > 0; pos--)
+        *msg_at (ob, pos) = *msg_at (ob, pos - 1);
+    ob->head = (ob->head + 1) % ob->capacity;
+    ob->n--;
+}
+
+/* A reference is gone, caller holds the lock */
+static void
+lost_reference (struct outbox *ob)
+{
+    if (ob->lost_cb)
+        ob->lost_cb (ob->lost_arg);
+}
+
+/* Forget everything on disk, caller holds the lock */
+static void
+spill_reset (struct outbox *ob)
+{
+    ob->spill_n = 0;
+    ob->spill_read = 0;
+    if (ftruncate (fileno (ob->spill), 0) < 0)
+        log_error_en (errno, "could not truncate outbox spill file");
+}
+
+/*
+ * Move the events on disk that were not sent yet to the start of the spill
+ * file, the next run reads it from the start. Caller holds the lock or is
+ * the only user left.
+ */
+static void
+spill_compact (struct outbox *ob)
+{
+    struct outbox_msg m;
+    long from = ob->spill_read, to = 0;
+    int ii;
+
+    if (!ob->spill_read)
+        return;
+
+    for (ii = 0; ii < ob->spill_n; ii++)
+      {
+        if (fseek (ob->spill, from, SEEK_SET) < 0 ||
+            fread (&m, sizeof (m), 1, ob->spill) != 1 ||
+            fseek (ob->spill, to, SEEK_SET) < 0 ||
+            fwrite (&m, sizeof (m), 1, ob->spill) != 1)
+          {
+            log_error_en (errno, "could not compact outbox spill file");
+            break;
+          }
+        from += sizeof (m);
+        to += sizeof (m);
+      }
+
+    /* Better to lose what is left than to send it all again */
+    ob->stats.dropped += ob->spill_n - ii;
+    ob->spill_n = ii;
+    ob->spill_read = 0;
+    if (fflush (ob->spill) != 0 || ftruncate (fileno (ob->spill), to) < 0)
+        log_error_en (errno, "could not truncate outbox spill file");
+}
+
+/* Move the oldest event in memory to the end of the spill file */
+static int
+spill_oldest (struct outbox *ob)
+{
+    if (!ob->spill || ob->spill_n >= OUTBOX_SPILL_MAX)
+        return -1;
+
+    if (fseek (ob->spill, 0, SEEK_END) < 0 ||
+        fwrite (msg_at (ob, 0), sizeof (struct outbox_msg), 1, ob->spill) != 1 ||
+        fflush (ob->spill) != 0)
+      {
+        log_error_en (errno, "could not spill event to disk");
+        return -1;
+      }
+
+    ring_remove (ob, 0);
+    ob->spill_n++;
+    ob->stats.spilled++;
+    return 0;
+}
+
+/* Read back the oldest event on disk */
+static int
+unspill (struct outbox *ob, struct outbox_msg *m)
+{
+    if (fseek (ob->spill, ob->spill_read, SEEK_SET) < 0 ||
+        fread (m, sizeof (*m), 1, ob->spill) != 1 ||
+        m->length < 0 || m->length > OUTBOX_MAX_PAYLOAD)
+      {
+        log_error ("could not read spilled events, dropping them");
+        ob->stats.dropped += ob->spill_n;
+        lost_reference (ob);
+        spill_reset (ob);
+        return -1;
+      }
+
+    ob->spill_read += sizeof (*m);
+    if (--ob->spill_n == 0)
+        spill_reset (ob);
+    return 0;
+}
+
+/*
+ * Whether the event pos places from the oldest may be dropped to make room
+ * for fgev. A reference may only go once a newer one took over and no
+ * report depends on it any more.
+ */
+static bool
+droppable (struct outbox *ob, int pos, const struct fgevent *fgev,
+           unsigned flags)
+{
+    struct outbox_msg *m = msg_at (ob, pos), *next;
+
+    if (!(m->flags & OUTBOX_REPORT))
+        return false;
+    if (!(m->flags & OUTBOX_REFERENCE))
+        return true;
+
+    for (pos++; pos < ob->n; pos++)
+      {
+        next = msg_at (ob, pos);
+        if ((next->flags & OUTBOX_REPORT) && next->id == m->id)
+            return next->flags & OUTBOX_REFERENCE;
+      }
+    return (flags & OUTBOX_REFERENCE) && fgev->id == m->id;
+}
+
+/*
+ * Make room in a full queue for fgev. Returns 1 if there is room now, 0 if
+ * fgev was coalesced into a queued report and -1 if it was dropped.
+ */
+static int
+make_room (struct outbox *ob, const struct fgevent *fgev, unsigned flags)
+{
+    struct outbox_msg *m;
+    int pos;
+
+    switch (ob->policy)
+      {
+        case OUTBOX_COALESCE:
+            for (pos = ob->n - 1; (flags & OUTBOX_REPORT) && pos >= 0; pos--)
+              {
+                m = msg_at (ob, pos);
+                if (!(m->flags & OUTBOX_REPORT) || m->id != fgev->id)
+                    continue;
+                /* Only a newer reference replaces a reference */
+                if ((m->flags & OUTBOX_REFERENCE) &&
+                    !(flags & OUTBOX_REFERENCE))
+                    break;
+                msg_set (m, fgev, flags);
+                ob->stats.coalesced++;
+                return 0;
+              }
+            break;
+        case OUTBOX_SPILL:
+            if (spill_oldest (ob) == 0)
+                return 1;
+            break;
+        default:
+            break;
+      }
+
+    /* Reports go before any other event */
+    for (pos = 0; pos < ob->n; pos++)
+      {
+        if (droppable (ob, pos, fgev, flags))
+            break;
+      }
+    ob->stats.dropped++;
+    if (pos == ob->n)
+      {
+        if (flags & OUTBOX_REPORT)
+          {
+            if (flags & OUTBOX_REFERENCE)
+                lost_reference (ob);
+            return -1;
+          }
+        pos = 0;
+      }
+    if (msg_at (ob, pos)->flags & OUTBOX_REFERENCE)
+        lost_reference (ob);
+    ring_remove (ob, pos);
+    return 1;
+}
+
+/* Hold the clock of ob->core while there is anything to send, caller holds
+   ob->lock */
+static void
+update_hold (struct outbox *ob)
+{
+    bool busy = ob->n || ob->spill_n || ob->sending;
+
+    if (!ob->core || busy == ob->holding)
+        return;
+
+    ob->holding = busy;
+    if (busy)
+        evcore_hold (ob->core);
+    else
+        evcore_release (ob->core);
+}
+
+static void *
+outbox_thread (void *arg)
+{
+    struct outbox *ob = arg;
+    struct outbox_msg m;
+    struct fgevent fgev;
+    int res;
+
+    pthread_mutex_lock (&ob->lock);
+    for (;;)
+      {
+        while (!ob->stopping && !ob->n && !ob->spill_n)
+            pthread_cond_wait (&ob->cond, &ob->lock);
+        if (ob->stopping)
+            break;
+
+        /* Whatever is on disk is older than what is in memory */
+        if (ob->spill_n)
+          {
+            if (unspill (ob, &m) < 0)
+                continue;
+          }
+        else
+          {
+            m = *msg_at (ob, 0);
+            ring_remove (ob, 0);
+          }
+        ob->sending = true;
+        pthread_mutex_unlock (&ob->lock);
+
+        fgev.id = m.id;
+        fgev.receiver = m.receiver;
+        fgev.writeback = m.writeback;
+        fgev.length = m.length;
+        fgev.payload = m.payload;
+        res = fg_send_event (ob->etdata, &fgev);
+
+        pthread_mutex_lock (&ob->lock);
+        /* The master may not have the reference later reports need */
+        if (res < 0 && (m.flags & OUTBOX_REFERENCE))
+            lost_reference (ob);
+        if (res < 0)
+            ob->stats.errors++;
+        else
+            ob->stats.sent++;
+        ob->sending = false;
+        update_hold (ob);
+      }
+    pthread_mutex_unlock (&ob->lock);
+
+    return NULL;
+}
+
+int
+outbox_parse_policy (const char *name)
+{
+    if (strcasecmp (name, "drop") == 0)
+        return OUTBOX_DROP_OLDEST;
+    if (strcasecmp (name, "coalesce") == 0)
+        return OUTBOX_COALESCE;
+    if (strcasecmp (name, "spill") == 0)
+        return OUTBOX_SPILL;
+    return -1;
+}
+
+int
+outbox_init (struct outbox *ob, struct fg_events_data *etdata,
+             enum outbox_policy policy, int depth, const char *spill_path)
+{
+    long size;
+    int fd, s;
+
+    memset (ob, 0, sizeof (*ob));
+    ob->etdata = etdata;
+    ob->policy = policy;
+    ob->capacity = depth;
+    pthread_mutex_init (&ob->lock, NULL);
+    pthread_cond_init (&ob->cond, NULL);
+
+    if (depth < 1 || depth > OUTBOX_MAX_DEPTH)
+      {
+        log_error ("outbox depth out of range");
+        return -1;
+      }
+
+    ob->ring = calloc (depth, sizeof (struct outbox_msg));
+    if (!ob->ring)
+      {
+        log_error ("calloc failed for outbox");
+        return -1;
+      }
+
+    /* Events left on disk by the previous run are sent first */
+    if (policy == OUTBOX_SPILL)
+      {
+        /* Not opened for appending, it is compacted in place on close */
+        fd = open (spill_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        ob->spill = fd >= 0 ? fdopen (fd, "r+b") : NULL;
+        if (fd >= 0 && !ob->spill)
+            close (fd);
+        if (!ob->spill)
+          {
+            log_error_en (errno, "could not open outbox spill file, "
+                          "dropping the oldest reports instead");
+            ob->policy = OUTBOX_DROP_OLDEST;
+          }
+        else if (fseek (ob->spill, 0, SEEK_END) == 0 &&
+                 (size = ftell (ob->spill)) > 0)
+          {
+            ob->spill_n = size / sizeof (struct outbox_msg);
+            _log_debug ("outbox: %d events left on disk\n", ob->spill_n);
+          }
+      }
+
+    s = pthread_create (&ob->thread, NULL, outbox_thread, ob);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create outbox thread");
+        return -1;
+      }
+    ob->started = true;
+
+    return 0;
+}
+
+void
+outbox_hold_clock (struct outbox *ob, struct evcore *core)
+{
+    pthread_mutex_lock (&ob->lock);
+    ob->core = core;
+    update_hold (ob);
+    pthread_mutex_unlock (&ob->lock);
+}
+
+void
+outbox_on_lost_reference (struct outbox *ob, void (*cb) (void *), void *arg)
+{
+    pthread_mutex_lock (&ob->lock);
+    ob->lost_cb = cb;
+    ob->lost_arg = arg;
+    pthread_mutex_unlock (&ob->lock);
+}
+
+void
+outbox_free (struct outbox *ob)
+{
+    if (ob->started)
+      {
+        pthread_mutex_lock (&ob->lock);
+        ob->stopping = true;
+        pthread_cond_signal (&ob->cond);
+        pthread_mutex_unlock (&ob->lock);
+        pthread_join (ob->thread, NULL);
+        ob->started = false;
+
+        _log_debug ("outbox: %" PRIu64 " queued, %" PRIu64 " sent, %" PRIu64
+                    " errors, %" PRIu64 " dropped, %" PRIu64 " coalesced, %"
+                    PRIu64 " spilled, %d left\n", ob->stats.queued,
+                    ob->stats.sent, ob->stats.errors, ob->stats.dropped,
+                    ob->stats.coalesced, ob->stats.spilled,
+                    ob->n + ob->spill_n);
+      }
+
+    if (ob->holding)
+        evcore_release (ob->core);
+    ob->holding = false;
+    ob->core = NULL;
+
+    /* Keep what the master has not got yet for the next run, and only
+       that */
+    if (ob->policy == OUTBOX_SPILL && ob->spill)
+      {
+        while (ob->n && spill_oldest (ob) == 0)
+            ;
+        spill_compact (ob);
+      }
+
+    if (ob->spill)
+        fclose (ob->spill);
+    ob->spill = NULL;
+    free (ob->ring);
+    ob->ring = NULL;
+    ob->n = 0;
+    pthread_cond_destroy (&ob->cond);
+    pthread_mutex_destroy (&ob->lock);
+}
+
+int
+outbox_push (struct outbox *ob, const struct fgevent *fgev, unsigned flags)
+{
+    int room = 1;
+
+    if (fgev->length < 0 || fgev->length > OUTBOX_MAX_PAYLOAD)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+
+    pthread_mutex_lock (&ob->lock);
+    ob->stats.queued++;
+    if (ob->n == ob->capacity)
+        room = make_room (ob, fgev, flags);
+    if (room > 0)
+      {
+        msg_set (msg_at (ob, ob->n), fgev, flags);
+        ob->n++;
+        if (ob->n > ob->stats.max_depth)
+            ob->stats.max_depth = ob->n;
+        pthread_cond_signal (&ob->cond);
+      }
+    update_hold (ob);
+    pthread_mutex_unlock (&ob->lock);
+
+    return room < 0 ? -1 : 0;
+}
+
+void
+outbox_get_stats (struct outbox *ob, struct outbox_stats *stats)
+{
+    pthread_mutex_lock (&ob->lock);
+    *stats = ob->stats;
+    stats->depth = ob->n;
+    stats->spill_depth = ob->spill_n;
+    pthread_mutex_unlock (&ob->lock);
+}
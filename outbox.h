@@ -0,0 +1,139 @@
+/*
+ *  outbox.h
+ *    Bounded queue of events for the master, sent from a thread of its own
+ *    so a slow master or network cannot stall reporting or grow memory
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <fgevents.h>
+
+#include "evcore.h"
+
+#define OUTBOX_DEFAULT_DEPTH 32
+#define OUTBOX_MAX_DEPTH     1024
+
+/* Longest payload an event may have */
+#define OUTBOX_MAX_PAYLOAD 16
+
+/* Events kept on disk at most with OUTBOX_SPILL, older ones are dropped */
+#define OUTBOX_SPILL_MAX 65536
+
+#define OUTBOX_SPILL_PATH "/var/spool/fagelmatare-slave.outbox"
+
+/* Kinds of event for outbox_push */
+#define OUTBOX_EVENT     0
+#define OUTBOX_REPORT    1  /* superseded by a newer report of the same id */
+#define OUTBOX_REFERENCE 2  /* a report later reports of the same id need */
+
+/* What happens to an event that does not fit in a full queue */
+enum outbox_policy {
+    OUTBOX_DROP_OLDEST,     /* the oldest report is dropped */
+    OUTBOX_COALESCE,        /* it replaces the newest queued report */
+    OUTBOX_SPILL            /* the oldest event is moved to disk */
+};
+
+struct outbox_msg {
+    int32_t id;
+    int32_t receiver;
+    int32_t writeback;
+    int32_t length;
+    int32_t flags;          /* OUTBOX_REPORT and OUTBOX_REFERENCE */
+    int32_t payload[OUTBOX_MAX_PAYLOAD];
+};
+
+struct outbox_stats {
+    uint64_t queued;
+    uint64_t sent;
+    uint64_t errors;        /* fg_send_event failed */
+    uint64_t dropped;
+    uint64_t coalesced;
+    uint64_t spilled;
+    int      depth;
+    int      max_depth;
+    int      spill_depth;   /* events waiting on disk */
+};
+
+/*
+ * Events spilled to disk are always older than those in memory, so they
+ * are sent first. The spill file is kept across restarts.
+ */
+struct outbox {
+    struct fg_events_data *etdata;
+    enum outbox_policy     policy;
+    pthread_mutex_t        lock;
+    pthread_cond_t         cond;
+    pthread_t              thread;
+    bool                   started;
+    bool                   stopping;
+    struct outbox_msg     *ring;
+    int                    capacity;
+    int                    head;
+    int                    n;
+    FILE                  *spill;
+    long                   spill_read;  /* offset of the oldest event */
+    int                    spill_n;
+    struct outbox_stats    stats;
+    struct evcore         *core;        /* see outbox_hold_clock */
+    bool                   sending;
+    bool                   holding;
+    void                 (*lost_cb) (void *);
+    void                  *lost_arg;
+};
+
+/* Parse drop, coalesce or spill, -1 if it is none of them */
+extern int outbox_parse_policy (const char *);
+
+extern int outbox_init (struct outbox *, struct fg_events_data *,
+                        enum outbox_policy, int, const char *);
+
+/* Keep virtual time from moving on while events wait to be sent, so a
+   master that keeps up in real time keeps up in virtual time too */
+extern void outbox_hold_clock (struct outbox *, struct evcore *);
+
+/* Call cb whenever a reference was dropped or could not be sent, so the
+   next report can be one. It is called from any thread with the outbox
+   locked and must not push events itself. */
+extern void outbox_on_lost_reference (struct outbox *, void (*) (void *),
+                                      void *);
+
+/* Stop the sender, with OUTBOX_SPILL whatever is left goes to disk */
+extern void outbox_free (struct outbox *);
+
+/*
+ * Queue an event for the master, the payload is copied. Reports are
+ * subject to the overflow policy, other events are only dropped when the
+ * queue holds nothing but events that are not reports and references that
+ * are still needed. A reference is needed until a newer reference of the
+ * same id follows it with no other report of that id in between. Returns
+ * -1 if the event itself could not be queued.
+ */
+extern int outbox_push (struct outbox *, const struct fgevent *, unsigned);
+
+extern void outbox_get_stats (struct outbox *, struct outbox_stats *);
+
+#endif /* _OUTBOX_H_ */
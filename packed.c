@@ -0,0 +1,112 @@
+/*
+ *  packed.c
+ *    Compact encoding of sensor reports, varints of only the readings
+ *    present, optionally as differences to a reference report
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "packed.h"
+
+void
+packed_init (struct packed_encoder *enc, bool delta)
+{
+    memset (enc, 0, sizeof (*enc));
+    enc->delta = delta;
+    /* Spilled reports of an earlier run must not match our references */
+    enc->seq = (uint8_t) time (NULL);
+    atomic_init (&enc->reset, true);
+}
+
+void
+packed_reset (struct packed_encoder *enc)
+{
+    atomic_store (&enc->reset, true);
+}
+
+static size_t
+put_varint (uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80)
+      {
+        p[n++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+      }
+    p[n++] = (uint8_t) v;
+    return n;
+}
+
+static uint32_t
+zigzag (int32_t v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+int
+packed_encode (struct packed_encoder *enc, unsigned mask,
+               const int32_t *value, int32_t *payload, bool *reference)
+{
+    uint8_t buf[PACKED_MAX_WORDS * 4];
+    size_t n, ii;
+    bool delta;
+    int bit;
+
+    mask &= SENSOR_ALL | PACKED_OUTTEMP;
+
+    /* Deltas only for readings the reference has */
+    *reference = enc->delta &&
+                 (atomic_exchange (&enc->reset, false) ||
+                  enc->since >= PACKED_REFERENCE_EVERY ||
+                  (mask & ~enc->ref_mask));
+    delta = enc->delta && !*reference;
+    if (*reference)
+      {
+        enc->seq++;
+        enc->since = 0;
+        enc->ref_mask = mask;
+        memcpy (enc->ref, value, sizeof (enc->ref));
+      }
+    else if (delta)
+        enc->since++;
+
+    memset (buf, 0, sizeof (buf));
+    buf[0] = PACKED_VERSION;
+    buf[1] = (uint8_t) (mask | (delta ? PACKED_DELTA : 0));
+    buf[2] = enc->seq;
+    n = 3;
+    for (bit = 0; bit < PACKED_VALUES; bit++)
+      {
+        if (!(mask & (1u << bit)))
+            continue;
+        n += put_varint (buf + n, zigzag (delta ? value[bit] - enc->ref[bit] :
+                                          value[bit]));
+      }
+
+    for (ii = 0; ii < (n + 3) / 4; ii++)
+        payload[ii] = (int32_t) ((uint32_t) buf[ii * 4] |
+                                 (uint32_t) buf[ii * 4 + 1] << 8 |
+                                 (uint32_t) buf[ii * 4 + 2] << 16 |
+                                 (uint32_t) buf[ii * 4 + 3] << 24);
+    return (int) ((n + 3) / 4);
+}
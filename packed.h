@@ -0,0 +1,85 @@
+/*
+ *  packed.h
+ *    Compact encoding of sensor reports, varints of only the readings
+ *    present, optionally as differences to a reference report
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _PACKED_H_
+#define _PACKED_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensors.h"
+
+/*
+ * Payload layout, bytes packed four to a word with the first byte in the
+ * least significant byte, unused bytes of the last word zero:
+ *   version   PACKED_VERSION, lets the master tell formats apart
+ *   mask      SENSOR_BIT of each reading present, PACKED_OUTTEMP for the
+ *             outside temperature and PACKED_DELTA for a delta report
+ *   reference sequence number of the reference report, for a reference
+ *             report its own
+ *   values    one zigzag varint per reading in mask in bit order, in
+ *             tenths of the unit like FG_SENSOR_DATA
+ * A delta report carries the difference to the reference report with the
+ * given sequence number. A master that does not have that reference drops
+ * the report, the next reference report follows at most
+ * PACKED_REFERENCE_EVERY reports later.
+ */
+#define PACKED_VERSION 1
+
+#define PACKED_OUTTEMP SENSOR_BIT(SENSOR_CHANNELS)
+#define PACKED_DELTA   0x80
+
+/* Readings in a report, the channels and the outside temperature */
+#define PACKED_VALUES (SENSOR_CHANNELS + 1)
+
+#define PACKED_REFERENCE_EVERY 16
+
+/* Longest payload in words, three header bytes and five per varint */
+#define PACKED_MAX_WORDS ((3 + 5 * PACKED_VALUES + 3) / 4)
+
+struct packed_encoder {
+    atomic_bool reset;          /* the master may have lost the reference */
+    bool        delta;          /* send delta reports at all */
+    uint8_t     seq;            /* of the current reference report */
+    int         since;          /* delta reports sent since */
+    unsigned    ref_mask;
+    int32_t     ref[PACKED_VALUES];
+};
+
+extern void packed_init (struct packed_encoder *, bool);
+
+/* Start over with a reference report, as on a new connection */
+extern void packed_reset (struct packed_encoder *);
+
+/*
+ * Encode the readings in mask, value holds PACKED_VALUES of them indexed
+ * by bit. The payload must hold PACKED_MAX_WORDS. Returns the number of
+ * words used and sets reference when the report is one that later delta
+ * reports depend on, never without delta reports.
+ */
+extern int packed_encode (struct packed_encoder *, unsigned,
+                          const int32_t *, int32_t *, bool *);
+
+#endif /* _PACKED_H_ */
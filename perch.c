@@ -0,0 +1,124 @@
+/*
+ *  perch.c
+ *    Incremental impact detector that recognises a bird landing on the feeder
+ *    from a stream of accelerometer samples
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "perch.h"
+
+void
+perch_init (struct perch_detector *det, uint32_t hz, uint32_t ug_per_count)
+{
+    memset (det, 0, sizeof (*det));
+
+    det->hz = hz;
+    det->mg_per_count_q16 = (uint32_t) (((uint64_t) ug_per_count << 16) /
+                                        1000);
+    det->floor = PERCH_FLOOR_MG * 1000 / ug_per_count;
+    det->impact = PERCH_IMPACT_MG * 1000 / ug_per_count;
+    det->warmup = PERCH_WARMUP_MS * hz / 1000;
+    det->min_len = PERCH_MIN_MS * hz / 1000;
+    det->max_len = PERCH_MAX_MS * hz / 1000;
+    det->holdoff = PERCH_HOLDOFF_MS * hz / 1000;
+}
+
+static uint32_t
+counts_to_mg (const struct perch_detector *det, uint64_t counts)
+{
+    return (uint32_t) ((counts * det->mg_per_count_q16) >> 16);
+}
+
+bool
+perch_update (struct perch_detector *det, const int16_t *a, int64_t t,
+              struct perch_landing *landing)
+{
+    int32_t v, d, e, floor;
+    uint32_t len;
+    int ax;
+
+    /* Deviation from the baseline of each axis, summed as an L1 norm which
+       is as good as the Euclidean one for finding impacts and far cheaper */
+    e = 0;
+    for (ax = 0; ax < 3; ax++)
+      {
+        v = (int32_t) a[ax] << PERCH_FRAC;
+        if (!det->n)
+            det->base[ax] = v;
+        d = v - det->base[ax];
+        det->base[ax] += d >> PERCH_BASELINE_SHIFT;
+        e += abs (d) >> PERCH_FRAC;
+      }
+    det->n++;
+
+    det->sta += ((e << PERCH_FRAC) - det->sta) >> PERCH_STA_SHIFT;
+    /* The LTA is the background the event is measured against, keep the
+       event itself out of it */
+    if (!det->active)
+        det->lta += ((e << PERCH_FRAC) - det->lta) >> PERCH_LTA_SHIFT;
+
+    if (det->n < det->warmup)
+        return false;
+
+    floor = det->floor << PERCH_FRAC;
+    if (!det->active)
+      {
+        if (det->n < det->quiet_until ||
+            det->sta <= ((int64_t) det->lta * PERCH_TRIGGER_RATIO >> 3) +
+                        floor)
+            return false;
+
+        det->active = true;
+        det->start = det->n;
+        det->start_t = t;
+        det->peak = e;
+        det->sum = e;
+        return false;
+      }
+
+    if (e > det->peak)
+        det->peak = e;
+    det->sum += e;
+
+    len = det->n - det->start;
+    if (len < det->max_len &&
+        det->sta > ((int64_t) det->lta * PERCH_RELEASE_RATIO >> 3) + floor)
+        return false;
+
+    /* The feeder has settled */
+    det->active = false;
+    det->quiet_until = det->n + det->holdoff;
+
+    if (len < det->min_len || len >= det->max_len || det->peak < det->impact)
+      {
+        det->rejected++;
+        return false;
+      }
+
+    landing->t = det->start_t;
+    landing->peak_mg = counts_to_mg (det, det->peak);
+    landing->duration_ms = len * 1000 / det->hz;
+    landing->energy = counts_to_mg (det, det->sum) / det->hz;
+    det->landings++;
+    return true;
+}
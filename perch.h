@@ -0,0 +1,102 @@
+/*
+ *  perch.h
+ *    Incremental impact detector that recognises a bird landing on the feeder
+ *    from a stream of accelerometer samples
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _PERCH_H_
+#define _PERCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The detector works on raw accelerometer counts in integer arithmetic and
+ * keeps a handful of running values, so each sample costs a few additions
+ * and shifts and nothing is ever allocated. Gravity and slow tilt are
+ * removed by a per-axis baseline; the remaining vibration energy is fed to
+ * a short and a long running average (STA/LTA). A landing is the STA rising
+ * well above the LTA with a sharp peak, followed by the feeder settling.
+ * Smoothing factors are powers of two and given as shifts.
+ */
+#define PERCH_BASELINE_SHIFT 6      /* ~0.27 s at 238 Hz */
+#define PERCH_STA_SHIFT      3      /* ~34 ms */
+#define PERCH_LTA_SHIFT      8      /* ~1.1 s */
+
+/* Fixed-point fraction bits of the running values */
+#define PERCH_FRAC 8
+
+/* Trigger when STA > PERCH_TRIGGER_RATIO * LTA + floor and release once
+   STA < PERCH_RELEASE_RATIO * LTA + floor (ratios in eighths) */
+#define PERCH_TRIGGER_RATIO 32      /* 4.0 */
+#define PERCH_RELEASE_RATIO 12      /* 1.5 */
+
+/* Thresholds in mg, converted to counts by perch_init */
+#define PERCH_FLOOR_MG  8           /* noise floor of the STA */
+#define PERCH_IMPACT_MG 60          /* peak needed for a landing */
+
+/* Samples to settle before triggering, shortest and longest excitation
+   counted as a landing and dead time after a landing, in ms */
+#define PERCH_WARMUP_MS   1000
+#define PERCH_MIN_MS      20
+#define PERCH_MAX_MS      3000
+#define PERCH_HOLDOFF_MS  2000
+
+struct perch_landing {
+    int64_t  t;             /* sample time of the trigger, CLOCK_REALTIME ns */
+    uint32_t peak_mg;       /* largest deviation from the baseline */
+    uint32_t duration_ms;   /* time until the feeder settled */
+    uint32_t energy;        /* summed deviation over the event, mg*s */
+};
+
+struct perch_detector {
+    /* configuration in sample counts and raw counts */
+    uint32_t hz;
+    uint32_t mg_per_count_q16;
+    int32_t  floor;
+    int32_t  impact;
+    uint32_t warmup, min_len, max_len, holdoff;
+
+    /* running state */
+    int32_t  base[3];       /* Q PERCH_FRAC */
+    int32_t  sta, lta;      /* Q PERCH_FRAC */
+    uint32_t n;             /* samples seen since init */
+    uint32_t quiet_until;   /* no triggers before this sample */
+    bool     active;
+    uint32_t start;
+    int64_t  start_t;
+    int32_t  peak;
+    uint64_t sum;
+
+    /* statistics */
+    uint32_t landings;
+    uint32_t rejected;      /* triggers too short, too long or too weak */
+};
+
+/* Prepare for samples at hz, each count being ug_per_count micro g */
+extern void perch_init (struct perch_detector *, uint32_t, uint32_t);
+
+/* Feed one sample taken at t (CLOCK_REALTIME ns). Returns true and fills
+   in landing when a landing has just ended. */
+extern bool perch_update (struct perch_detector *, const int16_t *, int64_t,
+                          struct perch_landing *);
+
+#endif /* _PERCH_H_ */
@@ -0,0 +1,489 @@
+/*
+ *  query.c
+ *    Local request/response server on a UNIX domain socket answering from
+ *    an in-memory cache of recent readings
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "query.h"
+#include "i2cbus.h"
+#include "command.h"
+#include "common.h"
+#include "log.h"
+
+/* One connection, what it subscribes to lasts as long as the connection */
+struct query_client {
+    struct query_server  *srv;
+    struct bufferevent   *bev;
+    int                   sub;      /* subscriber id, -1 until it subscribes */
+    struct query_client  *next;
+    struct query_client **prev;
+};
+
+static const char *channel_names[SENSOR_CHANNELS] = {
+    [SENSOR_PRESSURE]    = "pressure",
+    [SENSOR_TEMPERATURE] = "temperature",
+    [SENSOR_HUMIDITY]    = "humidity"
+};
+
+static float
+channel_value (const struct SensorData *data, int ch)
+{
+    switch (ch)
+      {
+        case SENSOR_PRESSURE:
+            return data->pressure;
+        case SENSOR_TEMPERATURE:
+            return data->temperature;
+        default:
+            return data->humidity;
+      }
+}
+
+void
+query_cache_report (struct query_server *srv, const struct SensorData *data,
+                    unsigned mask, bool valid_outtemp, float outtemp)
+{
+    struct query_cache *cache = &srv->cache;
+    struct query_report *r = &cache->history[cache->next];
+
+    r->timestamp = clock_ns (CLOCK_REALTIME);
+    r->mask = mask;
+    r->data = *data;
+    r->valid_outtemp = valid_outtemp;
+    r->outtemp = outtemp;
+
+    cache->next = (cache->next + 1) % QUERY_HISTORY;
+    if (cache->n < QUERY_HISTORY)
+        cache->n++;
+}
+
+static void
+reply_latest (struct query_server *srv, struct evbuffer *out)
+{
+    const struct query_cache *cache = &srv->cache;
+    const struct query_report *r;
+    int ch;
+
+    if (!cache->n)
+      {
+        evbuffer_add_printf (out, "ERR no reading yet\n");
+        return;
+      }
+
+    r = &cache->history[(cache->next + QUERY_HISTORY - 1) % QUERY_HISTORY];
+    evbuffer_add_printf (out, "OK t=%" PRId64, r->timestamp / NSEC_PER_MSEC);
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (r->mask & SENSOR_BIT(ch))
+            evbuffer_add_printf (out, " %s=%.3f", channel_names[ch],
+                                 channel_value (&r->data, ch));
+      }
+    if (r->valid_outtemp)
+        evbuffer_add_printf (out, " outtemp=%.1f", r->outtemp);
+    evbuffer_add_printf (out, "\n");
+}
+
+static void
+reply_summary (struct query_server *srv, struct evbuffer *out)
+{
+    const struct query_cache *cache = &srv->cache;
+    const struct query_report *r;
+    float v, min, max;
+    double sum;
+    int ii, ch, n;
+
+    if (!cache->n)
+      {
+        evbuffer_add_printf (out, "ERR no reading yet\n");
+        return;
+      }
+
+    r = &cache->history[(cache->next + QUERY_HISTORY - cache->n) %
+                        QUERY_HISTORY];
+    evbuffer_add_printf (out, "OK n=%d since=%" PRId64, cache->n,
+                         r->timestamp / NSEC_PER_MSEC);
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        min = INFINITY;
+        max = -INFINITY;
+        sum = 0.0;
+        n = 0;
+        for (ii = 0; ii < cache->n; ii++)
+          {
+            r = &cache->history[ii];
+            if (!(r->mask & SENSOR_BIT(ch)))
+                continue;
+            v = channel_value (&r->data, ch);
+            min = fminf (min, v);
+            max = fmaxf (max, v);
+            sum += v;
+            n++;
+          }
+        if (n)
+            evbuffer_add_printf (out, " %s=%.3f,%.3f,%.3f", channel_names[ch],
+                                 min, sum / n, max);
+      }
+    evbuffer_add_printf (out, "\n");
+}
+
+/* The only request that touches the bus. Without the acquisition to
+   keep it, the next scheduled read may find no new conversion. */
+static void
+reply_sample (struct query_server *srv, struct evbuffer *out)
+{
+    struct SensorSample sample;
+    int res, ch;
+
+    if (srv->acq)
+        res = acquire_read_now (srv->acq, SENSOR_ALL, &sample);
+    else
+        res = sensors_sample (SENSOR_ALL, &sample);
+    if (res < 0)
+      {
+        evbuffer_add_printf (out, "ERR sample failed: %s\n",
+                             strerror (errno));
+        return;
+      }
+
+    evbuffer_add_printf (out, "OK t=%" PRId64,
+                         clock_ns (CLOCK_REALTIME) / NSEC_PER_MSEC);
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (sample.mask & SENSOR_BIT(ch))
+            evbuffer_add_printf (out, " %s=%.3f", channel_names[ch],
+                                 sensors_convert (ch, sample.raw[ch]));
+      }
+    evbuffer_add_printf (out, "\n");
+}
+
+static void
+reply_outbox (struct query_server *srv, struct evbuffer *out)
+{
+    struct outbox_stats st;
+
+    if (!srv->outbox)
+      {
+        evbuffer_add_printf (out, "ERR no outbox\n");
+        return;
+      }
+
+    outbox_get_stats (srv->outbox, &st);
+    evbuffer_add_printf (out, "OK depth=%d max=%d spill=%d queued=%" PRIu64
+                         " sent=%" PRIu64 " errors=%" PRIu64 " dropped=%"
+                         PRIu64 " coalesced=%" PRIu64 " spilled=%" PRIu64
+                         "\n", st.depth, st.max_depth, st.spill_depth,
+                         st.queued, st.sent, st.errors, st.dropped,
+                         st.coalesced, st.spilled);
+}
+
+static void
+reply_bus (struct evbuffer *out)
+{
+    static const char *const prio_names[I2C_PRIO_LEVELS] = {
+        "stream", "sample", "config"
+    };
+    struct i2c_bus_usage u;
+    int p;
+
+    i2c_bus_get_usage (&u);
+    evbuffer_add_printf (out, "OK util=%.2f%% txns=%" PRIu64 " bytes=%" PRIu64
+                         " switches=%" PRIu64 " saved=%" PRIu64
+                         " late=%" PRIu64,
+                         u.elapsed_ns ? 100.0 * u.busy_ns / u.elapsed_ns : 0.0,
+                         u.transactions, u.bytes, u.switches,
+                         u.switches_saved, u.late);
+    for (p = 0; p < I2C_PRIO_LEVELS; p++)
+      {
+        if (u.requests[p])
+            evbuffer_add_printf (out, " %s=%" PRIu64 ",%.1f,%.1f",
+                                 prio_names[p], u.requests[p],
+                                 (double) u.wait_ns[p] / u.requests[p] / 1000.0,
+                                 (double) u.max_wait_ns[p] / 1000.0);
+      }
+    evbuffer_add_printf (out, "\n");
+}
+
+static void
+reply_history (struct query_server *srv, const char *line,
+               struct evbuffer *out)
+{
+    struct rollup_bucket buckets[QUERY_MAX_BUCKETS];
+    char channel[16], tier[16];
+    int ii, ch, t, n;
+
+    n = 60;
+    if (sscanf (line, "history %15s %15s %d", channel, tier, &n) < 2)
+      {
+        evbuffer_add_printf (out, "ERR usage: history CHANNEL TIER [N]\n");
+        return;
+      }
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (strcmp (channel, channel_names[ch]) == 0)
+            break;
+      }
+    for (t = 0; t < ROLLUP_TIERS; t++)
+      {
+        if (strcmp (tier, rollup_tier_name (t)) == 0)
+            break;
+      }
+    if (ch == SENSOR_CHANNELS || t == ROLLUP_TIERS || n < 1 || !srv->rollup)
+      {
+        evbuffer_add_printf (out, "ERR unknown channel or tier\n");
+        return;
+      }
+
+    if (n > QUERY_MAX_BUCKETS)
+        n = QUERY_MAX_BUCKETS;
+    n = rollup_history (srv->rollup, ch, t, buckets, n);
+
+    evbuffer_add_printf (out, "OK n=%d", n);
+    for (ii = 0; ii < n; ii++)
+        evbuffer_add_printf (out, " %" PRId64 ",%.3f,%.3f,%.3f,%" PRIu32,
+                             buckets[ii].start, buckets[ii].min,
+                             buckets[ii].sum / buckets[ii].count,
+                             buckets[ii].max, buckets[ii].count);
+    evbuffer_add_printf (out, "\n");
+}
+
+static void
+reply_subscribe (struct query_client *client, const char *line,
+                 struct evbuffer *out)
+{
+    struct query_server *srv = client->srv;
+    char channel[16];
+    int ch, ms = 0;
+    bool subscribe;
+
+    subscribe = strncmp (line, "subscribe ", 10) == 0;
+    if (sscanf (line, subscribe ? "subscribe %15s %d" : "unsubscribe %15s",
+                channel, &ms) < 1 || ms < 0)
+      {
+        evbuffer_add_printf (out, "ERR usage: subscribe CHANNEL [MS] or "
+                             "unsubscribe CHANNEL\n");
+        return;
+      }
+    if (!srv->subs || (ch = subscribe_parse_channel (channel)) < 0)
+      {
+        evbuffer_add_printf (out, "ERR unknown channel\n");
+        return;
+      }
+
+    if (client->sub < 0 && subscribe)
+        client->sub = subscribe_add (srv->subs, "query");
+    if (client->sub < 0 && subscribe)
+      {
+        evbuffer_add_printf (out, "ERR too many subscribers\n");
+        return;
+      }
+
+    if (ms && ms < COMMAND_MIN_PERIOD_MS)
+        ms = COMMAND_MIN_PERIOD_MS;
+    subscribe_set (srv->subs, client->sub, ch, !subscribe ? 0 :
+                   ms ? ms * NSEC_PER_MSEC : SUB_ANY_RATE);
+    evbuffer_add_printf (out, "OK\n");
+}
+
+static void
+reply_channels (struct query_server *srv, struct evbuffer *out)
+{
+    const struct subscriptions *subs = srv->subs;
+    int ii, ch, n;
+
+    if (!subs)
+      {
+        evbuffer_add_printf (out, "ERR no subscriptions\n");
+        return;
+      }
+
+    evbuffer_add_printf (out, "OK");
+    for (ch = 0; ch < SUB_CHANNELS; ch++)
+      {
+        for (ii = n = 0; ii < SUB_MAX; ii++)
+          {
+            if (subs->sub[ii].used && subs->sub[ii].period[ch])
+                n++;
+          }
+        if (!subs->period[ch])
+            evbuffer_add_printf (out, " %s=off,%d",
+                                 subscribe_channel_name (ch), n);
+        else if (subs->period[ch] == SUB_ANY_RATE)
+            evbuffer_add_printf (out, " %s=any,%d",
+                                 subscribe_channel_name (ch), n);
+        else
+            evbuffer_add_printf (out, " %s=%" PRId64 ",%d",
+                                 subscribe_channel_name (ch),
+                                 subs->period[ch] / NSEC_PER_MSEC, n);
+      }
+    evbuffer_add_printf (out, "\n");
+}
+
+/* Dropping a client drops its subscriptions */
+static void
+client_free (struct query_client *client)
+{
+    if (client->sub >= 0)
+        subscribe_remove (client->srv->subs, client->sub);
+    *client->prev = client->next;
+    if (client->next)
+        client->next->prev = client->prev;
+    bufferevent_free (client->bev);
+    free (client);
+}
+
+static void
+query_read_cb (struct bufferevent *bev, void *arg)
+{
+    struct query_client *client = arg;
+    struct query_server *srv = client->srv;
+    struct evbuffer *in = bufferevent_get_input (bev);
+    struct evbuffer *out = bufferevent_get_output (bev);
+    char *line;
+
+    while ((line = evbuffer_readln (in, NULL, EVBUFFER_EOL_ANY)) != NULL)
+      {
+        srv->requests++;
+        if (strcmp (line, "latest") == 0)
+            reply_latest (srv, out);
+        else if (strcmp (line, "summary") == 0)
+            reply_summary (srv, out);
+        else if (strcmp (line, "sample") == 0)
+            reply_sample (srv, out);
+        else if (strcmp (line, "outbox") == 0)
+            reply_outbox (srv, out);
+        else if (strcmp (line, "bus") == 0)
+            reply_bus (out);
+        else if (strncmp (line, "history ", 8) == 0)
+            reply_history (srv, line, out);
+        else if (strncmp (line, "subscribe ", 10) == 0 ||
+                 strncmp (line, "unsubscribe ", 12) == 0)
+            reply_subscribe (client, line, out);
+        else if (strcmp (line, "channels") == 0)
+            reply_channels (srv, out);
+        else
+            evbuffer_add_printf (out, "ERR unknown request\n");
+        free (line);
+      }
+
+    /* Drop clients that send garbage without ever ending the line */
+    if (evbuffer_get_length (in) > QUERY_MAX_LINE)
+        client_free (client);
+}
+
+static void
+query_event_cb (struct bufferevent *UNUSED(bev), short events, void *arg)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        client_free (arg);
+}
+
+static void
+query_accept_cb (struct evconnlistener *listener, evutil_socket_t fd,
+                 struct sockaddr *UNUSED(addr), int UNUSED(len), void *arg)
+{
+    struct event_base *base = evconnlistener_get_base (listener);
+    struct query_client *client;
+    struct bufferevent *bev;
+
+    client = malloc (sizeof (*client));
+    bev = client ? bufferevent_socket_new (base, fd, BEV_OPT_CLOSE_ON_FREE) :
+                   NULL;
+    if (!bev)
+      {
+        log_error ("could not create bufferevent for query client");
+        free (client);
+        close (fd);
+        return;
+      }
+    client->srv = arg;
+    client->bev = bev;
+    client->sub = -1;
+    client->next = client->srv->clients;
+    client->prev = &client->srv->clients;
+    if (client->next)
+        client->next->prev = &client->next;
+    client->srv->clients = client;
+
+    bufferevent_setcb (bev, query_read_cb, NULL, query_event_cb, client);
+    bufferevent_enable (bev, EV_READ | EV_WRITE);
+}
+
+int
+query_init (struct query_server *srv, struct event_base *base,
+            const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset (srv, 0, sizeof (*srv));
+    srv->path = path;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+      {
+        errno = ENAMETOOLONG;
+        log_error ("query socket path too long");
+        return -1;
+      }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    strcpy (addr.sun_path, path);
+
+    /* Remove a socket left behind by a previous run */
+    unlink (path);
+
+    srv->listener = evconnlistener_new_bind (base, query_accept_cb, srv,
+                                             LEV_OPT_CLOSE_ON_FREE |
+                                             LEV_OPT_CLOSE_ON_EXEC, -1,
+                                             (struct sockaddr *) &addr,
+                                             sizeof (addr));
+    if (!srv->listener)
+      {
+        log_error ("could not listen on query socket");
+        return -1;
+      }
+
+    return 0;
+}
+
+void
+query_free (struct query_server *srv)
+{
+    if (!srv->listener)
+        return;
+
+    while (srv->clients)
+        client_free (srv->clients);
+    evconnlistener_free (srv->listener);
+    unlink (srv->path);
+    srv->listener = NULL;
+}
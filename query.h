@@ -0,0 +1,113 @@
+/*
+ *  query.h
+ *    Local request/response server on a UNIX domain socket answering from
+ *    an in-memory cache of recent readings
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include "sensors.h"
+#include "acquire.h"
+#include "rollup.h"
+#include "outbox.h"
+#include "subscribe.h"
+
+#define QUERY_SOCKET_PATH "/run/fagelmatare-slave.sock"
+
+/* Number of reports the window summary is calculated over */
+#define QUERY_HISTORY 60
+
+/* Longest request line accepted */
+#define QUERY_MAX_LINE 128
+
+/* Most rollup buckets returned by a single history request */
+#define QUERY_MAX_BUCKETS 120
+
+struct query_report {
+    int64_t           timestamp;    /* CLOCK_REALTIME, nanoseconds */
+    unsigned          mask;
+    struct SensorData data;
+    bool              valid_outtemp;
+    float             outtemp;
+};
+
+/* Cache of the latest reports, only written from the event loop */
+struct query_cache {
+    struct query_report history[QUERY_HISTORY];
+    int                 n;
+    int                 next;
+};
+
+struct query_client;
+
+struct query_server {
+    struct evconnlistener *listener;
+    struct query_client   *clients;
+    struct query_cache     cache;
+    const struct rollup_set *rollup;
+    struct outbox         *outbox;
+    struct subscriptions  *subs;
+    struct acquisition    *acq;     /* "sample" reads through it if set */
+    const char            *path;
+    uint64_t               requests;
+};
+
+/*
+ * Requests are single lines, every response is a single line starting with
+ * OK or ERR:
+ *   latest    values of the latest report
+ *   summary   min, mean and max of each channel over the cached reports
+ *   sample    take a fresh sample on the bus and return it, the sample
+ *             also goes into the next report
+ *   outbox    depth, high water mark and spill depth of the queue to the
+ *             master, events queued, sent, failed, dropped, coalesced and
+ *             spilled
+ *   bus       i2c bus utilisation, transactions, bytes, address switches
+ *             issued and saved, requests served late and per priority the
+ *             requests with mean and max wait in microseconds
+ *   history CHANNEL TIER [N]
+ *             the latest N (default 60) rollup buckets of a channel, TIER
+ *             being second, minute or hour, as start,min,mean,max,count
+ *   subscribe CHANNEL [MS]
+ *             keep CHANNEL (or outtemp) sampled at least every MS
+ *             milliseconds, at any rate without MS, for as long as the
+ *             connection stays open
+ *   unsubscribe CHANNEL
+ *   channels  per channel the period it is sampled at for its subscribers
+ *             in milliseconds (any or off) and the number of subscribers
+ */
+extern int query_init (struct query_server *, struct event_base *,
+                       const char *);
+
+extern void query_free (struct query_server *);
+
+extern void query_cache_report (struct query_server *,
+                                const struct SensorData *, unsigned, bool,
+                                float);
+
+#endif /* _QUERY_H_ */
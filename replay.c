@@ -0,0 +1,119 @@
+/*
+ *  replay.c
+ *    Drive the acquisition code from a recorded I2C trace for deterministic
+ *    regression runs and throughput benchmarks
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "replay.h"
+#include "acquire.h"
+#include "i2cbus.h"
+#include "sensors.h"
+#include "common.h"
+#include "log.h"
+
+static void
+print_report (uint64_t n, unsigned mask, const struct SensorData *data)
+{
+    printf ("report %" PRIu64 ":", n);
+    if (mask & SENSOR_BIT(SENSOR_PRESSURE))
+        printf (" pressure %.4f (sd %.4f)", data->pressure, data->pressure_sd);
+    if (mask & SENSOR_BIT(SENSOR_TEMPERATURE))
+        printf (" temperature %.4f (sd %.4f)", data->temperature,
+                data->temperature_sd);
+    if (mask & SENSOR_BIT(SENSOR_HUMIDITY))
+        printf (" humidity %.4f (sd %.4f)", data->humidity, data->humidity_sd);
+    printf ("\n");
+}
+
+int
+replay_run (const char *path, bool realtime, int loops)
+{
+    struct acquisition acq;
+    struct SensorSample sample;
+    struct SensorData data;
+    struct i2c_trace_stats stats;
+    uint64_t reports, samples;
+    uint32_t arg;
+    int64_t start, elapsed;
+    unsigned mask;
+    int op, loop;
+
+    if (i2c_trace_replay (path, realtime) < 0)
+        return -1;
+
+    /* Only the windows of the acquisition are used, the schedule is what
+       the trace says */
+    memset (&acq, 0, sizeof (acq));
+
+    reports = samples = 0;
+    start = clock_ns (CLOCK_MONOTONIC);
+    for (loop = 0; loop < loops; loop++)
+      {
+        i2c_trace_rewind ();
+        while ((op = i2c_trace_next_mark (&arg)) >= 0)
+          {
+            switch (op)
+              {
+                case I2C_MARK_INIT:
+                    sensors_init ();
+                    break;
+                case I2C_MARK_AVERAGING:
+                    sensors_set_averaging (arg & 0xff, (arg >> 8) & 0xff,
+                                           (arg >> 16) & 0xff);
+                    break;
+                case I2C_MARK_POWER:
+                    sensors_set_power (arg);
+                    break;
+                case I2C_MARK_SAMPLE:
+                    if (sensors_sample (arg, &sample) == 0)
+                        acquire_store (&acq, &sample);
+                    samples++;
+                    break;
+                case I2C_MARK_PUBLISH:
+                    memset (&data, 0, sizeof (data));
+                    mask = acquire_publish (&acq, &data);
+                    if (loop == 0)
+                        print_report (reports, mask, &data);
+                    reports++;
+                    break;
+                default:
+                    break;
+              }
+          }
+      }
+    elapsed = clock_ns (CLOCK_MONOTONIC) - start;
+
+    i2c_trace_get_stats (&stats);
+    i2c_trace_close ();
+
+    printf ("%d pass(es): %" PRIu64 " reports, %" PRIu64 " samples, %" PRIu64
+            " records, %" PRIu64 " bus bytes in %.3f s\n", loops, reports,
+            samples, stats.records, stats.bytes, (double) elapsed / NSEC_PER_SEC);
+    if (elapsed > 0)
+        printf ("throughput: %.0f samples/s, %.0f records/s\n",
+                (double) samples * NSEC_PER_SEC / elapsed,
+                (double) stats.records * NSEC_PER_SEC / elapsed);
+    printf ("divergences: %" PRIu64 "\n", stats.divergences);
+
+    return stats.divergences ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+/*
+ *  replay.h
+ *    Drive the acquisition code from a recorded I2C trace for deterministic
+ *    regression runs and throughput benchmarks
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdbool.h>
+
+/*
+ * Replay trace through sensors_init, sensors_set_averaging, sensors_sample
+ * and acquire_publish in the order they were recorded. Every report of the
+ * first pass is printed, so two runs over the same trace can be diffed. The
+ * trace is replayed loops times, in real time or as fast as possible.
+ * Returns 0 if the code did exactly what it did when the trace was recorded.
+ */
+extern int replay_run (const char *, bool, int);
+
+#endif /* _REPLAY_H_ */
@@ -0,0 +1,110 @@
+/*
+ *  rollup.c
+ *    Rollups of every channel per second, minute and hour kept incrementally
+ *    in fixed-size rings
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "rollup.h"
+#include "common.h"
+
+static const struct {
+    const char *name;
+    int64_t     span;       /* seconds */
+    int         offset;     /* first bucket in rollup_channel.buckets */
+    int         size;
+} tiers[ROLLUP_TIERS] = {
+    [ROLLUP_SECOND] = { "second", 1, 0, ROLLUP_SECONDS },
+    [ROLLUP_MINUTE] = { "minute", 60, ROLLUP_SECONDS, ROLLUP_MINUTES },
+    [ROLLUP_HOUR]   = { "hour", 3600, ROLLUP_SECONDS + ROLLUP_MINUTES,
+                        ROLLUP_HOURS }
+};
+
+void
+rollup_init (struct rollup_set *set)
+{
+    memset (set, 0, sizeof (*set));
+}
+
+const char *
+rollup_tier_name (enum rollup_tier tier)
+{
+    return tiers[tier].name;
+}
+
+void
+rollup_add (struct rollup_set *set, enum sensor_channel channel, float value,
+            int64_t t)
+{
+    struct rollup_channel *c = &set->ch[channel];
+    struct rollup_bucket *b;
+    struct rollup_ring *r;
+    int64_t start;
+    int tier;
+
+    for (tier = 0; tier < ROLLUP_TIERS; tier++)
+      {
+        r = &c->ring[tier];
+        start = t / NSEC_PER_SEC / tiers[tier].span * tiers[tier].span;
+        b = &c->buckets[tiers[tier].offset + r->head];
+
+        if (!r->n || b->start != start)
+          {
+            /* Start a new bucket, overwriting the oldest one when full */
+            if (r->n)
+                r->head = (r->head + 1) % tiers[tier].size;
+            if (r->n < tiers[tier].size)
+                r->n++;
+
+            b = &c->buckets[tiers[tier].offset + r->head];
+            b->start = start;
+            b->min = value;
+            b->max = value;
+            b->sum = 0.0;
+            b->count = 0;
+          }
+
+        if (value < b->min)
+            b->min = value;
+        if (value > b->max)
+            b->max = value;
+        b->sum += value;
+        b->count++;
+      }
+}
+
+int
+rollup_history (const struct rollup_set *set, enum sensor_channel channel,
+                enum rollup_tier tier, struct rollup_bucket *out, int max)
+{
+    const struct rollup_channel *c = &set->ch[channel];
+    const struct rollup_ring *r = &c->ring[tier];
+    int ii, n, size;
+
+    size = tiers[tier].size;
+    n = r->n < max ? r->n : max;
+    for (ii = 0; ii < n; ii++)
+        out[ii] = c->buckets[tiers[tier].offset +
+                             (r->head - n + 1 + ii + size) % size];
+
+    return n;
+}
@@ -0,0 +1,87 @@
+/*
+ *  rollup.h
+ *    Rollups of every channel per second, minute and hour kept incrementally
+ *    in fixed-size rings
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdint.h>
+
+#include "sensors.h"
+
+enum rollup_tier {
+    ROLLUP_SECOND,
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_TIERS
+};
+
+/* Buckets kept per tier: ten minutes of seconds, a day of minutes and a
+   week of hours */
+#define ROLLUP_SECONDS 600
+#define ROLLUP_MINUTES 1440
+#define ROLLUP_HOURS   168
+#define ROLLUP_BUCKETS (ROLLUP_SECONDS + ROLLUP_MINUTES + ROLLUP_HOURS)
+
+struct rollup_bucket {
+    int64_t  start;     /* CLOCK_REALTIME seconds, multiple of the span */
+    float    min;
+    float    max;
+    double   sum;
+    uint32_t count;
+};
+
+struct rollup_ring {
+    int head;           /* bucket currently being filled */
+    int n;              /* buckets in use */
+};
+
+/*
+ * Every sample updates the current bucket of each tier, so all tiers are
+ * up to date at any time and nothing has to be re-aggregated when they are
+ * read. A bucket is started when a sample falls outside the current one,
+ * spans without samples leave no bucket.
+ */
+struct rollup_channel {
+    struct rollup_bucket buckets[ROLLUP_BUCKETS];
+    struct rollup_ring   ring[ROLLUP_TIERS];
+};
+
+struct rollup_set {
+    struct rollup_channel ch[SENSOR_CHANNELS];
+};
+
+extern void rollup_init (struct rollup_set *);
+
+/* Account value of channel sampled at t (CLOCK_REALTIME ns) */
+extern void rollup_add (struct rollup_set *, enum sensor_channel, float,
+                        int64_t);
+
+/* Copy up to max of the latest buckets of a tier into out, oldest first.
+   Returns the number of buckets copied. */
+extern int rollup_history (const struct rollup_set *, enum sensor_channel,
+                           enum rollup_tier, struct rollup_bucket *, int);
+
+extern const char *rollup_tier_name (enum rollup_tier);
+
+#endif /* _ROLLUP_H_ */
@@ -0,0 +1,305 @@
+/*
+ *  rtacq.c
+ *    Optional real-time acquisition thread running under SCHED_FIFO with
+ *    locked memory, handing samples to the event loop through a SPSC ring
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rtacq.h"
+#include "common.h"
+#include "log.h"
+
+static void rtacq_cb (uint64_t, void *);
+
+/* Set up thread attributes for SCHED_FIFO and CPU affinity */
+static int
+rt_attr_init (pthread_attr_t *attr, const struct rtacq_config *cfg)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int s;
+
+    s = pthread_attr_init (attr);
+    if (s != 0)
+        return s;
+
+    if (!cfg->enabled)
+        return 0;
+
+    param.sched_priority = cfg->priority;
+    if ((s = pthread_attr_setinheritsched (attr, PTHREAD_EXPLICIT_SCHED)) ||
+        (s = pthread_attr_setschedpolicy (attr, SCHED_FIFO)) ||
+        (s = pthread_attr_setschedparam (attr, &param)))
+        return s;
+
+    if (cfg->cpu >= 0)
+      {
+        CPU_ZERO (&cpus);
+        CPU_SET (cfg->cpu, &cpus);
+        s = pthread_attr_setaffinity_np (attr, sizeof (cpus), &cpus);
+      }
+
+    return s;
+}
+
+/* Create thread with real-time attributes, fall back to normal scheduling
+   if we lack the privileges for SCHED_FIFO */
+static int
+rt_thread_create (pthread_t *thread, const struct rtacq_config *cfg,
+                  void *(*fn) (void *), void *arg)
+{
+    pthread_attr_t attr;
+    int s;
+
+    s = rt_attr_init (&attr, cfg);
+    if (s == 0)
+        s = pthread_create (thread, &attr, fn, arg);
+    pthread_attr_destroy (&attr);
+
+    if (s == EPERM)
+      {
+        log_error_en (s, "no permission for SCHED_FIFO, running unprivileged");
+        s = pthread_create (thread, NULL, fn, arg);
+      }
+
+    return s;
+}
+
+/* Lock all current and future pages so the thread never takes a page
+   fault in the middle of a sample */
+static void
+rt_lock_memory (const struct rtacq_config *cfg)
+{
+    if (cfg->enabled && mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+        log_error ("mlockall failed");
+}
+
+static void *
+rtacq_thread (void *arg)
+{
+    struct rtacq *rt = arg;
+    struct acquisition *acq = rt->acq;
+    struct acq_reading r;
+    unsigned due;
+    int64_t now, next;
+
+    for (;;)
+      {
+        now = clock_ns (CLOCK_MONOTONIC);
+
+        due = acquire_due (acq, now);
+        if (due)
+          {
+            /* Do not get cancelled while holding the bus */
+            pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+            acq->transactions++;
+            r.t = now;
+            if (sensors_sample_by (due, &r.sample,
+                                   acquire_deadline (acq, due, now)) < 0)
+                acq->errors++;
+            else if (!spsc_push (&rt->ring, &r))
+                atomic_fetch_add (&rt->dropped, 1);
+            else
+                evcore_wakeup (&rt->wake);
+            pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+          }
+
+        /* Period changes are picked up on the next wake up, sleep at most a
+           second so a faster cadence takes effect quickly */
+        next = acquire_next_due (acq);
+        if (next > now + NSEC_PER_SEC)
+            next = now + NSEC_PER_SEC;
+        vclock_sleep_until (next);
+      }
+
+    return NULL;
+}
+
+int
+rtacq_start (struct rtacq *rt, const struct rtacq_config *cfg,
+             struct acquisition *acq, struct evcore *core)
+{
+    int s;
+
+    memset (rt, 0, sizeof (*rt));
+    rt->cfg = *cfg;
+    rt->acq = acq;
+    spsc_init (&rt->ring);
+
+    if (evcore_wakeup_init (&rt->wake, core, rtacq_cb, rt) < 0)
+        return -1;
+
+    rt_lock_memory (cfg);
+
+    /* From here on the thread owns the schedule */
+    acq->threaded = true;
+    evcore_timer_set (&acq->timer, 0, 0);
+
+    s = rt_thread_create (&rt->thread, cfg, rtacq_thread, rt);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create acquisition thread");
+        acq->threaded = false;
+        rtacq_stop (rt);
+        return -1;
+      }
+    rt->started = true;
+
+    return 0;
+}
+
+void
+rtacq_stop (struct rtacq *rt)
+{
+    /* Never started */
+    if (!rt->acq)
+        return;
+
+    if (rt->started)
+      {
+        pthread_cancel (rt->thread);
+        pthread_join (rt->thread, NULL);
+        rt->started = false;
+      }
+    evcore_source_free (&rt->wake);
+}
+
+/* Drain samples handed over by the acquisition thread */
+static void
+rtacq_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct rtacq *rt = arg;
+    struct acq_reading r;
+
+    /* Samples posted while we were busy are all picked up here */
+    while (spsc_pop (&rt->ring, &r))
+        acquire_store (rt->acq, &r.sample);
+}
+
+struct bench_run {
+    const struct rtacq_config *cfg;
+    int                        count;
+    int64_t                    interval;
+    int64_t                   *intervals;
+};
+
+static void *
+bench_thread (void *arg)
+{
+    struct bench_run *run = arg;
+    struct SensorSample sample;
+    int64_t deadline, now, prev;
+    int ii;
+
+    prev = clock_ns (CLOCK_MONOTONIC);
+    deadline = prev + run->interval;
+    for (ii = 0; ii < run->count; ii++)
+      {
+        vclock_sleep_until (deadline);
+        now = clock_ns (CLOCK_MONOTONIC);
+        sensors_sample (SENSOR_ALL, &sample);
+
+        run->intervals[ii] = now - prev;
+        prev = now;
+        deadline += run->interval;
+      }
+
+    return NULL;
+}
+
+static int
+compare_s64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int
+bench_one (const char *name, const struct rtacq_config *cfg, int count,
+           int64_t interval)
+{
+    static const double pct[] = { 0.0, 50.0, 90.0, 99.0, 99.9, 100.0 };
+    struct bench_run run;
+    pthread_t thread;
+    size_t ii, idx;
+    int s;
+
+    run.cfg = cfg;
+    run.count = count;
+    run.interval = interval;
+    run.intervals = calloc (count, sizeof (int64_t));
+    if (!run.intervals)
+      {
+        log_error ("calloc failed for jitter benchmark");
+        return -1;
+      }
+
+    s = rt_thread_create (&thread, cfg, bench_thread, &run);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create benchmark thread");
+        free (run.intervals);
+        return -1;
+      }
+    pthread_join (thread, NULL);
+
+    qsort (run.intervals, count, sizeof (int64_t), compare_s64);
+    printf ("%-10s", name);
+    for (ii = 0; ii < sizeof (pct) / sizeof (pct[0]); ii++)
+      {
+        idx = (size_t) (pct[ii] / 100.0 * (count - 1) + 0.5);
+        printf (" %9.1f", (double) run.intervals[idx] / 1000.0);
+      }
+    printf ("\n");
+
+    free (run.intervals);
+    return 0;
+}
+
+int
+rtacq_bench (const struct rtacq_config *cfg, int count, int64_t interval)
+{
+    struct rtacq_config normal = { false, 0, -1 };
+    struct rtacq_config rt = *cfg;
+
+    if (count < 1)
+        return -1;
+
+    rt.enabled = true;
+    if (!rt.priority)
+        rt.priority = RTACQ_DEFAULT_PRIORITY;
+
+    printf ("%d samples, %" PRId64 " us interval\n", count, interval / 1000);
+    printf ("%-10s %9s %9s %9s %9s %9s %9s  (us)\n", "mode", "min", "p50",
+            "p90", "p99", "p99.9", "max");
+
+    if (bench_one ("normal", &normal, count, interval) < 0)
+        return -1;
+
+    rt_lock_memory (&rt);
+    return bench_one ("realtime", &rt, count, interval);
+}
@@ -0,0 +1,67 @@
+/*
+ *  rtacq.h
+ *    Optional real-time acquisition thread running under SCHED_FIFO with
+ *    locked memory, handing samples to the event loop through a SPSC ring
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _RTACQ_H_
+#define _RTACQ_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#include "acquire.h"
+#include "spsc.h"
+#include "evcore.h"
+
+#define RTACQ_DEFAULT_PRIORITY 50
+
+struct rtacq_config {
+    bool enabled;
+    int  priority;  /* SCHED_FIFO priority, 1 to 99 */
+    int  cpu;       /* CPU to pin the thread to, -1 for any */
+};
+
+struct rtacq {
+    struct rtacq_config  cfg;
+    struct acquisition  *acq;
+    struct spsc_ring     ring;
+    struct evcore_source wake;  /* posted for each sample */
+    pthread_t            thread;
+    bool                 started;
+    atomic_uint_least64_t dropped;
+};
+
+/* Take over the schedule of acq and run it in a real-time thread */
+extern int rtacq_start (struct rtacq *, const struct rtacq_config *,
+                        struct acquisition *, struct evcore *);
+
+extern void rtacq_stop (struct rtacq *);
+
+/* Sample every interval nanoseconds count times and print the distribution
+   of the intervals actually achieved, with and without real-time mode */
+extern int rtacq_bench (const struct rtacq_config *, int, int64_t);
+
+#endif /* _RTACQ_H_ */
@@ -0,0 +1,126 @@
+/*
+ *  schedule.c
+ *    Drift-free report scheduler with deadlines aligned to wall-clock
+ *    multiples of the report period
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "schedule.h"
+#include "common.h"
+#include "log.h"
+
+static void schedule_cb (uint64_t, void *);
+
+/* Arm the timer for the first wall-clock period boundary after now */
+static int
+schedule_arm (struct report_schedule *sched)
+{
+    int64_t now_real, now_mono, next_real, deadline;
+
+    now_real = clock_ns (CLOCK_REALTIME);
+    now_mono = clock_ns (CLOCK_MONOTONIC);
+
+    /* The boundary is recalculated every period so that a stepped wall
+       clock is followed without accumulating any error */
+    next_real = (now_real / sched->period + 1) * sched->period;
+    /* A wall clock stepped back by a few ms between arming and firing would
+       serve the same boundary again a moment later */
+    if (next_real == sched->served)
+        next_real += sched->period;
+    deadline = now_mono + (next_real - now_real);
+
+    /* Count the periods we skipped if the callback ran for too long */
+    if (sched->deadline && deadline - sched->deadline > sched->period * 3 / 2)
+        sched->stats.missed += (deadline - sched->deadline) / sched->period - 1;
+    sched->deadline = deadline;
+    sched->boundary = next_real;
+
+    return evcore_timer_set (&sched->timer, deadline, 0);
+}
+
+int
+schedule_init (struct report_schedule *sched, struct evcore *core,
+               int64_t period, evcore_cb cb, void *arg)
+{
+    memset (sched, 0, sizeof (*sched));
+    sched->period = period;
+    sched->cb = cb;
+    sched->arg = arg;
+
+    if (evcore_timer_init (&sched->timer, core, schedule_cb, sched) < 0)
+        return -1;
+
+    return schedule_arm (sched);
+}
+
+void
+schedule_free (struct report_schedule *sched)
+{
+    evcore_source_free (&sched->timer);
+}
+
+int
+schedule_set_period (struct report_schedule *sched, int64_t period)
+{
+    sched->period = period;
+    /* Not late for anything on the old grid */
+    sched->deadline = 0;
+    return schedule_arm (sched);
+}
+
+int64_t
+schedule_mean_late (const struct schedule_stats *stats)
+{
+    if (!stats->reports)
+        return 0;
+    return stats->sum_late / (int64_t) stats->reports;
+}
+
+static void
+schedule_cb (uint64_t n, void *arg)
+{
+    struct report_schedule *sched = arg;
+    struct schedule_stats *stats = &sched->stats;
+    int64_t late;
+
+    late = clock_ns (CLOCK_MONOTONIC) - sched->deadline;
+    stats->reports++;
+    stats->last_late = late;
+    stats->sum_late += late;
+    if (late > stats->max_late)
+        stats->max_late = late;
+    sched->served = sched->boundary;
+
+    sched->cb (n, sched->arg);
+
+    if (stats->reports % SCHEDULE_STATS_INTERVAL == 0)
+        _log_debug ("schedule: %" PRIu64 " reports, %" PRIu64 " missed, "
+                    "lateness last %" PRId64 " us mean %" PRId64 " us "
+                    "max %" PRId64 " us\n", stats->reports, stats->missed,
+                    stats->last_late / 1000, schedule_mean_late (stats) / 1000,
+                    stats->max_late / 1000);
+
+    schedule_arm (sched);
+}
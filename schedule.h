@@ -0,0 +1,73 @@
+/*
+ *  schedule.h
+ *    Drift-free report scheduler with deadlines aligned to wall-clock
+ *    multiples of the report period
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#include <stdint.h>
+
+#include <event2/event.h>
+
+#include "evcore.h"
+
+/* Log scheduling statistics every this many reports */
+#define SCHEDULE_STATS_INTERVAL 60
+
+/* Lateness statistics, all times in nanoseconds */
+struct schedule_stats {
+    uint64_t reports;
+    uint64_t missed;        /* periods skipped because we were too late */
+    int64_t  last_late;
+    int64_t  max_late;
+    int64_t  sum_late;
+};
+
+/*
+ * The scheduler arms a timerfd on CLOCK_MONOTONIC with absolute deadlines.
+ * Each deadline is calculated from the wall clock so that reports go out at
+ * multiples of the period since the epoch, which keeps all slaves in phase.
+ */
+struct report_schedule {
+    struct evcore_source  timer;
+    int64_t               period;   /* nanoseconds */
+    int64_t               deadline; /* CLOCK_MONOTONIC, nanoseconds */
+    int64_t               boundary; /* CLOCK_REALTIME of the deadline */
+    int64_t               served;   /* boundary of the last report */
+    evcore_cb             cb;
+    void                 *arg;
+    struct schedule_stats stats;
+};
+
+extern int schedule_init (struct report_schedule *, struct evcore *,
+                          int64_t, evcore_cb, void *);
+
+extern void schedule_free (struct report_schedule *);
+
+/* Change the period, the next report goes out at a boundary of the new one */
+extern int schedule_set_period (struct report_schedule *, int64_t);
+
+/* Mean lateness in nanoseconds */
+extern int64_t schedule_mean_late (const struct schedule_stats *);
+
+#endif /* _SCHEDULE_H_ */
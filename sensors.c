@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
@@ -40,26 +41,28 @@
 #include "HTS221.h"   // HTS221 relative humidity and temperature sensor
 #include "LPS25H.h"   // LPS25H MEMS 260-1260 hPa pressure sensor
 #include "sensors.h"
+#include "i2cbus.h"
 
-__s16 HTS221_T_OUT, HTS221_H_OUT;
-__s32 LPS25H_P_OUT;
 __s16 H0_T0_OUT = 0;
 __s16 H1_T0_OUT = 0;
 __s16 T0_OUT = 0;
 __s16 T1_OUT = 0;
 float H0_rH, H1_rH;
 float T0_degC, T1_degC;
-__u8 LPS25H_status, LPS25H_fifo_status, HTS221_status;
+__u8 LPS25H_status, HTS221_status;
 char i2cDp[] = DEVPATH_I2C;
 int i2c;
 
-float P_LPS25H, T_HTS221, H_HTS221;
+// linear conversion set up by an alternative backend such as IIO, used
+// instead of the HTS221 calibration when the scale is non-zero
+float conv_scale[SENSOR_CHANNELS], conv_offset[SENSOR_CHANNELS];
 
-int
-compare_s16 (const void * a, const void * b)
-{
-    return (*(__s16*)a - *(__s16*)b);
-}
+// HTS221 calibration block as read in sensors_init, for raw reports
+static __u8 hts221_cal[HTS221_CAL_SIZE];
+static int hts221_cal_valid;
+
+// channels whose sensor is powered up, see sensors_set_power
+static unsigned powered;
 
 int
 compare_s32 (const void * a, const void * b)
@@ -67,75 +70,95 @@ compare_s32 (const void * a, const void * b)
     return (*(__s32*)a - *(__s32*)b);
 }
 
-int
-sensors_init (void)
+// Set LPS25H_CTRL_REG1 following usage in RTIMULibDrive11
+static __u8
+lps25h_ctrl_reg1 (int pd)
+{
+    return LPS25H_CTRL_REG1_PD_if(pd) |         // 1 = power up
+           LPS25H_CTRL_REG1_ODR_if(LPS25HifODR) | // output data rate
+           LPS25H_CTRL_REG1_DIFF_EN_if(0) |   // disable differential pressure
+           LPS25H_CTRL_REG1_BDU_if(1) |       // enable block update
+           LPS25H_CTRL_REG1_RESET_AZ_if(0) |  // do not auto-zero
+           LPS25H_CTRL_REG1_SIM_if(0);        // SPI mode (irrelevant for i2c)
+}
+
+// Set HTS221_CTRL_REG1 following usage in RTIMULibDrive11
+static __u8
+hts221_ctrl_reg1 (int pd)
+{
+    return HTS221_CTRL_REG1_PD_if(pd) |         // 1 = power up
+           HTS221_CTRL_REG1_BDU_if(1) |         // enable block update
+           HTS221_CTRL_REG1_ODR_if(HTS221ifODR); // output data rate
+}
+
+static int
+sensors_init_locked (void)
 {
     int res;
     unsigned char buf[16];
-    unsigned char HTS221cal[16];
+    unsigned char HTS221cal[HTS221_CAL_SIZE];
     __u16 T0_degC_x8;
     __u16 T1_degC_x8;
     __u8 H0_rH_x2;
     __u8 H1_rH_x2;
 
+    // a retry starts over with a fresh descriptor
+    if (i2c > 0)
+        i2c_close (i2c);
+
     // open the i2c device on raspberry pi
-    i2c = open (i2cDp, O_RDWR);
+    i2c = i2c_open (i2cDp);
     if (i2c == -1)
       {
         perror ("open i2c");
+        i2c = 0;
         return 1;
       }
 
     // discover LPS25H
-    res = ioctl (i2c, I2C_SLAVE, LPS25H_SAD);
+    res = i2c_bus_select (i2c, LPS25H_SAD);
     buf[0] = LPS25H_WHO_AM_I;
-    res = write (i2c, buf, 1);
+    res = i2c_write (i2c, buf, 1);
     if (res == -1)
       {
         perror ("write i2c");
-        return 1;
+        goto fail;
       }
     
-    res = read (i2c, buf, 1);
+    res = i2c_read (i2c, buf, 1);
     if (res != 1)
       {
         if (res == -1) perror ("read i2c");
         else printf ("read i2c returns %d\n", res);
-        return 1;
+        goto fail;
       }
     if (buf[0] != LPS25H_who_am_i)
       {
         printf ("expect LPS25H id = 0x%x, get 0x%x\n", LPS25H_who_am_i, buf[0]);
-        return 1;
+        goto fail;
       }
 
     // Set up for temperature measurements using the LPS25H
-    // Set LPS25H_CTRL_REG1 following usage in RTIMULibDrive11
     buf[0] = LPS25H_CTRL_REG1;
-    buf[1] = LPS25H_CTRL_REG1_PD_if(1) |      // power up
-           LPS25H_CTRL_REG1_ODR_if(LPS25HifODR) | // output data rate
-           LPS25H_CTRL_REG1_DIFF_EN_if(0) |   // disable differential pressure
-           LPS25H_CTRL_REG1_BDU_if(1) |       // enable block update
-           LPS25H_CTRL_REG1_RESET_AZ_if(0) |  // do not auto-zero
-           LPS25H_CTRL_REG1_SIM_if(0);        // SPI mode (irrelevant for i2c)
-    res = write(i2c, buf, 2);
+    buf[1] = lps25h_ctrl_reg1 (1);
+    res = i2c_write (i2c, buf, 2);
     if (res != 2)
       {
         perror("i2c write LPS25H");
-        return 1;
+        goto fail;
       }
     /* Set pressure averaging modes: internal averaging numbers
                                          for mode = 0,  1,   2,   3
     LPS25HifAVGP      pressure averaging number     8, 32, 128, 512  */
     buf[0] = LPS25H_RES_CONF;
     buf[1] = LPS25H_AV_CONF_AVGP_if(LPS25HifAVGP);
-    res = write(i2c, buf, 2);
+    res = i2c_write (i2c, buf, 2);
     /* Set FIFO mode. (The FIFO holds pressure data so this should not make a
     difference for temperature.) */
     buf[0] = LPS25H_FIFO_CTRL;
     buf[1] = LPS25H_FIFO_CTRL_F_MODE_if(6) |    // running average
              LPS25H_FIFO_CTRL_WTM_POINT_if(1);  // average 2 samples
-    res = write(i2c, buf, 2);
+    res = i2c_write (i2c, buf, 2);
     // Set LPS25H_CTRL_REG2 following usage in RTIMULibDrive11
     buf[0] = LPS25H_CTRL_REG2;
     buf[1] = LPS25H_CTRL_REG2_BOOT_if(0) |      // no refresh registers from flash
@@ -149,36 +172,33 @@ sensors_init (void)
     /* LPS25H_CTRL_REG3, LPS25H_CTRL_REG4, LPS25H_INT_CFG are irrelevant since
        interrupts are not being used. */
     // discover HTS221
-    res = ioctl (i2c, I2C_SLAVE, HTS221_SAD);
+    res = i2c_bus_select (i2c, HTS221_SAD);
     buf[0] = HTS221_WHO_AM_I;
-    res = write (i2c, buf, 1);
+    res = i2c_write (i2c, buf, 1);
     if (res != 1)
       {
         perror ("i2c write HTS221");
-        return 1;
+        goto fail;
       }
 
-    res = read (i2c, buf, 1);
+    res = i2c_read (i2c, buf, 1);
     if (res != 1)
       {
         if (res == -1) perror("read i2c");
         else printf("read i2c returns %d\n", res);
-        return 1;
+        goto fail;
       }
 
     if (buf[0] != HTS221_who_am_i)
       {
         printf("expect HTS221 id = 0x%x, get 0x%x\n", HTS221_who_am_i, buf[0]);
-        return 1;
+        goto fail;
       }
 
     // Set up for temperature measurements using the HTS221
-    // Set HTS221_CTRL_REG1 following usage in RTIMULibDrive11
-    buf[0] = HTS221_CTRL_REG1;                      //Drive11
-    buf[1] = HTS221_CTRL_REG1_PD_if(1) |            // power up             1
-             HTS221_CTRL_REG1_BDU_if(1) |           // enable block update  1
-             HTS221_CTRL_REG1_ODR_if(HTS221ifODR);  // output data rate     3
-    res = write (i2c, buf, 2);
+    buf[0] = HTS221_CTRL_REG1;
+    buf[1] = hts221_ctrl_reg1 (1);
+    res = i2c_write (i2c, buf, 2);
     /* Set temperature and humidity averaging modes: internal averaging numbers
                                     for mode = 0, 1,  2,  3,  4,   5,   6,   7
     HTS221ifAVGH  humidity averaging number     4, 8, 16, 32, 64, 128, 256, 512
@@ -186,17 +206,19 @@ sensors_init (void)
     buf[0] = HTS221_AV_CONF;                                           //Drive11
     buf[1] = HTS221_AV_CONF_AVGT_if(HTS221ifAVGT) |                    //   3
              HTS221_AV_CONF_AVGH_if(HTS221ifAVGH);                     //   3
-    res = write(i2c, buf, 2);
+    res = i2c_write (i2c, buf, 2);
     /* Read the calibration registers and calculate conversion coefficients.
     See datasheet tables 19 and 20. */
     buf[0] = HTS221_CAL_H0_rH_x2 | HTS221_reg_auto;
-    res = write(i2c, buf, 1);
-    res  = read(i2c, HTS221cal, 16);
-    if (res != 16)
+    res = i2c_write (i2c, buf, 1);
+    res  = i2c_read (i2c, HTS221cal, HTS221_CAL_SIZE);
+    if (res != HTS221_CAL_SIZE)
       {
         if (res == -1) perror("HTS221_CAL_H0_rH_x2");
         else printf("read 16 at HTS221_CAL_H0_rH_x2 returns %d\n", res);
       }
+    hts221_cal_valid = res == HTS221_CAL_SIZE;
+    memcpy (hts221_cal, HTS221cal, HTS221_CAL_SIZE);
 
     T0_degC_x8 = (((__u16)HTS221cal[5] & 0x3) << 8) | (__u16)HTS221cal[2];
     T1_degC_x8 = (((__u16)HTS221cal[5] & 0xc) << 6) | (__u16)HTS221cal[3];
@@ -211,17 +233,40 @@ sensors_init (void)
     H0_rH = (float)(H0_rH_x2) / 2.0f;
     H1_rH = (float)(H1_rH_x2) / 2.0f;
 
+    powered = SENSOR_ALL;
     return 0;
+
+  fail:
+    i2c_close (i2c);
+    i2c = 0;
+    return 1;
 }
 
 int
-sensors_grab(struct SensorData *data, int samplecount, int sample_usec)
+sensors_init (void)
 {
-    int res, ii;
-    struct timespec ts;
-    unsigned char buf[16];
-    __s16 *HTS221d16_H_OUT, *HTS221d16_T_OUT;
-    __s32 *LPS25Hd16_P_OUT;
+    int res;
+
+    i2c_bus_lock ();
+    i2c_trace_mark (I2C_MARK_INIT, 0);
+    res = sensors_init_locked ();
+    i2c_bus_unlock ();
+
+    return res;
+}
+
+int
+sensors_set_averaging (int avgp, int avgt, int avgh)
+{
+    __u8 p = LPS25H_AV_CONF_AVGP_if(avgp);
+    __u8 th = HTS221_AV_CONF_AVGT_if(avgt) | HTS221_AV_CONF_AVGH_if(avgh);
+    struct i2c_txn txn[2] = {
+        { LPS25H_SAD, LPS25H_RES_CONF, true, &p, 1, 0 },
+        { HTS221_SAD, HTS221_AV_CONF, true, &th, 1, 0 }
+    };
+    struct i2c_request req = { i2c, txn, 2, I2C_PRIO_CONFIG, 0,
+                               I2C_MARK_AVERAGING,
+                               avgp | avgt << 8 | avgh << 16 };
 
     // check if i2c is initalized
     if (!i2c)
@@ -230,187 +275,230 @@ sensors_grab(struct SensorData *data, int samplecount, int sample_usec)
         return -1;
       }
 
-    /*
-    * Allocate memory for storing sensor readings.
-    */
-    LPS25Hd16_P_OUT = calloc (samplecount, sizeof(__s32));
-    if (!LPS25Hd16_P_OUT) return 1;
-
-    HTS221d16_T_OUT = calloc (samplecount, sizeof(__s16));
-    if (!HTS221d16_T_OUT)
+    if (i2c_bus_submit (&req) < 0)
       {
-        free (LPS25Hd16_P_OUT);
-        return 1;
+        perror ("i2c write averaging configuration");
+        return -1;
       }
 
-    HTS221d16_H_OUT = calloc (samplecount, sizeof(__s16));
-    if (!HTS221d16_H_OUT)
+    return 0;
+}
+
+int
+sensors_set_power (unsigned mask)
+{
+    bool lps = (mask & SENSOR_BIT(SENSOR_PRESSURE)) != 0;
+    bool hts = (mask & (SENSOR_BIT(SENSOR_TEMPERATURE) |
+                        SENSOR_BIT(SENSOR_HUMIDITY))) != 0;
+    __u8 p = lps25h_ctrl_reg1 (lps), th = hts221_ctrl_reg1 (hts);
+    struct i2c_txn txn[2];
+    struct i2c_request req = { i2c, txn, 0, I2C_PRIO_CONFIG, 0,
+                               I2C_MARK_POWER, mask };
+    unsigned want;
+
+    // check if i2c is initalized
+    if (!i2c)
       {
-        free (LPS25Hd16_P_OUT);
-        free (HTS221d16_T_OUT);
-        return 1;
+        errno = EINVAL;
+        return -1;
       }
 
-    for (ii = 0; ii < samplecount; ii++)
+    // the HTS221 measures both of its channels or none
+    want = (lps ? SENSOR_BIT(SENSOR_PRESSURE) : 0) |
+           (hts ? SENSOR_BIT(SENSOR_TEMPERATURE) |
+                  SENSOR_BIT(SENSOR_HUMIDITY) : 0);
+    if ((want ^ powered) & SENSOR_BIT(SENSOR_PRESSURE))
+        txn[req.n++] = (struct i2c_txn) { LPS25H_SAD, LPS25H_CTRL_REG1, true,
+                                          &p, 1, 0 };
+    if ((want ^ powered) & SENSOR_BIT(SENSOR_TEMPERATURE))
+        txn[req.n++] = (struct i2c_txn) { HTS221_SAD, HTS221_CTRL_REG1, true,
+                                          &th, 1, 0 };
+    if (!req.n)
+        return 0;
+
+    if (i2c_bus_submit (&req) < 0)
       {
-        // wait out the sample interval before fetching sample
-        ts.tv_sec = sample_usec / 1000000;
-        ts.tv_nsec = (sample_usec % 1000000) * 1000;
-        nanosleep (&ts, NULL);
-
-        // get a LPS25H pressure sample
-        res = ioctl (i2c, I2C_SLAVE, LPS25H_SAD);
-        buf[0] = LPS25H_STATUS_REG;
-        res = write (i2c, buf, 1);
-        res = read (i2c, buf, 2);
-        LPS25H_status = buf[0];
-        buf[0] = LPS25H_FIFO_STATUS;
-        res = write (i2c, buf, 1);
-        res = read (i2c, buf, 2);
-        LPS25H_fifo_status = buf[0];
-        buf[0] = LPS25H_PRESS_POUT|LPS25H_reg_auto;
-        res = write (i2c, buf, 1);
-        res = read (i2c, buf, 3); // read registers at 0x28, 0x29, 0x2a
+        perror ("i2c write power mode");
+        return -1;
+      }
 
-        // new pressure data available
-        if (LPS25H_status & 2)
-          {
-            LPS25Hd16_P_OUT[ii] =   (((__s32)(buf[2])) << 16) |
-                                    (((__s32)(buf[1])) << 8) |
-                                    (((__s32)(buf[0])));
-          }
+    powered = want;
+    return 0;
+}
 
-        // get a HTS221 humidity sample
-        res = ioctl (i2c, I2C_SLAVE, HTS221_SAD);
-        buf[0] = HTS221_STATUS_REG;
-        res = write (i2c, buf, 1);
-        res = read (i2c, buf, 2);
-        HTS221_status = buf[0];
+int
+sensors_sample (unsigned mask, struct SensorSample *sample)
+{
+    return sensors_sample_by (mask, sample, 0);
+}
 
-        // new humidity data available
-        if (HTS221_status & 2)
-          {
-            buf[0] = HTS221_HUMIDITY_OUT | HTS221_reg_auto;
-            res = write (i2c, buf, 1);
-            res = read (i2c, buf, 2);
-            HTS221d16_H_OUT[ii] = (((__s16)buf[1]) << 8) | (__s16)buf[0];
-          }
+int
+sensors_sample_by (unsigned mask, struct SensorSample *sample,
+                   int64_t deadline)
+{
+    __u8 p[4], th[5];
+    struct i2c_txn txn[2];
+    struct i2c_txn *tp = NULL, *tth = NULL;
+    struct i2c_request req = { i2c, txn, 0, I2C_PRIO_SAMPLE, deadline,
+                               I2C_MARK_SAMPLE, mask };
+    int res;
 
-        // new temperature data available
-        if (HTS221_status & 1)
-          {
-            buf[0] = HTS221_TEMP_OUT | HTS221_reg_auto;
-            res = write (i2c, buf, 1);
-            res = read (i2c, buf, 2);
-            HTS221d16_T_OUT[ii] = (((__s16)buf[1]) << 8) | (__s16)buf[0];
-          }
+    // check if i2c is initalized
+    if (!i2c)
+      {
+        errno = EINVAL;
+        return -1;
       }
 
+    sample->mask = 0;
+
     /*
-    * Shift all non-zero elements to front thus ignoring zero values
-    * Traverse the array. If element encountered is non-zero, then replace the
-    * element at index 'ii' with this element
-    *
-    * Sort arrays using qsort, this may not be the fastest method
-    * However because this happens infrequently this will not be an issue
-    *
-    * Calculate atmospheric pressure, temperature and relative humidity
-    * from median sample
+    * Status and pressure registers are adjacent (0x27 to 0x2a) so status
+    * and a pressure sample are fetched with a single auto-increment read
     */
-    res = 0;
-    for (ii = 0; ii < samplecount; ii++)
+    if (mask & SENSOR_BIT(SENSOR_PRESSURE))
       {
-        if (LPS25Hd16_P_OUT[ii])
-          {
-            LPS25Hd16_P_OUT[res++] = LPS25Hd16_P_OUT[ii];
-          }
+        tp = &txn[req.n++];
+        *tp = (struct i2c_txn) { LPS25H_SAD,
+                                 LPS25H_STATUS_REG | LPS25H_reg_auto,
+                                 false, p, 4, 0 };
       }
-    if (res)
+
+    /*
+    * Likewise for HTS221, status is followed by humidity (0x28) and then
+    * temperature (0x2a). Only read as far as the channels that are due.
+    */
+    if (mask & (SENSOR_BIT(SENSOR_HUMIDITY) | SENSOR_BIT(SENSOR_TEMPERATURE)))
       {
-        qsort (LPS25Hd16_P_OUT, res, sizeof(__s32), compare_s32);
-        if (res % 2)
-          {
-            P_LPS25H = (float)(LPS25Hd16_P_OUT[(res+1)/2-1]) / 4096.0f;
-          }
-        else
-          {
-            P_LPS25H = (float)((LPS25Hd16_P_OUT[res/2] + LPS25Hd16_P_OUT[res/2-1]) / 2) / 4096.0f;
-          }
+        tth = &txn[req.n++];
+        *tth = (struct i2c_txn) { HTS221_SAD,
+                                  HTS221_STATUS_REG | HTS221_reg_auto, false,
+                                  th, mask & SENSOR_BIT(SENSOR_TEMPERATURE) ?
+                                  5 : 3, 0 };
       }
 
-    res = 0;
-    for (ii = 0; ii < samplecount; ii++)
+    // the bus scheduler reads whichever slave is selected already first
+    res = i2c_bus_submit (&req);
+
+    if (tp && tp->res == 4)
       {
-        if (HTS221d16_T_OUT[ii])
+        LPS25H_status = p[0];
+
+        // new pressure data available
+        if (LPS25H_STATUS_REG_P_DA_ef(LPS25H_status))
           {
-            HTS221d16_T_OUT[res++] = HTS221d16_T_OUT[ii];
+            sample->raw[SENSOR_PRESSURE] = (((__s32)(p[3])) << 16) |
+                                           (((__s32)(p[2])) << 8) |
+                                           (((__s32)(p[1])));
+            sample->mask |= SENSOR_BIT(SENSOR_PRESSURE);
           }
       }
-    if (res)
+
+    if (tth && tth->res == (ssize_t) tth->len)
       {
-        qsort (HTS221d16_T_OUT, res, sizeof(__s16), compare_s16);
-        if (res % 2)
-          {
-            T_HTS221 = T0_degC + (((float)(HTS221d16_T_OUT[(res+1)/2-1])-T0_OUT)/
-                                    (T1_OUT-T0_OUT))*(T1_degC-T0_degC);
-          }
-        else
+        HTS221_status = th[0];
+
+        // new humidity data available
+        if ((mask & SENSOR_BIT(SENSOR_HUMIDITY)) &&
+            HTS221_STATUS_REG_H_DA_ef(HTS221_status))
           {
-            T_HTS221 = T0_degC + (((float)((HTS221d16_T_OUT[res/2] +
-                                    HTS221d16_T_OUT[res/2-1]) / 2)-T0_OUT)/
-                                    (T1_OUT-T0_OUT))*(T1_degC-T0_degC);
+            sample->raw[SENSOR_HUMIDITY] = (__s16)((((__u16)th[2]) << 8) |
+                                                   (__u16)th[1]);
+            sample->mask |= SENSOR_BIT(SENSOR_HUMIDITY);
           }
-      }
 
-    res = 0;
-    for (ii = 0; ii < samplecount; ii++)
-      {
-        if (HTS221d16_H_OUT[ii])
+        // new temperature data available
+        if ((mask & SENSOR_BIT(SENSOR_TEMPERATURE)) &&
+            HTS221_STATUS_REG_T_DA_ef(HTS221_status))
           {
-            HTS221d16_H_OUT[res++] = HTS221d16_H_OUT[ii];
+            sample->raw[SENSOR_TEMPERATURE] = (__s16)((((__u16)th[4]) << 8) |
+                                                      (__u16)th[3]);
+            sample->mask |= SENSOR_BIT(SENSOR_TEMPERATURE);
           }
       }
-    if (res)
+
+    return res;
+}
+
+float
+sensors_convert (enum sensor_channel channel, float raw)
+{
+    if (conv_scale[channel] != 0.0f)
+        return (raw + conv_offset[channel]) * conv_scale[channel];
+
+    switch (channel)
       {
-        qsort (HTS221d16_H_OUT, res, sizeof(__s16), compare_s16);
-        if (res % 2)
-          {
-            H_HTS221 = H0_rH + (((float)(HTS221d16_H_OUT[(res+1)/2-1])-H0_T0_OUT)/
-                                (H1_T0_OUT-H0_T0_OUT))*(H1_rH-H0_rH);
-          }
-        else
-          {
-            H_HTS221 = H0_rH + (((float)((HTS221d16_H_OUT[res/2] +
-                                HTS221d16_H_OUT[res/2-1]) / 2)-H0_T0_OUT)/
-                                (H1_T0_OUT-H0_T0_OUT))*(H1_rH-H0_rH);
-          }
+        case SENSOR_PRESSURE:
+            return raw / 4096.0f;
+        case SENSOR_TEMPERATURE:
+            return T0_degC + ((raw-T0_OUT)/(T1_OUT-T0_OUT))*(T1_degC-T0_degC);
+        case SENSOR_HUMIDITY:
+            return H0_rH + ((raw-H0_T0_OUT)/(H1_T0_OUT-H0_T0_OUT))*(H1_rH-H0_rH);
+        default:
+            return 0.0f;
       }
+}
 
-    /*
-    * Reference: datasheet DM00116291.pdf (October 2015), www.st.com
-    * According to pressure Mechanical characteristics: see datasheet table 3
-    * For pressure in range 800 to 1100 hPa inbetween 20 to 60 °C ±0.2
-    */
-    //data->pressure = ceilf(P_LPS25H / 0.2f) * 0.2f;
-    data->pressure = P_LPS25H;
+void
+sensors_set_conversion (enum sensor_channel channel, float scale,
+                        float offset)
+{
+    conv_scale[channel] = scale;
+    conv_offset[channel] = offset;
+}
 
-    /*
-    * Reference: datasheet DM00066332.pdf (January 2014), www.st.com
-    * According to humidity and temperature accuracy specification: see datasheet table 3
-    * For humidity in range 20 to 80 % rH ±3.5
-    * For temperature in range 15 to 60 °C ±0.5
-    */
-    //data->temperature = ceilf(T_HTS221 / 0.5f) * 0.5f;
-    //data->humidity = ceilf(H_HTS221 / 0.5f) * 0.5f;
-    data->temperature = T_HTS221;
-    data->humidity = H_HTS221;
+int
+sensors_calibration (__u8 *cal)
+{
+    if (!hts221_cal_valid || conv_scale[SENSOR_TEMPERATURE] != 0.0f ||
+        conv_scale[SENSOR_HUMIDITY] != 0.0f)
+        return -1;
+
+    memcpy (cal, hts221_cal, HTS221_CAL_SIZE);
+    return 0;
+}
+
+int
+sensors_aggregate (enum sensor_channel channel, __s32 *samples, int n,
+                   __s32 *raw, float *value, float *sd)
+{
+    double mean = 0.0, m2 = 0.0;
+    float median;
+    int ii;
+
+    if (n <= 0)
+        return -1;
 
     /*
-    * Free memory from allocated sensor sample arrays since we no longer need them
+    * Sort array using qsort, this may not be the fastest method
+    * However because this happens infrequently this will not be an issue
+    *
+    * Calculate atmospheric pressure, temperature or relative humidity
+    * from median sample
     */
-    free (LPS25Hd16_P_OUT);
-    free (HTS221d16_T_OUT);
-    free (HTS221d16_H_OUT);
+    qsort (samples, n, sizeof(__s32), compare_s32);
+    if (n % 2)
+        median = (float) samples[(n+1)/2-1];
+    else
+        median = ((float) samples[n/2] + (float) samples[n/2-1]) / 2.0f;
+    if (raw)
+        *raw = n % 2 ? samples[(n+1)/2-1] :
+               (__s32) (((int64_t) samples[n/2] + samples[n/2-1] + 1) >> 1);
+    *value = sensors_convert (channel, median);
+
+    // standard deviation in the unit of the channel, a measure of noise
+    *sd = 0.0f;
+    if (n > 1)
+      {
+        for (ii = 0; ii < n; ii++)
+            mean += samples[ii];
+        mean /= n;
+        for (ii = 0; ii < n; ii++)
+            m2 += (samples[ii] - mean) * (samples[ii] - mean);
+        *sd = (float) sqrt (m2 / (n - 1)) *
+              fabsf (sensors_convert (channel, 1.0f) -
+                     sensors_convert (channel, 0.0f));
+      }
 
     return 0;
-}
\ No newline at end of file
+}
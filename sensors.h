@@ -26,6 +26,9 @@
 #ifndef SENSORS_H
 #define SENSORS_H
 
+#include <stdint.h>
+#include <asm/types.h>
+
 // averaging mode and output rate definitions for HTS221 and LPS25H
 #define LPS25HifAVGP 3
 #define LPS25HifODR 3
@@ -37,13 +40,41 @@
 #define DEVPATH_I2C     "/dev/i2c-1"  // the device file
 #define I2C_SLAVE       0x0703        // ioctl:  Use this slave address
 
+// channels measured by HTS221 and LPS25H
+enum sensor_channel {
+    SENSOR_PRESSURE,
+    SENSOR_TEMPERATURE,
+    SENSOR_HUMIDITY,
+    SENSOR_CHANNELS
+};
+
+#define SENSOR_BIT(ch)  (1u << (ch))
+#define SENSOR_ALL      (SENSOR_BIT(SENSOR_CHANNELS) - 1)
+
+// struct to store one raw sample per channel, mask tells which are valid
+struct SensorSample {
+    unsigned mask;
+    __s32 raw[SENSOR_CHANNELS];
+};
+
 // struct to store sensor readings for HTS221, LPS25H
 struct SensorData {
     float pressure;
     float temperature;
     float humidity;
+
+    // standard deviation of the samples the medians were taken from
+    float pressure_sd;
+    float temperature_sd;
+    float humidity_sd;
+
+    // medians in sensor counts, rounded to the nearest count
+    __s32 raw[SENSOR_CHANNELS];
 };
 
+// size of the HTS221 calibration block, registers 0x30 to 0x3f
+#define HTS221_CAL_SIZE 16
+
 /*
  * Initialize i2c device and discover LPS25H and HTS221
  * Obtain calculated constants from sensors used in formulas
@@ -51,9 +82,54 @@ struct SensorData {
 int sensors_init (void);
 
 /*
- * Grab sensor readings and populate a SensorData struct with
- * median value calculated from LPS25H and HTS221 sensors
+ * Read one sample of the channels in mask using as few bus transactions as
+ * possible. Channels that had new data are set in the mask of the sample.
+ */
+int sensors_sample (unsigned, struct SensorSample *);
+
+/*
+ * Same as sensors_sample, with a deadline (CLOCK_MONOTONIC) the bus
+ * scheduler orders the read by among other sampling on the bus
+ */
+int sensors_sample_by (unsigned, struct SensorSample *, int64_t);
+
+/*
+ * Convert a raw sample (or median of raw samples) of a channel to hPa, °C or
+ * %rH using the calibration read in sensors_init
+ */
+float sensors_convert (enum sensor_channel, float);
+
+/*
+ * Override the conversion of a channel with value = (raw + offset) * scale,
+ * used by backends that do not read the calibration through sensors_init
+ */
+void sensors_set_conversion (enum sensor_channel, float, float);
+
+/*
+ * Copy the HTS221 calibration block read in sensors_init to cal, which holds
+ * HTS221_CAL_SIZE bytes. Returns -1 if it was not read or another backend
+ * has overridden the conversion, then raw counts cannot be converted with it.
+ */
+int sensors_calibration (__u8 *);
+
+/*
+ * Calculate median value and standard deviation of n raw samples of a
+ * channel. The samples array is sorted in place. The median in sensor counts
+ * is stored in raw unless it is NULL.
+ */
+int sensors_aggregate (enum sensor_channel, __s32 *, int, __s32 *, float *,
+                       float *);
+
+/*
+ * Power down the sensors none of the channels in mask are measured by and
+ * power up the others. A sensor that is powered down has no new data.
+ */
+int sensors_set_power (unsigned);
+
+/*
+ * Change the on-chip averaging modes of LPS25H (AVGP) and HTS221 (AVGT, AVGH)
+ * See sensors_init for the averaging number each mode corresponds to
  */
-int sensors_grab (struct SensorData *, int, int);
+int sensors_set_averaging (int, int, int);
 
 #endif
@@ -0,0 +1,121 @@
+/*
+ *  shmpub.c
+ *    Latest readings published in POSIX shared memory behind a seqlock so
+ *    co-located processes can read them without syscalls or IPC
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <sys/stat.h>
+
+#include "shmpub.h"
+#include "common.h"
+#include "log.h"
+
+int
+shmpub_open (struct shmpub *pub)
+{
+    int fd;
+
+    pub->seg = NULL;
+
+    fd = shm_open (SHMPUB_NAME, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      {
+        log_error ("shm_open failed");
+        return -1;
+      }
+
+    if (ftruncate (fd, sizeof (struct shmpub_segment)) < 0)
+      {
+        log_error ("ftruncate of shared memory failed");
+        close (fd);
+        return -1;
+      }
+
+    pub->seg = mmap (NULL, sizeof (struct shmpub_segment),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (pub->seg == MAP_FAILED)
+      {
+        log_error ("mmap of shared memory failed");
+        pub->seg = NULL;
+        return -1;
+      }
+
+    /* A reader of the previous run may still be inside the segment, clear
+       it like any other write, seq odd meanwhile and never back to a value
+       a reader saw before. A run that died mid-write left seq odd. */
+    if (!(atomic_load (&pub->seg->seq) & 1))
+        atomic_fetch_add_explicit (&pub->seg->seq, 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    memset (pub->seg->ch, 0, sizeof (pub->seg->ch));
+    pub->seg->mask = 0;
+    atomic_fetch_add_explicit (&pub->seg->seq, 1, memory_order_release);
+
+    /* Readers check magic and version, write them last */
+    pub->seg->version = SHMPUB_VERSION;
+    atomic_thread_fence (memory_order_release);
+    pub->seg->magic = SHMPUB_MAGIC;
+
+    return 0;
+}
+
+void
+shmpub_begin (struct shmpub *pub)
+{
+    if (!pub->seg)
+        return;
+
+    atomic_fetch_add_explicit (&pub->seg->seq, 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+}
+
+void
+shmpub_update (struct shmpub *pub, enum shmpub_channel_id id, float value,
+               float sd, int64_t timestamp)
+{
+    if (!pub->seg)
+        return;
+
+    pub->seg->ch[id].value = value;
+    pub->seg->ch[id].sd = sd;
+    pub->seg->ch[id].timestamp = timestamp;
+    pub->seg->mask |= 1u << id;
+}
+
+void
+shmpub_commit (struct shmpub *pub)
+{
+    if (!pub->seg)
+        return;
+
+    atomic_fetch_add_explicit (&pub->seg->seq, 1, memory_order_release);
+}
+
+void
+shmpub_close (struct shmpub *pub)
+{
+    if (!pub->seg)
+        return;
+
+    munmap (pub->seg, sizeof (struct shmpub_segment));
+    shm_unlink (SHMPUB_NAME);
+    pub->seg = NULL;
+}
@@ -0,0 +1,137 @@
+/*
+ *  shmpub.h
+ *    Latest readings published in POSIX shared memory behind a seqlock so
+ *    co-located processes can read them without syscalls or IPC
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SHMPUB_H_
+#define _SHMPUB_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * This header is self-contained so that readers such as the camera and
+ * recorder processes can include it on its own. They map the segment once
+ * with shmpub_attach and then call shmpub_read as often as they like.
+ */
+
+#define SHMPUB_NAME    "/fagelmatare-slave"
+#define SHMPUB_MAGIC   0x46475348   /* "FGSH" */
+#define SHMPUB_VERSION 1
+
+enum shmpub_channel_id {
+    SHMPUB_PRESSURE,        /* hPa */
+    SHMPUB_TEMPERATURE,     /* °C, inside the feeder */
+    SHMPUB_HUMIDITY,        /* %rH */
+    SHMPUB_OUTTEMP,         /* °C, outdoor temperature from the AVR */
+    SHMPUB_CHANNELS
+};
+
+struct shmpub_channel {
+    float   value;
+    float   sd;             /* spread of the samples behind value */
+    int64_t timestamp;      /* CLOCK_REALTIME, nanoseconds */
+};
+
+/*
+ * seq is odd while the slave is writing. A reader copies the data between
+ * two loads of seq and retries if seq changed or was odd.
+ */
+struct shmpub_segment {
+    uint32_t              magic;
+    uint32_t              version;
+    _Atomic uint32_t      seq;
+    uint32_t              mask;     /* bit per channel that has a value */
+    struct shmpub_channel ch[SHMPUB_CHANNELS];
+};
+
+/* Consistent copy of the segment */
+struct shmpub_snapshot {
+    uint32_t              mask;
+    struct shmpub_channel ch[SHMPUB_CHANNELS];
+};
+
+/* Writer side, used by the slave */
+struct shmpub {
+    struct shmpub_segment *seg;
+};
+
+extern int shmpub_open (struct shmpub *);
+
+extern void shmpub_update (struct shmpub *, enum shmpub_channel_id, float,
+                           float, int64_t);
+
+/* Publish updates since the previous commit to readers */
+extern void shmpub_begin (struct shmpub *);
+extern void shmpub_commit (struct shmpub *);
+
+extern void shmpub_close (struct shmpub *);
+
+/* Map the segment read-only, returns NULL if the slave has not created it */
+static inline const struct shmpub_segment *
+shmpub_attach (void)
+{
+    const struct shmpub_segment *seg;
+    int fd;
+
+    fd = shm_open (SHMPUB_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    seg = mmap (NULL, sizeof (*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (seg == MAP_FAILED)
+        return NULL;
+
+    if (seg->magic != SHMPUB_MAGIC || seg->version != SHMPUB_VERSION)
+      {
+        munmap ((void *) seg, sizeof (*seg));
+        return NULL;
+      }
+
+    return seg;
+}
+
+/* Take a consistent snapshot, a couple of loads when nothing is written */
+static inline void
+shmpub_read (const struct shmpub_segment *seg, struct shmpub_snapshot *snap)
+{
+    struct shmpub_segment *s = (struct shmpub_segment *) seg;
+    uint32_t seq0, seq1;
+
+    do
+      {
+        seq0 = atomic_load_explicit (&s->seq, memory_order_acquire);
+        snap->mask = s->mask;
+        memcpy (snap->ch, s->ch, sizeof (snap->ch));
+        atomic_thread_fence (memory_order_acquire);
+        seq1 = atomic_load_explicit (&s->seq, memory_order_relaxed);
+      }
+    while ((seq0 & 1) || seq0 != seq1);
+}
+
+#endif /* _SHMPUB_H_ */
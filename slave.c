@@ -23,12 +23,8 @@
  *****************************************************************************
  */
 #include <signal.h>
-#include <semaphore.h>
 #include <stdatomic.h>
 #include <pthread.h>
-#include <poll.h>
-#include <sys/timerfd.h>
-#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -37,6 +33,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <getopt.h>
+#include <math.h>
 
 #include <events.h>
 #include <fgevents.h>
@@ -48,87 +46,398 @@
 #include <event2/thread.h>
 
 #include "sensors.h"
+#include "i2cbus.h"
+#include "emubus.h"
+#include "replay.h"
+#include "soak.h"
+#include "vclock.h"
+#include "slave.h"
 #include "common.h"
 #include "log.h"
 
 /* Forward declarations used in this file. */
-static void exit_cb (evutil_socket_t, short, void *);
-static void timer_cb (evutil_socket_t, short, void *);
+static void exit_cb (uint64_t, void *);
+static void timer_cb (uint64_t, void *);
 
-static int start_timer_event (struct event_base *, struct thread_data *);
+static int start_timer_event (struct thread_data *);
+
+static int start_startup (struct thread_data *);
+
+static void apply_sampling (struct thread_data *, unsigned);
+static void start_uring (struct thread_data *);
+static void stop_uring (struct thread_data *);
+static void init_subscriptions (struct thread_data *);
+static void subscriptions_cb (void *);
+
+static void send_report (struct thread_data *, const struct SensorData *,
+                         unsigned, bool, int32_t);
+static void build_sensor_data (struct fgevent *, int32_t *,
+                               const struct SensorData *, unsigned, bool,
+                               int32_t);
+static int send_sensor_data (struct fg_events_data *,
+                             const struct SensorData *, unsigned, bool,
+                             int32_t);
+static int send_calibration (struct thread_data *);
+static void reference_lost (void *);
+static bool build_packed_data (struct thread_data *, struct fgevent *,
+                               int32_t *, const struct SensorData *,
+                               unsigned, bool, int32_t);
+static void build_raw_data (struct fgevent *, int32_t *,
+                            const struct SensorData *, unsigned, bool,
+                            int32_t);
+
+static void command_cb (uint64_t, void *);
+static void burst_end_cb (uint64_t, void *);
+
+static void publish_shm (struct thread_data *, const struct SensorData *,
+                         unsigned);
 
 static int32_t query_temp (struct thread_data *);
 
+static void perch_landing_cb (const struct perch_landing *, void *);
+
 static int fg_handle_event (void *, struct fgevent *, struct fgevent *);
 
+static int run_soak (struct thread_data *);
+
 /* flag set if sensors initialized */
 static int is_sensors_enabled;
 
-static struct event *exev;
+static struct slave_options opts;
+
+/* Where the master is, the stand-in when running in virtual time */
+static char *master_ip = MASTER_IP;
+static int master_port = MASTER_PORT;
+
+static void print_virtual (struct thread_data *, int64_t, int64_t);
 
-/* Signal handler for SIGINT, SIGHUP and SIGTERM */
 static void
-handle_sig (int signum)
+usage (void)
 {
-    struct sigaction new_action;
+    fprintf (stderr, "Usage: %s [OPTION]...\n"
+             "  -r, --realtime[=PRIO]    sample in a SCHED_FIFO thread "
+             "(default priority %d)\n"
+             "  -c, --cpu=CPU            pin the real-time thread to CPU\n"
+             "      --bench-jitter=N     print sample interval distribution "
+             "of N samples\n"
+             "                           with and without real-time mode\n"
+             "      --record=FILE        record all i2c transactions to FILE\n"
+             "      --replay=FILE        replay i2c trace FILE through the "
+             "acquisition code\n"
+             "      --replay-realtime    replay with the recorded timing\n"
+             "      --replay-loops=N     replay the trace N times\n"
+             "      --query-socket=PATH  serve local queries on PATH "
+             "(default %s)\n"
+             "      --iio[=ROOT]         acquire through the kernel IIO "
+             "buffers, optionally\n"
+             "                           below ROOT instead of /\n"
+             "      --iio-trigger=NAME   attach IIO trigger NAME to the "
+             "buffers\n"
+             "      --imu                detect birds landing with the "
+             "accelerometer\n"
+             "      --raw                report raw sensor counts and send the "
+             "calibration\n"
+             "                           once per connection\n"
+             "      --channels=LIST      report only the channels in LIST "
+             "(default all):\n"
+             "                           pressure, temperature, humidity, "
+             "outtemp\n"
+             "      --packed[=delta]     report only the readings present in "
+             "varints, with\n"
+             "                           delta reports in between full ones "
+             "if asked to\n"
+             "      --io-uring           run bus transactions, log and trace "
+             "writes through\n"
+             "                           io_uring where the kernel has it\n"
+             "      --outbox-depth=N     queue at most N events for the "
+             "master (default %d)\n"
+             "      --outbox-policy=P    when the queue is full drop the "
+             "oldest report,\n"
+             "                           coalesce into the newest or spill "
+             "to disk:\n"
+             "                           drop (default), coalesce or spill\n"
+             "      --outbox-spill=FILE  spill to FILE (default %s)\n"
+             "      --load-sim=N         run N emulated slaves against a "
+             "local master stand-in\n"
+             "                           and print throughput and latency\n"
+             "      --load-duration=S    run the load simulation for S "
+             "seconds (default %d)\n"
+             "      --load-period=MS     report every MS milliseconds "
+             "(default %d)\n"
+             "      --load-storm=S       drop all simulated connections "
+             "every S seconds\n"
+             "      --virtual=S          run S seconds of virtual time as "
+             "fast as possible\n"
+             "                           against emulated sensors and a "
+             "local master stand-in\n"
+             "      --soak=N             run N report cycles against "
+             "emulated sensors and a\n"
+             "                           local master stand-in, fail if "
+             "memory, descriptors\n"
+             "                           or cycle latency keep growing\n"
+             "  -h, --help               display this help and exit\n",
+             __progname, RTACQ_DEFAULT_PRIORITY, QUERY_SOCKET_PATH,
+             OUTBOX_DEFAULT_DEPTH, OUTBOX_SPILL_PATH, LOADSIM_DEFAULT_DURATION,
+             REPORT_PERIOD * 1000);
+}
 
-    if (exev != NULL)
-        event_active (exev, EV_WRITE, 0);
-    else
-        exit (0);
+/* Parse command line into opts, returns -1 on invalid usage */
+static int
+parse_options (int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "realtime",     optional_argument, NULL, 'r' },
+        { "cpu",          required_argument, NULL, 'c' },
+        { "bench-jitter", required_argument, NULL, 'J' },
+        { "record",       required_argument, NULL, 'R' },
+        { "replay",       required_argument, NULL, 'P' },
+        { "replay-realtime", no_argument,    NULL, 'T' },
+        { "replay-loops", required_argument, NULL, 'L' },
+        { "query-socket", required_argument, NULL, 'Q' },
+        { "iio",          optional_argument, NULL, 'I' },
+        { "iio-trigger",  required_argument, NULL, 'G' },
+        { "imu",          no_argument,       NULL, 'M' },
+        { "raw",          no_argument,       NULL, 'W' },
+        { "packed",       optional_argument, NULL, 'X' },
+        { "channels",     required_argument, NULL, 'N' },
+        { "io-uring",     no_argument,       NULL, 'U' },
+        { "outbox-depth", required_argument, NULL, 'O' },
+        { "outbox-policy", required_argument, NULL, 'B' },
+        { "outbox-spill", required_argument, NULL, 'F' },
+        { "load-sim",     required_argument, NULL, 'S' },
+        { "load-duration", required_argument, NULL, 'D' },
+        { "load-period",  required_argument, NULL, 'E' },
+        { "load-storm",   required_argument, NULL, 'Y' },
+        { "soak",         required_argument, NULL, 'K' },
+        { "virtual",      required_argument, NULL, 'V' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
 
-    new_action.sa_handler = handle_sig;
-    sigemptyset (&new_action.sa_mask);
-    new_action.sa_flags = SA_RESTART;
+    opts.rt.priority = RTACQ_DEFAULT_PRIORITY;
+    opts.rt.cpu = -1;
+    opts.replay_loops = 1;
+    opts.query_path = QUERY_SOCKET_PATH;
+    opts.outbox_depth = OUTBOX_DEFAULT_DEPTH;
+    opts.outbox_policy = OUTBOX_DROP_OLDEST;
+    opts.outbox_spill = OUTBOX_SPILL_PATH;
+    opts.load.duration = LOADSIM_DEFAULT_DURATION;
+    opts.load.period_ms = REPORT_PERIOD * 1000;
+    opts.channels = SUB_ALL;
 
-    sigaction (signum, &new_action, NULL);
-}
+    while ((c = getopt_long (argc, argv, "r::c:h", long_options, NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'r':
+                opts.rt.enabled = true;
+                if (optarg)
+                    opts.rt.priority = atoi (optarg);
+                if (opts.rt.priority < 1 || opts.rt.priority > 99)
+                  {
+                    fprintf (stderr, "%s: priority must be 1 to 99\n",
+                             __progname);
+                    return -1;
+                  }
+                break;
+            case 'c':
+                opts.rt.cpu = atoi (optarg);
+                break;
+            case 'J':
+                opts.bench_jitter = atoi (optarg);
+                break;
+            case 'R':
+                opts.record_path = optarg;
+                break;
+            case 'P':
+                opts.replay_path = optarg;
+                break;
+            case 'T':
+                opts.replay_realtime = true;
+                break;
+            case 'L':
+                opts.replay_loops = atoi (optarg);
+                break;
+            case 'Q':
+                opts.query_path = optarg;
+                break;
+            case 'I':
+                opts.iio_root = optarg ? optarg : "";
+                break;
+            case 'G':
+                opts.iio_trigger = optarg;
+                break;
+            case 'M':
+                opts.imu = true;
+                break;
+            case 'W':
+                opts.raw = true;
+                break;
+            case 'X':
+                opts.packed = true;
+                if (optarg && strcmp (optarg, "delta") != 0)
+                  {
+                    fprintf (stderr, "%s: unknown packed mode %s\n",
+                             __progname, optarg);
+                    return -1;
+                  }
+                opts.packed_delta = optarg != NULL;
+                break;
+            case 'N':
+                if ((c = subscribe_parse_list (optarg)) < 0)
+                  {
+                    fprintf (stderr, "%s: unknown channel in %s\n",
+                             __progname, optarg);
+                    return -1;
+                  }
+                opts.channels = c;
+                break;
+            case 'U':
+                opts.io_uring = true;
+                break;
+            case 'O':
+                opts.outbox_depth = atoi (optarg);
+                if (opts.outbox_depth < 1 ||
+                    opts.outbox_depth > OUTBOX_MAX_DEPTH)
+                  {
+                    fprintf (stderr, "%s: outbox depth must be 1 to %d\n",
+                             __progname, OUTBOX_MAX_DEPTH);
+                    return -1;
+                  }
+                break;
+            case 'B':
+                if ((c = outbox_parse_policy (optarg)) < 0)
+                  {
+                    fprintf (stderr, "%s: unknown outbox policy %s\n",
+                             __progname, optarg);
+                    return -1;
+                  }
+                opts.outbox_policy = c;
+                break;
+            case 'F':
+                opts.outbox_spill = optarg;
+                break;
+            case 'S':
+                opts.load.clients = atoi (optarg);
+                break;
+            case 'D':
+                opts.load.duration = atoi (optarg);
+                break;
+            case 'E':
+                opts.load.period_ms = atoi (optarg);
+                break;
+            case 'Y':
+                opts.load.storm = atoi (optarg);
+                break;
+            case 'K':
+                opts.soak = strtoull (optarg, NULL, 10);
+                break;
+            case 'V':
+                opts.virtual_s = strtoll (optarg, NULL, 10);
+                if (opts.virtual_s < 1)
+                  {
+                    fprintf (stderr, "%s: virtual time must be positive\n",
+                             __progname);
+                    return -1;
+                  }
+                break;
+            case 'h':
+            default:
+                usage ();
+                return -1;
+          }
+      }
 
-/* Setup termination signals to exit gracefully */
-static void
-handle_signals ()
-{
-    struct sigaction new_action, old_action;
+    if (opts.load.clients &&
+        (opts.load.duration < 1 || opts.load.period_ms < 1))
+      {
+        fprintf (stderr, "%s: load duration and period must be positive\n",
+                 __progname);
+        return -1;
+      }
 
-    /* Turn off buffering on stdout to directly write to log file */
-    setvbuf (stdout, NULL, _IONBF, 0);
+    /* Virtual time needs everything on the event loop and our own bus */
+    if (opts.virtual_s && (opts.rt.enabled || opts.iio_root || opts.imu ||
+                           opts.record_path || opts.bench_jitter))
+      {
+        fprintf (stderr, "%s: --virtual cannot be combined with --realtime, "
+                 "--iio, --imu,\n--record or --bench-jitter\n", __progname);
+        return -1;
+      }
+
+    if (opts.raw && opts.packed)
+      {
+        fprintf (stderr, "%s: --raw cannot be combined with --packed\n",
+                 __progname);
+        return -1;
+      }
+
+    /* Replay only knows about the environmental sensors */
+    if (opts.imu && opts.record_path)
+      {
+        fprintf (stderr, "%s: --imu cannot be combined with --record\n",
+                 __progname);
+        return -1;
+      }
 
-    /* Set up the structure to specify the new action. */
-    new_action.sa_handler = handle_sig;
-    sigemptyset (&new_action.sa_mask);
-    new_action.sa_flags = SA_RESTART;
-    
-    /* Handle termination signals but avoid handling signals previously set
-       to be ignored */
-    sigaction (SIGINT, NULL, &old_action);
-    if (old_action.sa_handler != SIG_IGN)
-        sigaction (SIGINT, &new_action, NULL);
-    sigaction (SIGHUP, NULL, &old_action);
-    if (old_action.sa_handler != SIG_IGN)
-        sigaction (SIGHUP, &new_action, NULL);
-    sigaction (SIGTERM, NULL, &old_action);
-    if (old_action.sa_handler != SIG_IGN)
-        sigaction (SIGTERM, &new_action, NULL);
+    return 0;
 }
 
 int
-main (void)
+main (int argc, char **argv)
 {
 	ssize_t s;    
     struct thread_data tdata;
     struct event_base *base;
+    struct sim_master *sim_master = NULL;
+    int64_t real_t0 = 0, virtual_t0 = 0;
 
     memset (&tdata, 0, sizeof (tdata));
 
-    handle_signals ();
+    if (parse_options (argc, argv) < 0)
+        return 1;
+
+    packed_init (&tdata.packed, opts.packed_delta);
+
+    if (opts.replay_path)
+        return replay_run (opts.replay_path, opts.replay_realtime,
+                           opts.replay_loops) ? 1 : 0;
+
+    if (opts.load.clients)
+        return loadsim_run (&opts.load, send_sensor_data) ? 1 : 0;
+
+    if (opts.soak)
+        return run_soak (&tdata) ? 1 : 0;
+
+    if (opts.record_path && i2c_trace_record (opts.record_path) < 0)
+        return 1;
+
+    /* Before any thread is created, they all share the clock */
+    if (opts.virtual_s)
+      {
+        real_t0 = vclock_system_ns (CLOCK_MONOTONIC);
+        vclock_start ();
+        virtual_t0 = clock_ns (CLOCK_MONOTONIC);
+        i2c_bus_emulate ();
+      }
+
+    if (opts.bench_jitter)
+      {
+        sensors_init ();
+        return rtacq_bench (&opts.rt, opts.bench_jitter, 100000000) ? 1 : 0;
+      }
+
+    tdata.startup.t0 = clock_ns (CLOCK_MONOTONIC);
+
+    /* Turn off buffering on stdout to directly write to log file */
+    setvbuf (stdout, NULL, _IONBF, 0);
 
     evthread_use_pthreads ();
 
     tdata.valid_temp = false;
 
-    s = sensors_init ();
-    if (s != 0) is_sensors_enabled = 0;
-    else is_sensors_enabled = 1;    
+    adaptive_init (&tdata.adaptive);
 
     struct event_config *config = event_config_new ();
 
@@ -141,54 +450,169 @@ main (void)
 
     event_config_free (config);
 
-    exev = event_new (base, -1, 0, exit_cb, base);
-    if (!exev || event_add (exev, NULL) < 0)
-        log_error ("could not create/add exit event");
+    /* Signals are blocked from here on, before any thread is created, and
+       arrive through the event core instead */
+    if (evcore_init (&tdata.evcore, base) < 0 ||
+        evcore_signals (&tdata.signals, &tdata.evcore, exit_cb, base) < 0)
+        return 1;
+    if (opts.virtual_s)
+        evcore_set_horizon (&tdata.evcore, virtual_t0 +
+                            opts.virtual_s * NSEC_PER_SEC);
+
+    /* The master stand-in is the first thread, it inherits the blocked
+       signals like every other */
+    if (opts.virtual_s)
+      {
+        sim_master = loadsim_master_start ();
+        if (!sim_master)
+            return 1;
+        master_ip = "127.0.0.1";
+        master_port = loadsim_master_port (sim_master);
+      }
+    if (opts.io_uring)
+        start_uring (&tdata);
+
+    if (acquire_init (&tdata.acq, &tdata.evcore) < 0)
+        return 1;
+    rollup_init (&tdata.rollup);
+    tdata.acq.rollup = &tdata.rollup;
+
+    init_subscriptions (&tdata);
+
+    /* Must be ready before the master can send us anything */
+    if (command_queue_init (&tdata.control.commands, &tdata.evcore,
+                            command_cb, &tdata) < 0 ||
+        evcore_timer_init (&tdata.control.burst_timer, &tdata.evcore,
+                           burst_end_cb, &tdata) < 0)
+        return 1;
+
+    /* Nothing is sent before the connection attempt has finished */
+    if (outbox_init (&tdata.outbox, &tdata.etdata, opts.outbox_policy,
+                     opts.outbox_depth, opts.outbox_spill) < 0)
+        return 1;
+    outbox_on_lost_reference (&tdata.outbox, reference_lost, &tdata);
+    if (opts.virtual_s)
+        outbox_hold_clock (&tdata.outbox, &tdata.evcore);
+
+    /* Readers of the segment would take virtual readings for real ones */
+    if (!opts.virtual_s)
+        shmpub_open (&tdata.shm);
+    query_init (&tdata.query, base, opts.query_path);
+    tdata.query.rollup = &tdata.rollup;
+    tdata.query.outbox = &tdata.outbox;
+    tdata.query.subs = &tdata.subs;
+    tdata.query.acq = &tdata.acq;
+    if (opts.imu)
+        imu_init (&tdata.imu, &tdata.evcore, perch_landing_cb, &tdata);
 
-    s = fg_events_client_init_inet (&tdata.etdata, &fg_handle_event, NULL,
-                                &tdata, MASTER_IP, MASTER_PORT, FG_SLAVE);
+    /* Sensors are brought up and the master is connected to in the
+       background while the event loop already serves local clients */
+    s = start_startup (&tdata);
     if (s != 0)
       {
-        log_error_en (s, "error initializing fgevents");
+        log_error ("error in start_startup");
+        return 1;
       }
 
-    s = start_timer_event (base, &tdata);
+    s = start_timer_event (&tdata);
     if (s != 0)
       {
         log_error ("error in start_timer_event");
         return 1;
       }
 
+    if (opts.virtual_s)
+        print_virtual (&tdata, clock_ns (CLOCK_MONOTONIC) - virtual_t0,
+                       vclock_system_ns (CLOCK_MONOTONIC) - real_t0);
+
     /* **************************************************************** */
     /*                                                                  */
     /*                      Begin shutdown sequence                     */
     /*                                                                  */
     /* **************************************************************** */
 
+    rtacq_stop (&tdata.rt);
+    query_free (&tdata.query);
+    if (opts.imu)
+        imu_free (&tdata.imu);
+
+    /* Wait for startup threads that have not reported back yet */
+    if (!tdata.startup.sensors_done)
+        pthread_join (tdata.startup.sensors_thread, NULL);
+    if (!tdata.startup.master_done)
+        pthread_join (tdata.startup.master_thread, NULL);
+    iio_close (&tdata.iio);
+
+    /* A send stuck on a slow master fails once the connection is down */
     fg_events_client_shutdown (&tdata.etdata);
+    outbox_free (&tdata.outbox);
+    if (opts.io_uring)
+        stop_uring (&tdata);
+    command_queue_free (&tdata.control.commands);
+    evcore_source_free (&tdata.control.burst_timer);
+    evcore_source_free (&tdata.startup.sensors_wake);
+    evcore_source_free (&tdata.startup.master_wake);
+    evcore_source_free (&tdata.startup.sample_timer);
+    evcore_source_free (&tdata.signals);
+    evcore_free (&tdata.evcore);
+
+    shmpub_close (&tdata.shm);
+    i2c_trace_close ();
+
+    if (sim_master)
+        _log_debug ("master stand-in received %" PRIu64 " bytes\n",
+                    loadsim_master_stop (sim_master));
 
     return 0;
 }
 
+/* Summary of a run in virtual time, the wall time it took is pure compute */
 static void
-exit_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+print_virtual (struct thread_data *tdata, int64_t virtual_ns, int64_t real_ns)
+{
+    const struct schedule_stats *st = &tdata->schedule.stats;
+    struct outbox_stats ob;
+    struct evcore_stats *ev = &tdata->evcore.total;
+
+    outbox_get_stats (&tdata->outbox, &ob);
+    printf ("%.1f s of virtual time in %.3f s (%.0fx)\n",
+            (double) virtual_ns / NSEC_PER_SEC, (double) real_ns / NSEC_PER_SEC,
+            real_ns ? (double) virtual_ns / real_ns : 0.0);
+    printf ("reports: %" PRIu64 ", %" PRIu64 " missed, %.1f us compute each\n",
+            st->reports, st->missed,
+            st->reports ? (double) real_ns / st->reports / 1000.0 : 0.0);
+    printf ("samples: %" PRIu64 " bus transactions, %" PRIu64 " errors\n",
+            tdata->acq.transactions, tdata->acq.errors);
+    printf ("wakeups: %" PRIu64 " (%" PRIu64 " timer, %" PRIu64 " wakeup)\n",
+            ev->loops, ev->dispatched[EVCORE_TIMER],
+            ev->dispatched[EVCORE_WAKEUP]);
+    printf ("outbox: %" PRIu64 " queued, %" PRIu64 " sent, %" PRIu64
+            " dropped, %" PRIu64 " coalesced\n", ob.queued, ob.sent,
+            ob.dropped, ob.coalesced);
+}
+
+static void
+exit_cb (uint64_t signo, void *arg)
 {
     struct event_base *base = arg;
 
+    _log_debug ("received signal %d, exiting\n", (int) signo);
     event_base_loopexit (base, NULL);
 }
 
 static void
-timer_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void *arg)
+timer_cb (uint64_t UNUSED(n), void *arg)
 {
     struct SensorData sensor_data;
     struct thread_data *tdata = arg;
-    struct fgevent fgev;
     int sensors_avail;
 
-    if (!is_sensors_enabled && sensors_init ())
+    /* retry bring-up of sensors that failed at startup */
+    if (!is_sensors_enabled && tdata->startup.sensors_done &&
+        !opts.iio_root && sensors_init () == 0)
       {
         is_sensors_enabled = 1;
+        apply_sampling (tdata, SENSOR_ALL);
       }
 
     sensors_avail = 0;
@@ -196,44 +620,279 @@ timer_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void *arg)
       {
         memset (&sensor_data, 0, sizeof (struct SensorData));
 
-        // grab 8 samples with 100000 µs inbetween
-        if (sensors_grab (&sensor_data, 8, 100000))
+        /* each channel is sampled on its own cadence by the acquisition
+           scheduler, collect what it gathered since the last report */
+        sensors_avail = acquire_publish (&tdata->acq, &sensor_data);
+        if (sensors_avail)
           {
-            log_error ("failed to grab sensor data");
+            apply_sampling (tdata, adaptive_update (&tdata->adaptive,
+                                                    &sensor_data,
+                                                    sensors_avail));
           }
-        else
+        else if (tdata->subs.mask & SENSOR_ALL)
           {
-            sensors_avail = 1;
+            log_error ("no sensor data since last report");
           }
       }
 
-    fgev.id = FG_SENSOR_DATA;
-    fgev.receiver = FG_MASTER;
-    fgev.writeback = 0;
-    fgev.length = 8;
-    fgev.payload = malloc (sizeof (int32_t) * fgev.length);
+    publish_shm (tdata, &sensor_data, sensors_avail);
+    query_cache_report (&tdata->query, &sensor_data, sensors_avail,
+                        tdata->valid_temp &&
+                        tdata->c_invalidate_temp < MAX_TEMP_AGE,
+                        tdata->fetched_temp / 10.0f);
+
+    /* nothing to send to before the connection attempt has finished */
+    if (!tdata->startup.master_done)
+        return;
+
+    /* nobody to ask the AVR for, the last answer expires by itself */
+    int32_t tempx10 = tdata->subs.mask & SENSOR_BIT(SUB_OUTTEMP) ?
+                      query_temp (tdata) : tdata->fetched_temp;
+
+    send_report (tdata, &sensor_data, sensors_avail,
+                 tdata->valid_temp &&
+                 ++tdata->c_invalidate_temp < MAX_TEMP_AGE, tempx10);
+}
 
-    memset (fgev.payload, 0, sizeof (int32_t) * fgev.length);
+/* Send a report in sensor counts with --raw, packed with --packed and
+   converted otherwise */
+static void
+send_report (struct thread_data *tdata, const struct SensorData *data,
+             unsigned mask, bool valid_outtemp, int32_t tempx10)
+{
+    struct fgevent fgev;
+    int32_t payload[FG_SENSOR_LENGTH];  /* the longest of the formats */
+    bool reference = false;
+    unsigned wanted = subscribe_mask (&tdata->subs, tdata->master_sub);
+
+    /* Local subscribers may keep channels going the master has no use for */
+    if (!wanted)
+        return;
+    mask &= wanted;
+    valid_outtemp = valid_outtemp && (wanted & SENSOR_BIT(SUB_OUTTEMP));
+
+    if (opts.raw && send_calibration (tdata) == 0)
+        build_raw_data (&fgev, payload, data, mask, valid_outtemp, tempx10);
+    else if (opts.packed)
+        reference = build_packed_data (tdata, &fgev, payload, data, mask,
+                                       valid_outtemp, tempx10);
+    else
+        build_sensor_data (&fgev, payload, data, mask, valid_outtemp,
+                           tempx10);
 
-    int32_t tempx10 = query_temp (tdata);
+    /* A newer report supersedes this one if the master falls behind, but
+       not a reference later delta reports depend on */
+    outbox_push (&tdata->outbox, &fgev,
+                 OUTBOX_REPORT | (reference ? OUTBOX_REFERENCE : 0));
+}
+
+/* Readings go to the master in tenths of their unit */
+static int32_t
+tenths (float value)
+{
+    return (int32_t) lroundf (value * 10.0f);
+}
 
-    if (tdata->valid_temp && ++tdata->c_invalidate_temp < MAX_TEMP_AGE)
+/* Send the readings of the channels in mask to the master right away */
+static int
+send_sensor_data (struct fg_events_data *etdata,
+                  const struct SensorData *sensor_data, unsigned sensors_avail,
+                  bool valid_outtemp, int32_t tempx10)
+{
+    struct fgevent fgev;
+    int32_t payload[FG_SENSOR_LENGTH];
+
+    build_sensor_data (&fgev, payload, sensor_data, sensors_avail,
+                       valid_outtemp, tempx10);
+    return fg_send_event (etdata, &fgev);
+}
+
+/* Report of the readings of the channels in mask, payload holds
+   FG_SENSOR_LENGTH words */
+static void
+build_sensor_data (struct fgevent *fgev, int32_t *payload,
+                   const struct SensorData *sensor_data,
+                   unsigned sensors_avail, bool valid_outtemp, int32_t tempx10)
+{
+    fgev->id = FG_SENSOR_DATA;
+    fgev->receiver = FG_MASTER;
+    fgev->writeback = 0;
+    fgev->length = FG_SENSOR_LENGTH;
+    fgev->payload = payload;
+
+    memset (fgev->payload, 0, sizeof (int32_t) * fgev->length);
+
+    if (valid_outtemp)
       {
-        fgev.payload[0] = OUTTEMP;
-        fgev.payload[1] = tempx10;
+        fgev->payload[0] = OUTTEMP;
+        fgev->payload[1] = tempx10;
       }    
 
-    if (sensors_avail)
+    if (sensors_avail & SENSOR_BIT(SENSOR_TEMPERATURE))
+      {
+        fgev->payload[2] = INTEMP;
+        fgev->payload[3] = tenths (sensor_data->temperature);
+      }
+    if (sensors_avail & SENSOR_BIT(SENSOR_PRESSURE))
+      {
+        fgev->payload[4] = PRESSURE;
+        fgev->payload[5] = tenths (sensor_data->pressure);
+      }
+    if (sensors_avail & SENSOR_BIT(SENSOR_HUMIDITY))
+      {
+        fgev->payload[6] = HUMIDITY;
+        fgev->payload[7] = tenths (sensor_data->humidity);
+      }
+}
+
+/* The master may miss the reference the next delta report would need */
+static void
+reference_lost (void *arg)
+{
+    struct thread_data *tdata = arg;
+
+    packed_reset (&tdata->packed);
+}
+
+/* Report of the readings of the channels in mask as FG_SENSOR_PACKED,
+   payload holds PACKED_MAX_WORDS. Returns true for a reference report. */
+static bool
+build_packed_data (struct thread_data *tdata, struct fgevent *fgev,
+                   int32_t *payload, const struct SensorData *sensor_data,
+                   unsigned sensors_avail, bool valid_outtemp, int32_t tempx10)
+{
+    int32_t value[PACKED_VALUES];
+    bool reference;
+
+    value[SENSOR_PRESSURE] = tenths (sensor_data->pressure);
+    value[SENSOR_TEMPERATURE] = tenths (sensor_data->temperature);
+    value[SENSOR_HUMIDITY] = tenths (sensor_data->humidity);
+    value[SENSOR_CHANNELS] = tempx10;
+
+    fgev->id = FG_SENSOR_PACKED;
+    fgev->receiver = FG_MASTER;
+    fgev->writeback = 0;
+    fgev->length = packed_encode (&tdata->packed,
+                                  (sensors_avail & SENSOR_ALL) |
+                                  (valid_outtemp ? PACKED_OUTTEMP : 0),
+                                  value, payload, &reference);
+    fgev->payload = payload;
+    return reference;
+}
+
+/* Hand the master the HTS221 calibration unless it already has it for this
+   connection. Returns -1 if raw counts cannot be sent. */
+static int
+send_calibration (struct thread_data *tdata)
+{
+    struct fgevent fgev;
+    int32_t payload[HTS221_CAL_SIZE / 4];
+    __u8 cal[HTS221_CAL_SIZE];
+    int ii;
+
+    if (atomic_load (&tdata->calibration_sent))
+        return 0;
+
+    if (sensors_calibration (cal) < 0)
       {
-        fgev.payload[2] = INTEMP;
-        fgev.payload[3] = (int32_t) sensor_data.temperature * 10.0;
-        fgev.payload[4] = PRESSURE;
-        fgev.payload[5] = (int32_t) sensor_data.pressure * 10.0;
-        fgev.payload[6] = HUMIDITY;
-        fgev.payload[7] = (int32_t) sensor_data.humidity * 10.0;        
+        _log_debug ("no HTS221 calibration, sending converted readings\n");
+        return -1;
       }
 
-    fg_send_event (&tdata->etdata, &fgev);
+    for (ii = 0; ii < HTS221_CAL_SIZE / 4; ii++)
+        payload[ii] = (int32_t) ((uint32_t) cal[ii * 4] |
+                                 (uint32_t) cal[ii * 4 + 1] << 8 |
+                                 (uint32_t) cal[ii * 4 + 2] << 16 |
+                                 (uint32_t) cal[ii * 4 + 3] << 24);
+
+    fgev.id = FG_SENSOR_CALIBRATION;
+    fgev.receiver = FG_MASTER;
+    fgev.writeback = 0;
+    fgev.length = HTS221_CAL_SIZE / 4;
+    fgev.payload = payload;
+    if (outbox_push (&tdata->outbox, &fgev, OUTBOX_EVENT) < 0)
+        return -1;
+
+    atomic_store (&tdata->calibration_sent, true);
+    return 0;
+}
+
+/* Report of the medians of the channels in mask in sensor counts, payload
+   holds FG_RAW_LENGTH words */
+static void
+build_raw_data (struct fgevent *fgev, int32_t *payload,
+                const struct SensorData *sensor_data, unsigned sensors_avail,
+                bool valid_outtemp, int32_t tempx10)
+{
+    __u16 t, h;
+
+    t = (__u16) sensor_data->raw[SENSOR_TEMPERATURE];
+    h = (__u16) sensor_data->raw[SENSOR_HUMIDITY];
+
+    payload[0] = sensors_avail & SENSOR_ALL;
+    payload[1] = 0;
+    if (valid_outtemp)
+      {
+        payload[0] |= FG_RAW_OUTTEMP;
+        payload[1] = tempx10;
+      }
+    payload[2] = sensor_data->raw[SENSOR_PRESSURE];
+    payload[3] = (int32_t) ((uint32_t) t << 16 | h);
+
+    fgev->id = FG_SENSOR_RAW;
+    fgev->receiver = FG_MASTER;
+    fgev->writeback = 0;
+    fgev->length = FG_RAW_LENGTH;
+    fgev->payload = payload;
+}
+
+/* Tell the master as soon as a bird has landed */
+static void
+perch_landing_cb (const struct perch_landing *landing, void *arg)
+{
+    struct thread_data *tdata = arg;
+    struct fgevent fgev;
+    int32_t payload[3];
+
+    _log_debug ("landing: peak %u mg, %u ms, energy %u mg*s\n",
+                landing->peak_mg, landing->duration_ms, landing->energy);
+
+    if (!tdata->startup.master_done)
+        return;
+
+    payload[0] = landing->peak_mg;
+    payload[1] = landing->duration_ms;
+    payload[2] = landing->energy;
+
+    fgev.id = FG_PERCH_LANDING;
+    fgev.receiver = FG_MASTER;
+    fgev.writeback = 0;
+    fgev.length = 3;
+    fgev.payload = payload;
+    outbox_push (&tdata->outbox, &fgev, OUTBOX_EVENT);
+}
+
+/* Make the latest readings available to local processes */
+static void
+publish_shm (struct thread_data *tdata, const struct SensorData *data,
+             unsigned mask)
+{
+    int64_t now = clock_ns (CLOCK_REALTIME);
+
+    shmpub_begin (&tdata->shm);
+    if (mask & SENSOR_BIT(SENSOR_PRESSURE))
+        shmpub_update (&tdata->shm, SHMPUB_PRESSURE, data->pressure,
+                       data->pressure_sd, now);
+    if (mask & SENSOR_BIT(SENSOR_TEMPERATURE))
+        shmpub_update (&tdata->shm, SHMPUB_TEMPERATURE, data->temperature,
+                       data->temperature_sd, now);
+    if (mask & SENSOR_BIT(SENSOR_HUMIDITY))
+        shmpub_update (&tdata->shm, SHMPUB_HUMIDITY, data->humidity,
+                       data->humidity_sd, now);
+    if (tdata->valid_temp && tdata->c_invalidate_temp < MAX_TEMP_AGE)
+        shmpub_update (&tdata->shm, SHMPUB_OUTTEMP,
+                       tdata->fetched_temp / 10.0f, 0.0f, now);
+    shmpub_commit (&tdata->shm);
 }
 
 static int32_t
@@ -244,21 +903,496 @@ query_temp (struct thread_data *tdata)
     fgev.receiver = FG_AVR;
     fgev.writeback = 1;
     fgev.length = 0;
-    fg_send_event (&tdata->etdata, &fgev);
+    fgev.payload = NULL;
+    outbox_push (&tdata->outbox, &fgev, OUTBOX_REPORT);
     return tdata->fetched_temp;
 }
 
+/* Apply cadence and on-chip averaging of the channels in mask */
+static void
+apply_sampling (struct thread_data *tdata, unsigned mask)
+{
+    const struct adaptive_params *params;
+    int64_t period, wanted;
+    int ch;
+
+    /* The kernel paces IIO buffers, cadence and averaging are fixed */
+    if (!mask || tdata->iio.active)
+        return;
+
+    for (ch = 0; ch < SENSOR_CHANNELS; ch++)
+      {
+        if (!(mask & SENSOR_BIT(ch)))
+            continue;
+
+        /* Nobody would see the samples */
+        wanted = tdata->subs.period[ch];
+        if (!wanted)
+          {
+            _log_debug ("channel %d: no subscribers, not sampled\n", ch);
+            acquire_set_period (&tdata->acq, ch, 0);
+            continue;
+          }
+
+        /* A burst or a window set by the master overrides the level, the
+           subscriber asking for the fastest rate overrides both */
+        params = adaptive_params (&tdata->adaptive, ch);
+        period = params->period_ms * NSEC_PER_MSEC;
+        if (tdata->control.burst_period)
+            period = tdata->control.burst_period;
+        else if (tdata->control.window_period[ch])
+            period = tdata->control.window_period[ch];
+        if (period > wanted)
+            period = wanted;
+
+        _log_debug ("channel %d: level %d, sampled every %" PRId64 " ms\n",
+                    ch, tdata->adaptive.ch[ch].level, period / NSEC_PER_MSEC);
+        acquire_set_period (&tdata->acq, ch, period);
+      }
+
+    if (is_sensors_enabled && sensors_set_power (tdata->subs.mask) < 0)
+        log_error ("failed to power sensors up or down");
+
+    if (is_sensors_enabled &&
+        sensors_set_averaging (
+                adaptive_params (&tdata->adaptive, SENSOR_PRESSURE)->avg,
+                adaptive_params (&tdata->adaptive, SENSOR_TEMPERATURE)->avg,
+                adaptive_params (&tdata->adaptive, SENSOR_HUMIDITY)->avg))
+        log_error ("failed to set on-chip averaging");
+}
+
+/* Take a reading of every channel and send it right away. Channels without
+   a new conversion since the last read report their latest sample. */
+static void
+read_now (struct thread_data *tdata)
+{
+    struct SensorSample sample;
+    struct SensorData data;
+
+    if (!is_sensors_enabled || tdata->iio.active ||
+        !tdata->startup.master_done)
+      {
+        _log_debug ("read-now: no sensors or master\n");
+        return;
+      }
+
+    if (acquire_read_now (&tdata->acq,
+                          subscribe_mask (&tdata->subs, tdata->master_sub) &
+                          SENSOR_ALL, &sample) < 0)
+      {
+        log_error ("read-now: sample failed");
+        return;
+      }
+
+    memset (&data, 0, sizeof (data));
+    data.pressure = sensors_convert (SENSOR_PRESSURE,
+                                     sample.raw[SENSOR_PRESSURE]);
+    data.temperature = sensors_convert (SENSOR_TEMPERATURE,
+                                        sample.raw[SENSOR_TEMPERATURE]);
+    data.humidity = sensors_convert (SENSOR_HUMIDITY,
+                                     sample.raw[SENSOR_HUMIDITY]);
+    memcpy (data.raw, sample.raw, sizeof (data.raw));
+
+    send_report (tdata, &data, sample.mask, false, 0);
+}
+
+static void
+burst_end_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct thread_data *tdata = arg;
+
+    _log_debug ("burst ended\n");
+    tdata->control.burst_period = 0;
+    apply_sampling (tdata, SENSOR_ALL);
+}
+
+static void
+start_burst (struct thread_data *tdata, const struct slave_command *cmd)
+{
+    struct master_control *ctl = &tdata->control;
+    int32_t seconds, period_ms;
+
+    seconds = cmd->n > 0 ? cmd->args[0] : 0;
+    if (seconds <= 0)
+      {
+        evcore_timer_set (&ctl->burst_timer, 0, 0);
+        burst_end_cb (0, tdata);
+        return;
+      }
+    if (seconds > COMMAND_MAX_BURST_S)
+        seconds = COMMAND_MAX_BURST_S;
+
+    period_ms = cmd->n > 1 ? cmd->args[1] : 0;
+    if (period_ms < COMMAND_MIN_PERIOD_MS)
+        period_ms = COMMAND_MIN_PERIOD_MS;
+
+    _log_debug ("burst: every %d ms for %d s\n", period_ms, seconds);
+    ctl->burst_period = period_ms * NSEC_PER_MSEC;
+    evcore_timer_set (&ctl->burst_timer, clock_ns (CLOCK_MONOTONIC) +
+                      seconds * NSEC_PER_SEC, 0);
+    apply_sampling (tdata, SENSOR_ALL);
+}
+
+static void
+set_window (struct thread_data *tdata, const struct slave_command *cmd)
+{
+    int32_t ch, period_ms;
+    int ii;
+
+    for (ii = 0; ii + 1 < cmd->n; ii += 2)
+      {
+        ch = cmd->args[ii];
+        period_ms = cmd->args[ii + 1];
+        if (ch < 0 || ch >= SENSOR_CHANNELS)
+            continue;
+
+        if (period_ms > 0 && period_ms < COMMAND_MIN_PERIOD_MS)
+            period_ms = COMMAND_MIN_PERIOD_MS;
+        tdata->control.window_period[ch] = period_ms > 0 ?
+                                           period_ms * NSEC_PER_MSEC : 0;
+      }
+
+    apply_sampling (tdata, SENSOR_ALL);
+}
+
+static void
+set_subscription (struct thread_data *tdata, const struct slave_command *cmd)
+{
+    int32_t ch, period_ms;
+    int ii;
+
+    for (ii = 0; ii + 1 < cmd->n; ii += 2)
+      {
+        ch = cmd->args[ii];
+        period_ms = cmd->args[ii + 1];
+        if (ch < 0 || ch >= SUB_CHANNELS)
+            continue;
+
+        if (period_ms > 0 && period_ms < COMMAND_MIN_PERIOD_MS)
+            period_ms = COMMAND_MIN_PERIOD_MS;
+        subscribe_set (&tdata->subs, tdata->master_sub, ch,
+                       period_ms < 0 ? 0 : period_ms > 0 ?
+                       period_ms * NSEC_PER_MSEC : SUB_ANY_RATE);
+      }
+}
+
+/* Send the master the latest rollup buckets it asked for, a few to an
+   event so that each fits in the outbox */
+static void
+send_history (struct thread_data *tdata, const struct slave_command *cmd)
+{
+    struct rollup_bucket buckets[COMMAND_MAX_HISTORY];
+    int32_t payload[4 + 4 * HISTORY_PER_EVENT];
+    struct fgevent fgev;
+    int32_t *p;
+    int ii, jj, n;
+
+    if (cmd->n < 3 || cmd->args[0] < 0 || cmd->args[0] >= SENSOR_CHANNELS ||
+        cmd->args[1] < 0 || cmd->args[1] >= ROLLUP_TIERS || cmd->args[2] < 1)
+      {
+        _log_debug ("invalid history request\n");
+        return;
+      }
+
+    n = rollup_history (&tdata->rollup, cmd->args[0], cmd->args[1], buckets,
+                        cmd->args[2] < COMMAND_MAX_HISTORY ?
+                        cmd->args[2] : COMMAND_MAX_HISTORY);
+
+    fgev.id = FG_SENSOR_HISTORY;
+    fgev.receiver = FG_MASTER;
+    fgev.writeback = 0;
+    fgev.payload = payload;
+    ii = 0;
+    /* Even no buckets at all get an answer */
+    do
+      {
+        payload[0] = cmd->args[0];
+        payload[1] = cmd->args[1];
+        payload[2] = n - ii < HISTORY_PER_EVENT ? n - ii : HISTORY_PER_EVENT;
+        payload[3] = n - ii - payload[2];
+        p = payload + 4;
+        for (jj = 0; jj < payload[2]; jj++, ii++)
+          {
+            *p++ = (int32_t) buckets[ii].start;
+            *p++ = tenths (buckets[ii].min);
+            *p++ = tenths ((float) (buckets[ii].sum / buckets[ii].count));
+            *p++ = tenths (buckets[ii].max);
+          }
+        fgev.length = p - payload;
+        if (outbox_push (&tdata->outbox, &fgev, OUTBOX_EVENT) < 0)
+            log_error ("could not queue history for the master");
+      }
+    while (ii < n);
+}
+
+/* Bus transactions, log and trace writes go through io_uring where the
+   kernel has it and stay blocking calls otherwise */
+static void
+start_uring (struct thread_data *tdata)
+{
+    if (uring_init (&tdata->bus_ring, URING_BUS_ENTRIES) < 0)
+      {
+        log_error ("io_uring not available, using blocking i/o");
+        return;
+      }
+    if (uring_init (&tdata->loop_ring, URING_LOOP_ENTRIES) < 0 ||
+        uring_attach (&tdata->loop_ring, &tdata->evcore) < 0)
+      {
+        log_error ("could not attach io_uring to the event loop");
+        uring_free (&tdata->loop_ring);
+        uring_free (&tdata->bus_ring);
+        return;
+      }
+
+    i2c_bus_use_uring (&tdata->bus_ring);
+    i2c_trace_use_uring (&tdata->loop_ring);
+    log_use_uring (&tdata->loop_ring);
+}
+
+/* Once nothing uses the bus or logs from another thread any more */
+static void
+stop_uring (struct thread_data *tdata)
+{
+    const struct uring_stats *bus = &tdata->bus_ring.stats;
+    const struct uring_stats *loop = &tdata->loop_ring.stats;
+
+    i2c_bus_use_uring (NULL);
+    log_use_uring (NULL);
+    i2c_trace_use_uring (NULL);
+
+    _log_debug ("io_uring: bus %" PRIu64 " calls for %" PRIu64 " operations,"
+                " log and trace %" PRIu64 " calls for %" PRIu64 "\n",
+                bus->enters, bus->sqes, loop->enters, loop->sqes);
+    uring_free (&tdata->loop_ring);
+    uring_free (&tdata->bus_ring);
+}
+
+/* The master takes the channels given on the command line until it
+   subscribes itself */
+static void
+init_subscriptions (struct thread_data *tdata)
+{
+    int ch;
+
+    subscribe_init (&tdata->subs, subscriptions_cb, tdata);
+    tdata->master_sub = subscribe_add (&tdata->subs, "master");
+    for (ch = 0; ch < SUB_CHANNELS; ch++)
+      {
+        if (opts.channels & SENSOR_BIT(ch))
+            subscribe_set (&tdata->subs, tdata->master_sub, ch, SUB_ANY_RATE);
+      }
+}
+
+/* Sampling follows the union of the subscriptions */
+static void
+subscriptions_cb (void *arg)
+{
+    struct thread_data *tdata = arg;
+
+    if (is_sensors_enabled)
+        apply_sampling (tdata, SENSOR_ALL);
+}
+
+/* Run the commands fg_handle_event queued for the event loop */
+static void
+command_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct thread_data *tdata = arg;
+    struct slave_command cmd;
+
+    while (command_queue_pop (&tdata->control.commands, &cmd))
+      {
+        switch (cmd.id)
+          {
+            case FG_SLAVE_BURST:
+                start_burst (tdata, &cmd);
+                break;
+            case FG_SLAVE_SET_PERIOD:
+                if (cmd.n < 1 || cmd.args[0] < 1 ||
+                    cmd.args[0] > COMMAND_MAX_REPORT_S)
+                  {
+                    _log_debug ("invalid report period\n");
+                    break;
+                  }
+                _log_debug ("report period: %d s\n", cmd.args[0]);
+                schedule_set_period (&tdata->schedule,
+                                     cmd.args[0] * NSEC_PER_SEC);
+                break;
+            case FG_SLAVE_SET_WINDOW:
+                set_window (tdata, &cmd);
+                break;
+            case FG_SLAVE_READ_NOW:
+                read_now (tdata);
+                break;
+            case FG_SLAVE_SUBSCRIBE:
+                set_subscription (tdata, &cmd);
+                break;
+            case FG_SLAVE_HISTORY:
+                send_history (tdata, &cmd);
+                break;
+          }
+      }
+}
+
+static void *
+sensors_startup_thread (void *arg)
+{
+    struct thread_data *tdata = arg;
+
+    if (opts.iio_root)
+        tdata->startup.sensors_res = iio_open (&tdata->iio, opts.iio_root,
+                                               opts.iio_trigger);
+    else
+        tdata->startup.sensors_res = sensors_init ();
+    evcore_wakeup (&tdata->startup.sensors_wake);
+    return NULL;
+}
+
+static void *
+master_startup_thread (void *arg)
+{
+    struct thread_data *tdata = arg;
+
+    tdata->startup.master_res = fg_events_client_init_inet (&tdata->etdata,
+                                        &fg_handle_event, NULL, tdata,
+                                        master_ip, master_port, FG_SLAVE);
+    evcore_wakeup (&tdata->startup.master_wake);
+    return NULL;
+}
+
+/* Send the first report as soon as sensors and master are both ready
+   instead of waiting for the first report boundary */
+static void
+first_report (struct thread_data *tdata)
+{
+    struct startup *st = &tdata->startup;
+
+    if (st->reported || !st->sampled || !st->master_done)
+        return;
+
+    timer_cb (0, tdata);
+
+    st->reported = true;
+    st->time_to_first_report = clock_ns (CLOCK_MONOTONIC) - st->t0;
+    _log_debug ("time to first report: %" PRId64 " ms\n",
+                st->time_to_first_report / NSEC_PER_MSEC);
+}
+
+static void
+first_sample_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct thread_data *tdata = arg;
+    struct SensorSample sample;
+
+    /* IIO buffers are read in batches, take what is there already */
+    if (tdata->iio.active)
+        iio_drain (&tdata->iio);
+    else if (is_sensors_enabled &&
+             sensors_sample (tdata->subs.mask & SENSOR_ALL, &sample) == 0)
+        acquire_store (&tdata->acq, &sample);
+
+    tdata->startup.sampled = true;
+    first_report (tdata);
+}
+
+static void
+sensors_ready_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct thread_data *tdata = arg;
+    struct startup *st = &tdata->startup;
+
+    pthread_join (st->sensors_thread, NULL);
+    st->sensors_done = true;
+    evcore_release (&tdata->evcore);
+
+    if (st->sensors_res != 0)
+      {
+        log_error ("sensors not available, will retry at each report");
+        st->sampled = true;
+        first_report (tdata);
+        return;
+      }
+
+    /* Start sampling only now that the sensors are up */
+    is_sensors_enabled = 1;
+    if (opts.iio_root)
+      {
+        if (iio_start (&tdata->iio, tdata->evcore.base, &tdata->acq) < 0)
+            is_sensors_enabled = 0;
+      }
+    else
+        apply_sampling (tdata, SENSOR_ALL);
+
+    if (!opts.iio_root && opts.rt.enabled &&
+        rtacq_start (&tdata->rt, &opts.rt, &tdata->acq, &tdata->evcore) < 0)
+        log_error ("could not start real-time acquisition, using event loop");
+
+    evcore_timer_set (&st->sample_timer, clock_ns (CLOCK_MONOTONIC) +
+                      FIRST_SAMPLE_DELAY_MS * NSEC_PER_MSEC, 0);
+}
+
+static void
+master_ready_cb (uint64_t UNUSED(n), void *arg)
+{
+    struct thread_data *tdata = arg;
+    struct startup *st = &tdata->startup;
+
+    pthread_join (st->master_thread, NULL);
+    st->master_done = true;
+    evcore_release (&tdata->evcore);
+
+    if (st->master_res != 0)
+        log_error_en (st->master_res, "error initializing fgevents");
+
+    first_report (tdata);
+}
+
 static int
-start_timer_event (struct event_base *base, struct thread_data *tdata)
+start_startup (struct thread_data *tdata)
 {
-    struct timeval t = { 10, 0 };
-    struct event *ev;
+    struct startup *st = &tdata->startup;
+    int s;
+
+    if (evcore_wakeup_init (&st->sensors_wake, &tdata->evcore,
+                            sensors_ready_cb, tdata) < 0 ||
+        evcore_wakeup_init (&st->master_wake, &tdata->evcore,
+                            master_ready_cb, tdata) < 0 ||
+        evcore_timer_init (&st->sample_timer, &tdata->evcore,
+                           first_sample_cb, tdata) < 0)
+        return -1;
+
+    /* Virtual time waits for both to report back */
+    evcore_hold (&tdata->evcore);
+    evcore_hold (&tdata->evcore);
 
-    ev = event_new (base, -1, EV_PERSIST, timer_cb, tdata);
-    if (!ev || event_add (ev, &t) < 0)
+    s = pthread_create (&st->sensors_thread, NULL, sensors_startup_thread,
+                        tdata);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create sensor startup thread");
         return -1;
+      }
 
-    event_base_dispatch (base);
+    s = pthread_create (&st->master_thread, NULL, master_startup_thread,
+                        tdata);
+    if (s != 0)
+      {
+        log_error_en (s, "could not create master startup thread");
+        return -1;
+      }
+
+    return 0;
+}
+
+static int
+start_timer_event (struct thread_data *tdata)
+{
+    if (schedule_init (&tdata->schedule, &tdata->evcore,
+                       REPORT_PERIOD * NSEC_PER_SEC, timer_cb, tdata) < 0)
+        return -1;
+
+    evcore_dispatch (&tdata->evcore);
+    schedule_free (&tdata->schedule);
     return 0;
 }
 
@@ -271,6 +1405,9 @@ fg_handle_event (void *arg, struct fgevent *fgev,
     /* Handle error in fgevent */
     if (fgev == NULL)
       {
+        /* a new connection needs the calibration and a reference again */
+        atomic_store (&tdata->calibration_sent, false);
+        packed_reset (&tdata->packed);
         log_error_en (tdata->etdata.save_errno, tdata->etdata.error);
         return 0;
       }
@@ -285,10 +1422,120 @@ fg_handle_event (void *arg, struct fgevent *fgev,
                 tdata->fetched_temp = fgev->payload[0];                
               }
             break;
+        case FG_SLAVE_BURST:
+        case FG_SLAVE_SET_PERIOD:
+        case FG_SLAVE_SET_WINDOW:
+        case FG_SLAVE_READ_NOW:
+        case FG_SLAVE_SUBSCRIBE:
+        case FG_SLAVE_HISTORY:
+            /* We are on the fgevents thread, leave it to the event loop */
+            if (command_queue_push (&tdata->control.commands, fgev) < 0)
+                log_error ("could not queue command from master");
+            break;
         default:
             _log_debug ("eventid: %d\n", fgev->id);
             break;                                                          
       }
       
     return 0;
-}
\ No newline at end of file
+}
+
+/* One report period of the soak test: the samples the acquisition scheduler
+   would take, then the report. Every SOAK_REINIT_CYCLES the sensors drop
+   out and come back on the second attempt. */
+static void
+soak_cycle (void *arg)
+{
+    static uint64_t n;
+    struct thread_data *tdata = arg;
+    struct SensorSample sample;
+    int ii;
+
+    if (++n % SOAK_REINIT_CYCLES == 0)
+      {
+        emubus_fail_opens (1);
+        is_sensors_enabled = 0;
+      }
+
+    for (ii = 0; is_sensors_enabled && ii < SOAK_SAMPLES; ii++)
+      {
+        if (sensors_sample (SENSOR_ALL, &sample) == 0)
+            acquire_store (&tdata->acq, &sample);
+      }
+
+    timer_cb (0, tdata);
+}
+
+/* Run the report cycle opts.soak times against emulated sensors and a
+   master stand-in, see soak_run */
+static int
+run_soak (struct thread_data *tdata)
+{
+    static char addr[] = "127.0.0.1";
+    struct sim_master *master;
+    struct event_base *base;
+    int s, ret = -1;
+
+    evthread_use_pthreads ();
+    base = event_base_new ();
+    if (base == NULL)
+      {
+        log_error ("error event_base_new");
+        return -1;
+      }
+
+    i2c_bus_emulate ();
+    adaptive_init (&tdata->adaptive);
+    if (evcore_init (&tdata->evcore, base) < 0)
+        goto out_base;
+    if (acquire_init (&tdata->acq, &tdata->evcore) < 0)
+        goto out_evcore;
+    rollup_init (&tdata->rollup);
+    tdata->acq.rollup = &tdata->rollup;
+    init_subscriptions (tdata);
+
+    master = loadsim_master_start ();
+    if (!master)
+        goto out_acq;
+
+    if (outbox_init (&tdata->outbox, &tdata->etdata, opts.outbox_policy,
+                     opts.outbox_depth, opts.outbox_spill) < 0)
+        goto out_master;
+    outbox_on_lost_reference (&tdata->outbox, reference_lost, tdata);
+
+    s = fg_events_client_init_inet (&tdata->etdata, &fg_handle_event, NULL,
+                                    tdata, addr, loadsim_master_port (master),
+                                    FG_SLAVE);
+    if (s != 0)
+      {
+        log_error_en (s, "could not connect to master stand-in");
+        goto out_outbox;
+      }
+
+    if (sensors_init () != 0)
+      {
+        log_error ("emulated sensors did not come up");
+        goto out_client;
+      }
+    is_sensors_enabled = 1;
+    apply_sampling (tdata, SENSOR_ALL);
+    tdata->startup.sensors_done = true;
+    tdata->startup.master_done = true;
+
+    ret = soak_run (opts.soak, soak_cycle, tdata);
+
+  out_client:
+    fg_events_client_shutdown (&tdata->etdata);
+  out_outbox:
+    outbox_free (&tdata->outbox);
+  out_master:
+    _log_debug ("master stand-in received %" PRIu64 " bytes\n",
+                loadsim_master_stop (master));
+  out_acq:
+    acquire_free (&tdata->acq);
+  out_evcore:
+    evcore_free (&tdata->evcore);
+  out_base:
+    event_base_free (base);
+    return ret;
+}
@@ -0,0 +1,173 @@
+/*
+ *  slave.h
+ *    State of the slave shared by its event loop and threads, and the
+ *    events it exchanges with the master
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SLAVE_H_
+#define _SLAVE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <fgevents.h>
+
+#include "evcore.h"
+#include "adaptive.h"
+#include "acquire.h"
+#include "schedule.h"
+#include "rtacq.h"
+#include "shmpub.h"
+#include "query.h"
+#include "iio.h"
+#include "imu.h"
+#include "command.h"
+#include "loadsim.h"
+#include "outbox.h"
+#include "packed.h"
+#include "subscribe.h"
+#include "uring.h"
+
+/* Default report period in seconds, reports are aligned to multiples of it */
+#define REPORT_PERIOD 10
+
+/* Options given on the command line */
+struct slave_options {
+    struct rtacq_config rt;
+    int                 bench_jitter;   /* samples to benchmark, 0 = off */
+    const char         *record_path;    /* i2c trace to record to */
+    const char         *replay_path;    /* i2c trace to replay */
+    bool                replay_realtime;
+    int                 replay_loops;
+    const char         *query_path;     /* local query socket */
+    const char         *iio_root;       /* acquire through IIO, "" = / */
+    const char         *iio_trigger;    /* IIO trigger to attach */
+    bool                imu;            /* detect landings with the IMU */
+    struct loadsim_config load;         /* load simulation, 0 clients = off */
+    bool                raw;            /* report raw counts, see FG_SENSOR_RAW */
+    int                 outbox_depth;   /* events queued for the master */
+    enum outbox_policy  outbox_policy;  /* what to do when it is full */
+    const char         *outbox_spill;   /* spill file for OUTBOX_SPILL */
+    uint64_t            soak;           /* soak test cycles, 0 = off */
+    bool                packed;         /* report as FG_SENSOR_PACKED */
+    bool                packed_delta;   /* with delta reports */
+    int64_t             virtual_s;      /* seconds of virtual time, 0 = off */
+    unsigned            channels;       /* the master subscribes to */
+    bool                io_uring;       /* bus, log and trace i/o */
+};
+
+/* Event sent to the master when a bird lands on the feeder, payload is
+   peak acceleration in mg, duration in ms and energy in mg*s */
+#ifndef FG_PERCH_LANDING
+#define FG_PERCH_LANDING 64
+#endif
+
+/* Sent once per connection before the first FG_SENSOR_RAW report. The
+   payload is the HTS221 calibration block, four bytes per word with the
+   lowest register in the least significant byte. Pressure counts are always
+   1/4096 hPa. */
+#ifndef FG_SENSOR_CALIBRATION
+#define FG_SENSOR_CALIBRATION 69
+#endif
+
+/* Report in sensor counts instead of FG_SENSOR_DATA. The payload is the mask
+   of channels present (SENSOR_BIT, bit 3 for the outside temperature), the
+   outside temperature x10, the 24 bit pressure count and the 16 bit
+   temperature count in the upper and the humidity count in the lower half
+   of the last word. */
+#ifndef FG_SENSOR_RAW
+#define FG_SENSOR_RAW 70
+#endif
+
+#define FG_RAW_OUTTEMP SENSOR_BIT(SENSOR_CHANNELS)
+#define FG_RAW_LENGTH 4
+
+/* Words in a FG_SENSOR_DATA payload, a tag and a value for each reading */
+#define FG_SENSOR_LENGTH 8
+
+/* Report instead of FG_SENSOR_DATA with only the readings present in
+   varints, see packed.h for the payload. A master accepting both tells
+   them apart by id, the payload starts with its version. */
+#ifndef FG_SENSOR_PACKED
+#define FG_SENSOR_PACKED 71
+#endif
+
+/* Time we give the sensors to complete their first conversion after they
+   were brought up, one period of the 12.5 Hz output data rate */
+#define FIRST_SAMPLE_DELAY_MS 80
+
+/* Sensor discovery and master connection run concurrently at startup */
+struct startup {
+    int64_t       t0;               /* CLOCK_MONOTONIC at process start */
+    pthread_t     sensors_thread;
+    pthread_t     master_thread;
+    struct evcore_source sensors_wake;  /* posted when sensors_init is done */
+    struct evcore_source master_wake;   /* posted when connect is done */
+    struct evcore_source sample_timer;  /* first sample after bring-up */
+    int           sensors_res;
+    int           master_res;
+    bool          sensors_done;
+    bool          sampled;
+    bool          master_done;
+    bool          reported;
+    int64_t       time_to_first_report;
+};
+
+/* Sampling imposed by commands from the master, it takes precedence over
+   the adaptive controller */
+struct master_control {
+    struct command_queue commands;
+    struct evcore_source burst_timer;   /* ends the burst */
+    int64_t              burst_period;  /* nanoseconds, 0 = no burst */
+    int64_t              window_period[SENSOR_CHANNELS]; /* 0 = adaptive */
+};
+
+/* Common data structure used by threads */
+struct thread_data {
+    struct evcore         evcore;
+    struct evcore_source  signals;
+    struct fg_events_data etdata;
+    struct outbox         outbox;       /* everything sent to the master */
+    atomic_bool           calibration_sent; /* on this connection */
+    struct packed_encoder packed;       /* references on this connection */
+    bool 				  valid_temp;
+    int32_t				  fetched_temp;
+    size_t 				  c_invalidate_temp;
+    struct adaptive_ctl   adaptive;
+    struct acquisition    acq;
+    struct rollup_set     rollup;
+    struct rtacq          rt;
+    struct shmpub         shm;
+    struct query_server   query;
+    struct iio_backend    iio;
+    struct imu_stream     imu;
+    struct startup        startup;
+    struct master_control control;
+    struct report_schedule schedule;
+    struct subscriptions  subs;         /* drive what is acquired */
+    int                   master_sub;   /* subscriber id of the master */
+    struct uring          bus_ring;     /* run by the bus owner */
+    struct uring          loop_ring;    /* log and trace writes */
+};
+
+#endif /* _SLAVE_H_ */
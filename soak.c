@@ -0,0 +1,244 @@
+/*
+ *  soak.c
+ *    Endurance run of the report cycle that watches memory, descriptors
+ *    and cycle latency for anything that keeps growing
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "soak.h"
+#include "common.h"
+#include "log.h"
+
+/* Cycle latencies kept per checkpoint, longer intervals are subsampled */
+#define SOAK_MAX_LATENCY 65536
+
+struct soak_point {
+    uint64_t cycles;
+    double   rss;       /* bytes */
+    double   heap;      /* bytes */
+    double   fds;
+    double   p50, p99;  /* nanoseconds */
+};
+
+static double
+read_rss (void)
+{
+    long pages = 0, resident = 0;
+    FILE *fp;
+
+    fp = fopen ("/proc/self/statm", "r");
+    if (!fp)
+        return 0.0;
+    if (fscanf (fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose (fp);
+
+    return (double) resident * sysconf (_SC_PAGESIZE);
+}
+
+/* Chunks handed out by malloc, in every arena and mmapped */
+static double
+read_heap (void)
+{
+    struct mallinfo2 mi = mallinfo2 ();
+
+    return (double) mi.uordblks + (double) mi.hblkhd;
+}
+
+static double
+count_fds (void)
+{
+    struct dirent *de;
+    DIR *dir;
+    int n = 0;
+
+    dir = opendir ("/proc/self/fd");
+    if (!dir)
+        return 0.0;
+    while ((de = readdir (dir)))
+      {
+        if (de->d_name[0] != '.')
+            n++;
+      }
+    closedir (dir);
+
+    /* Not counting the descriptor of the listing itself */
+    return n - 1;
+}
+
+static int
+compare_s64 (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+percentile (int64_t *v, size_t n, double pct)
+{
+    if (n == 0)
+        return 0.0;
+    return (double) v[(size_t) (pct / 100.0 * (n - 1) + 0.5)];
+}
+
+/* Least squares slope of y over the cycle count, times the cycles it spans */
+static double
+growth (const struct soak_point *p, int n, size_t offset)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, d;
+    int ii;
+
+    if (n < 2)
+        return 0.0;
+
+    for (ii = 0; ii < n; ii++)
+      {
+        x = (double) p[ii].cycles;
+        y = *(const double *) ((const char *) &p[ii] + offset);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+      }
+    d = n * sxx - sx * sx;
+    if (d == 0.0)
+        return 0.0;
+
+    return (n * sxy - sx * sy) / d * (double) (p[n - 1].cycles - p[0].cycles);
+}
+
+static int
+verdict (const char *name, const char *unit, double scale, double grown,
+         double slack)
+{
+    bool leak = grown > slack;
+
+    printf ("%-8s %+12.1f %-4s over the run (limit %.1f)  %s\n", name,
+            grown / scale, unit, slack / scale, leak ? "GROWING" : "flat");
+    return leak;
+}
+
+int
+soak_run (uint64_t n, soak_cycle_fn cycle, void *arg)
+{
+    struct soak_point points[SOAK_CHECKPOINTS], *pt, *first;
+    uint64_t per_point, done, stride, ii;
+    int64_t *latency, t0;
+    size_t n_latency;
+    double lat_slack, tail_slack;
+    int k, measured, failed;
+
+    per_point = n / SOAK_CHECKPOINTS;
+    if (per_point < 1)
+      {
+        fprintf (stderr, "%s: soak needs at least %d cycles\n", __progname,
+                 SOAK_CHECKPOINTS);
+        return -1;
+      }
+    stride = (per_point + SOAK_MAX_LATENCY - 1) / SOAK_MAX_LATENCY;
+
+    latency = malloc (sizeof (int64_t) * SOAK_MAX_LATENCY);
+    if (!latency)
+      {
+        log_error ("malloc failed for cycle latencies");
+        return -1;
+      }
+
+    printf ("%12s %10s %10s %6s %9s %9s\n", "cycles", "rss KiB", "heap KiB",
+            "fds", "p50 us", "p99 us");
+
+    done = 0;
+    for (k = 0; k < SOAK_CHECKPOINTS; k++)
+      {
+        n_latency = 0;
+        for (ii = 0; ii < per_point; ii++)
+          {
+            t0 = clock_ns (CLOCK_MONOTONIC);
+            cycle (arg);
+            if (ii % stride == 0 && n_latency < SOAK_MAX_LATENCY)
+                latency[n_latency++] = clock_ns (CLOCK_MONOTONIC) - t0;
+          }
+        done += per_point;
+
+        qsort (latency, n_latency, sizeof (int64_t), compare_s64);
+        pt = &points[k];
+        pt->cycles = done;
+        pt->rss = read_rss ();
+        pt->heap = read_heap ();
+        pt->fds = count_fds ();
+        pt->p50 = percentile (latency, n_latency, 50.0);
+        pt->p99 = percentile (latency, n_latency, 99.0);
+
+        printf ("%12" PRIu64 " %10.0f %10.1f %6.0f %9.1f %9.1f%s\n",
+                pt->cycles, pt->rss / 1024.0, pt->heap / 1024.0, pt->fds,
+                pt->p50 / 1000.0, pt->p99 / 1000.0,
+                k < SOAK_WARMUP ? "  (warmup)" : "");
+      }
+    free (latency);
+
+    first = &points[SOAK_WARMUP];
+    measured = SOAK_CHECKPOINTS - SOAK_WARMUP;
+
+    /* Latency is allowed to wander by half of where it started */
+    lat_slack = first->p50 / 2.0;
+    if (lat_slack < SOAK_LATENCY_SLACK)
+        lat_slack = SOAK_LATENCY_SLACK;
+
+    /* The tail is noisier and may wander by as much as where it started */
+    tail_slack = first->p99;
+    if (tail_slack < SOAK_TAIL_SLACK)
+        tail_slack = SOAK_TAIL_SLACK;
+
+    failed = 0;
+    failed += verdict ("rss", "KiB", 1024.0,
+                       growth (first, measured,
+                               offsetof (struct soak_point, rss)),
+                       SOAK_RSS_SLACK);
+    failed += verdict ("heap", "KiB", 1024.0,
+                       growth (first, measured,
+                               offsetof (struct soak_point, heap)),
+                       SOAK_HEAP_SLACK);
+    /* Half a descriptor is within rounding of the fit, one is a leak */
+    failed += verdict ("fds", "", 1.0,
+                       growth (first, measured,
+                               offsetof (struct soak_point, fds)), 0.5);
+    failed += verdict ("p50", "us", 1000.0,
+                       growth (first, measured,
+                               offsetof (struct soak_point, p50)),
+                       lat_slack);
+    failed += verdict ("p99", "us", 1000.0,
+                       growth (first, measured,
+                               offsetof (struct soak_point, p99)),
+                       tail_slack);
+
+    printf ("%s after %" PRIu64 " cycles\n",
+            failed ? "FAIL: resource use trends upward" : "PASS", done);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+/*
+ *  soak.h
+ *    Endurance run of the report cycle that watches memory, descriptors
+ *    and cycle latency for anything that keeps growing
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SOAK_H_
+#define _SOAK_H_
+
+#include <stdint.h>
+
+/* Points at which resource use is sampled over the run */
+#define SOAK_CHECKPOINTS 20
+
+/* Checkpoints left out of the trend while caches and pools fill up */
+#define SOAK_WARMUP 2
+
+/* Growth over the measured part of the run that still counts as flat */
+#define SOAK_RSS_SLACK      (512 * 1024)
+#define SOAK_HEAP_SLACK     (64 * 1024)
+#define SOAK_LATENCY_SLACK  20000       /* nanoseconds of p50 */
+#define SOAK_TAIL_SLACK     100000      /* nanoseconds of p99 */
+
+/* Samples taken per report in a soak cycle of the slave, and how often the
+   sensors are brought up again, the first attempt failing */
+#define SOAK_SAMPLES 4
+#define SOAK_REINIT_CYCLES 10000
+
+typedef void (*soak_cycle_fn) (void *);
+
+/*
+ * Run cycle n times and sample resident set size, heap in use, open file
+ * descriptors and the p50 and p99 cycle latency at SOAK_CHECKPOINTS points.
+ * A table of the samples is printed followed by the growth of each fitted
+ * over the run. Returns 1 if any of them trends upward, 0 if all are flat
+ * and -1 if the run could not be set up.
+ */
+extern int soak_run (uint64_t, soak_cycle_fn, void *);
+
+#endif /* _SOAK_H_ */
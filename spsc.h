@@ -0,0 +1,91 @@
+/*
+ *  spsc.h
+ *    Lock-free single-producer single-consumer ring used to hand sensor
+ *    samples from the acquisition thread to the event loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SPSC_H_
+#define _SPSC_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sensors.h"
+
+/* Must be a power of two */
+#define SPSC_CAPACITY 256
+
+/* A sample together with the CLOCK_MONOTONIC time it was taken at */
+struct acq_reading {
+    int64_t             t;
+    struct SensorSample sample;
+};
+
+/*
+ * head is only written by the producer and tail only by the consumer, each
+ * on its own cache line so the two threads do not bounce it between them
+ */
+struct spsc_ring {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) struct acq_reading slots[SPSC_CAPACITY];
+};
+
+static inline void
+spsc_init (struct spsc_ring *ring)
+{
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+}
+
+/* Called by the producer only. Returns false if the ring is full. */
+static inline bool
+spsc_push (struct spsc_ring *ring, const struct acq_reading *r)
+{
+    size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+
+    if (head - tail == SPSC_CAPACITY)
+        return false;
+
+    ring->slots[head & (SPSC_CAPACITY - 1)] = *r;
+    atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* Called by the consumer only. Returns false if the ring is empty. */
+static inline bool
+spsc_pop (struct spsc_ring *ring, struct acq_reading *r)
+{
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return false;
+
+    *r = ring->slots[tail & (SPSC_CAPACITY - 1)];
+    atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+#endif /* _SPSC_H_ */
@@ -0,0 +1,181 @@
+/*
+ *  subscribe.c
+ *    Per-channel subscriptions of the consumers of readings and the union
+ *    acquisition is driven by
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <string.h>
+
+#include "subscribe.h"
+#include "common.h"
+#include "log.h"
+
+static const char *channel_names[SUB_CHANNELS] = {
+    [SENSOR_PRESSURE]    = "pressure",
+    [SENSOR_TEMPERATURE] = "temperature",
+    [SENSOR_HUMIDITY]    = "humidity",
+    [SUB_OUTTEMP]        = "outtemp"
+};
+
+void
+subscribe_init (struct subscriptions *subs, void (*changed) (void *),
+                void *arg)
+{
+    memset (subs, 0, sizeof (*subs));
+    subs->changed = changed;
+    subs->arg = arg;
+}
+
+/* Take the shortest period of every channel over all subscribers and tell
+   the owner if that changed anything */
+static void
+update_union (struct subscriptions *subs)
+{
+    int64_t period[SUB_CHANNELS] = { 0 };
+    const struct subscriber *s;
+    unsigned mask = 0;
+    int ii, ch;
+
+    for (ii = 0; ii < SUB_MAX; ii++)
+      {
+        s = &subs->sub[ii];
+        for (ch = 0; s->used && ch < SUB_CHANNELS; ch++)
+          {
+            if (s->period[ch] && (!period[ch] || s->period[ch] < period[ch]))
+                period[ch] = s->period[ch];
+          }
+      }
+    for (ch = 0; ch < SUB_CHANNELS; ch++)
+      {
+        if (period[ch])
+            mask |= SENSOR_BIT(ch);
+      }
+
+    if (mask == subs->mask &&
+        memcmp (period, subs->period, sizeof (period)) == 0)
+        return;
+
+    if (mask != subs->mask)
+        _log_debug ("subscribed channels: %#x, was %#x\n", mask, subs->mask);
+    memcpy (subs->period, period, sizeof (period));
+    subs->mask = mask;
+    if (subs->changed)
+        subs->changed (subs->arg);
+}
+
+int
+subscribe_add (struct subscriptions *subs, const char *name)
+{
+    int ii;
+
+    for (ii = 0; ii < SUB_MAX; ii++)
+      {
+        if (!subs->sub[ii].used)
+          {
+            memset (&subs->sub[ii], 0, sizeof (subs->sub[ii]));
+            subs->sub[ii].used = true;
+            subs->sub[ii].name = name;
+            return ii;
+          }
+      }
+
+    return -1;
+}
+
+void
+subscribe_remove (struct subscriptions *subs, int id)
+{
+    if (id < 0 || id >= SUB_MAX || !subs->sub[id].used)
+        return;
+
+    subs->sub[id].used = false;
+    update_union (subs);
+}
+
+void
+subscribe_set (struct subscriptions *subs, int id, int ch, int64_t period)
+{
+    if (id < 0 || id >= SUB_MAX || !subs->sub[id].used || ch < 0 ||
+        ch >= SUB_CHANNELS || period < 0)
+        return;
+
+    subs->sub[id].period[ch] = period;
+    update_union (subs);
+}
+
+unsigned
+subscribe_mask (const struct subscriptions *subs, int id)
+{
+    unsigned mask = 0;
+    int ch;
+
+    if (id < 0 || id >= SUB_MAX || !subs->sub[id].used)
+        return 0;
+
+    for (ch = 0; ch < SUB_CHANNELS; ch++)
+      {
+        if (subs->sub[id].period[ch])
+            mask |= SENSOR_BIT(ch);
+      }
+
+    return mask;
+}
+
+const char *
+subscribe_channel_name (int ch)
+{
+    return ch >= 0 && ch < SUB_CHANNELS ? channel_names[ch] : "?";
+}
+
+int
+subscribe_parse_channel (const char *name)
+{
+    int ch;
+
+    for (ch = 0; ch < SUB_CHANNELS; ch++)
+      {
+        if (strcmp (name, channel_names[ch]) == 0)
+            return ch;
+      }
+
+    return -1;
+}
+
+int
+subscribe_parse_list (const char *list)
+{
+    char buf[SUB_MAX_LIST], *name, *save;
+    int mask = 0, ch;
+
+    if (strlen (list) >= sizeof (buf))
+        return -1;
+    strcpy (buf, list);
+
+    for (name = strtok_r (buf, ",", &save); name;
+         name = strtok_r (NULL, ",", &save))
+      {
+        if ((ch = subscribe_parse_channel (name)) < 0)
+            return -1;
+        mask |= SENSOR_BIT(ch);
+      }
+
+    return mask;
+}
@@ -0,0 +1,93 @@
+/*
+ *  subscribe.h
+ *    Per-channel subscriptions of the consumers of readings and the union
+ *    acquisition is driven by
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sensors.h"
+
+/* The outdoor temperature the AVR measures is subscribed to like the
+   channels of our own sensors */
+#define SUB_OUTTEMP  SENSOR_CHANNELS
+#define SUB_CHANNELS (SENSOR_CHANNELS + 1)
+#define SUB_ALL      (SENSOR_BIT(SUB_CHANNELS) - 1)
+
+/* Period of a channel wanted at whatever rate it is sampled at */
+#define SUB_ANY_RATE INT64_MAX
+
+/* Master, query clients and the odd local consumer */
+#define SUB_MAX 16
+
+/* Longest channel list accepted by subscribe_parse_list */
+#define SUB_MAX_LIST 64
+
+struct subscriber {
+    bool        used;
+    const char *name;                   /* for the log */
+    int64_t     period[SUB_CHANNELS];   /* nanoseconds, 0 = not wanted */
+};
+
+/*
+ * Each consumer of readings subscribes to the channels it uses with the
+ * longest sample period it can live with. The union holds per channel the
+ * shortest period any subscriber asked for, a channel nobody subscribes to
+ * is neither sampled nor kept powered up. changed is called whenever the
+ * union changes. Only used from the event loop.
+ */
+struct subscriptions {
+    struct subscriber sub[SUB_MAX];
+    int64_t           period[SUB_CHANNELS];     /* union, 0 = nobody */
+    unsigned          mask;                     /* channels in the union */
+    void            (*changed) (void *);
+    void             *arg;
+};
+
+extern void subscribe_init (struct subscriptions *, void (*) (void *),
+                            void *);
+
+/* Register a subscriber without channels, returns its id or -1 if all
+   SUB_MAX are taken */
+extern int subscribe_add (struct subscriptions *, const char *);
+
+/* Drop the subscriber and whatever it subscribed to */
+extern void subscribe_remove (struct subscriptions *, int);
+
+/* Subscribe to a channel at period (SUB_ANY_RATE for any), 0 unsubscribes */
+extern void subscribe_set (struct subscriptions *, int, int, int64_t);
+
+/* Channels a subscriber has subscribed to */
+extern unsigned subscribe_mask (const struct subscriptions *, int);
+
+extern const char *subscribe_channel_name (int);
+
+/* Channel named name, -1 if there is none */
+extern int subscribe_parse_channel (const char *);
+
+/* Mask of a comma separated list of channel names, -1 on an unknown one */
+extern int subscribe_parse_list (const char *);
+
+#endif /* _SUBSCRIBE_H_ */
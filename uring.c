@@ -0,0 +1,444 @@
+/*
+ *  uring.c
+ *    Minimal io_uring on raw system calls: batched and linked submissions and
+ *    write-behind files completed through the event loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "common.h"
+
+/* Nothing in here logs, the log itself may be written through a ring */
+
+static int
+sys_setup (unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall (SYS_io_uring_setup, entries, p);
+}
+
+static int
+sys_enter (int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return (int) syscall (SYS_io_uring_enter, fd, submit, complete, flags,
+                          NULL, 0);
+}
+
+static int
+sys_register (int fd, unsigned opcode, const void *arg, unsigned n)
+{
+    return (int) syscall (SYS_io_uring_register, fd, opcode, arg, n);
+}
+
+int
+uring_init (struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset (ring, 0, sizeof (*ring));
+    ring->fd = -1;
+
+    memset (&p, 0, sizeof (p));
+    ring->fd = sys_setup (entries, &p);
+    if (ring->fd < 0)
+        return -1;
+
+    /* Log and trace files are written where they stand, like write(2) */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+      {
+        close (ring->fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+      }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    ring->cq_size = p.cq_off.cqes +
+                    p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+      }
+    ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    ring->sq_ptr = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ptr = ring->sq_ptr;
+    if (ring->sq_ptr != MAP_FAILED && ring->cq_size)
+        ring->cq_ptr = mmap (NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED ||
+        ring->sqes == MAP_FAILED)
+      {
+        uring_free (ring);
+        return -1;
+      }
+
+    sq = ring->sq_ptr;
+    cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->entries = p.sq_entries;
+
+    pthread_mutex_init (&ring->lock, NULL);
+    return 0;
+}
+
+/* Run the completions posted so far, without the lock held so that
+   callbacks can queue more */
+static void
+reap (struct uring *ring)
+{
+    struct io_uring_cqe cqe;
+    struct uring_op *op;
+    unsigned head;
+
+    for (;;)
+      {
+        pthread_mutex_lock (&ring->lock);
+        head = *ring->cq_head;
+        if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+          {
+            pthread_mutex_unlock (&ring->lock);
+            break;
+          }
+        cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        ring->inflight--;
+        ring->stats.cqes++;
+        pthread_mutex_unlock (&ring->lock);
+
+        op = (struct uring_op *) (uintptr_t) cqe.user_data;
+        op->res = cqe.res;
+        if (op->cb)
+            op->cb (op, cqe.res);
+      }
+}
+
+static void
+complete_cb (uint64_t UNUSED(n), void *arg)
+{
+    reap (arg);
+}
+
+int
+uring_attach (struct uring *ring, struct evcore *core)
+{
+    if (evcore_wakeup_init (&ring->complete, core, complete_cb, ring) < 0)
+        return -1;
+
+    /* The kernel posts the eventfd for every completion */
+    if (sys_register (ring->fd, IORING_REGISTER_EVENTFD, &ring->complete.fd,
+                      1) < 0)
+      {
+        evcore_source_free (&ring->complete);
+        return -1;
+      }
+
+    return 0;
+}
+
+void
+uring_free (struct uring *ring)
+{
+    evcore_source_free (&ring->complete);
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap (ring->sqes, ring->sqes_size);
+    if (ring->cq_size && ring->cq_ptr && ring->cq_ptr != MAP_FAILED)
+        munmap (ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+        munmap (ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+      {
+        close (ring->fd);
+        pthread_mutex_destroy (&ring->lock);
+      }
+    ring->sq_ptr = ring->cq_ptr = NULL;
+    ring->sqes = NULL;
+    ring->fd = -1;
+}
+
+int
+uring_prep (struct uring *ring, struct uring_op *op, int opcode, int fd,
+            void *buf, size_t len, unsigned flags)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    if (ring->fd < 0)
+        return -1;
+
+    pthread_mutex_lock (&ring->lock);
+
+    /* Keep the completion queue from overflowing too, it is twice as big */
+    tail = *ring->sq_tail;
+    if (tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->entries || ring->queued + ring->inflight >= ring->entries)
+      {
+        pthread_mutex_unlock (&ring->lock);
+        errno = EBUSY;
+        return -1;
+      }
+
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset (sqe, 0, sizeof (*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (uint64_t) -1;
+    sqe->user_data = (uintptr_t) op;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+
+    pthread_mutex_unlock (&ring->lock);
+    return 0;
+}
+
+/* Enter the kernel with whatever is queued, caller holds ring->lock */
+static int
+enter (struct uring *ring, unsigned complete, unsigned flags)
+{
+    int res;
+
+    res = sys_enter (ring->fd, ring->queued, complete, flags);
+    ring->stats.enters++;
+    if (res < 0)
+        return errno == EINTR ? 0 : -1;
+
+    ring->queued -= res;
+    ring->inflight += res;
+    ring->stats.sqes += res;
+    return 0;
+}
+
+int
+uring_submit (struct uring *ring)
+{
+    int res = 0;
+
+    pthread_mutex_lock (&ring->lock);
+    if (ring->queued)
+        res = enter (ring, 0, 0);
+    pthread_mutex_unlock (&ring->lock);
+
+    return res;
+}
+
+int
+uring_run (struct uring *ring)
+{
+    int res;
+
+    for (;;)
+      {
+        pthread_mutex_lock (&ring->lock);
+        if (!ring->queued && !ring->inflight)
+          {
+            pthread_mutex_unlock (&ring->lock);
+            return 0;
+          }
+        /* One call for a whole chain rather than one per completion */
+        res = enter (ring, ring->queued + ring->inflight,
+                     IORING_ENTER_GETEVENTS);
+        pthread_mutex_unlock (&ring->lock);
+        if (res < 0)
+            return -1;
+
+        reap (ring);
+      }
+}
+
+/* ---------------------------------------------------------------------- */
+/*                           Write-behind files                           */
+/* ---------------------------------------------------------------------- */
+
+static void file_done (struct uring_op *, int);
+
+int
+uring_file_init (struct uring_file *f, struct uring *ring, int fd)
+{
+    memset (f, 0, sizeof (*f));
+    f->ring = ring;
+    f->fd = fd;
+    f->op.cb = file_done;
+    f->op.arg = f;
+    return pthread_mutex_init (&f->lock, NULL) ? -1 : 0;
+}
+
+/* Queue the rest of the buffer in flight, write it out the blocking way if
+   the ring is full. Caller holds f->lock. */
+static void
+issue (struct uring_file *f)
+{
+    ssize_t res;
+
+    f->busy = true;
+    if (uring_prep (f->ring, &f->op, IORING_OP_WRITE, f->fd,
+                    f->buf + f->done, f->len - f->done, 0) == 0)
+      {
+        /* Goes with the next submission if the kernel is busy now */
+        uring_submit (f->ring);
+        return;
+      }
+
+    while (f->done < f->len)
+      {
+        res = write (f->fd, f->buf + f->done, f->len - f->done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+          {
+            f->dropped += f->len - f->done;
+            break;
+          }
+        f->done += res;
+      }
+    f->busy = false;
+}
+
+/* Put what is waiting in flight, caller holds f->lock */
+static void
+start_write (struct uring_file *f)
+{
+    char *buf = f->buf;
+    size_t cap = f->cap;
+
+    f->buf = f->next;
+    f->cap = f->next_cap;
+    f->len = f->next_len;
+    f->done = 0;
+    f->next = buf;
+    f->next_cap = cap;
+    f->next_len = 0;
+    issue (f);
+}
+
+static void
+file_done (struct uring_op *op, int res)
+{
+    struct uring_file *f = op->arg;
+
+    pthread_mutex_lock (&f->lock);
+
+    /* Nothing was written, try again */
+    if (res == -EINTR || res == -EAGAIN)
+        res = 0;
+
+    if (res < 0)
+        f->dropped += f->len - f->done;
+    f->done = res < 0 ? f->len : f->done + res;
+
+    if (f->done < f->len)
+        issue (f);
+    else
+      {
+        f->busy = false;
+        if (f->next_len)
+            start_write (f);
+      }
+
+    pthread_mutex_unlock (&f->lock);
+}
+
+ssize_t
+uring_file_write (struct uring_file *f, const void *data, size_t len)
+{
+    size_t cap;
+    char *p;
+
+    pthread_mutex_lock (&f->lock);
+    if (f->next_len + len > f->next_cap)
+      {
+        for (cap = f->next_cap ? f->next_cap : 4096;
+             cap < f->next_len + len; cap *= 2)
+            ;
+        p = cap <= URING_FILE_MAX ? realloc (f->next, cap) : NULL;
+        if (!p)
+          {
+            f->dropped += len;
+            pthread_mutex_unlock (&f->lock);
+            errno = ENOBUFS;
+            return -1;
+          }
+        f->next = p;
+        f->next_cap = cap;
+      }
+
+    memcpy (f->next + f->next_len, data, len);
+    f->next_len += len;
+    if (!f->busy)
+        start_write (f);
+    pthread_mutex_unlock (&f->lock);
+
+    return (ssize_t) len;
+}
+
+static ssize_t
+stream_write (void *cookie, const char *buf, size_t len)
+{
+    return uring_file_write (cookie, buf, len) < 0 ? 0 : (ssize_t) len;
+}
+
+static int
+stream_close (void *UNUSED(cookie))
+{
+    return 0;
+}
+
+FILE *
+uring_file_stream (struct uring_file *f)
+{
+    cookie_io_functions_t io = { NULL, stream_write, NULL, stream_close };
+
+    return fopencookie (f, "w", io);
+}
+
+void
+uring_file_free (struct uring_file *f)
+{
+    free (f->buf);
+    free (f->next);
+    f->buf = f->next = NULL;
+    f->cap = f->next_cap = 0;
+    pthread_mutex_destroy (&f->lock);
+}
@@ -0,0 +1,132 @@
+/*
+ *  uring.h
+ *    Minimal io_uring on raw system calls: batched and linked submissions and
+ *    write-behind files completed through the event loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#include "evcore.h"
+
+/* Entries of the bus ring, two per transaction of the largest request */
+#define URING_BUS_ENTRIES 32
+
+/* Entries of the ring attached to the event loop */
+#define URING_LOOP_ENTRIES 64
+
+/* Bytes a write-behind file lets pile up before it drops writes */
+#define URING_FILE_MAX (1024 * 1024)
+
+struct uring_op;
+
+/* Called with the operation and its result, a byte count or -errno */
+typedef void (*uring_cb) (struct uring_op *, int);
+
+/* One submitted operation, lives until its completion has been reaped */
+struct uring_op {
+    uring_cb cb;        /* may be NULL, then only res is set */
+    void    *arg;
+    int      res;
+};
+
+struct uring_stats {
+    uint64_t enters;    /* io_uring_enter calls */
+    uint64_t sqes;      /* operations submitted */
+    uint64_t cqes;      /* completions reaped */
+};
+
+/*
+ * A ring is either attached to the event loop, which then reaps all its
+ * completions, or driven by one thread at a time through uring_run.
+ * Operations may be queued from any thread.
+ */
+struct uring {
+    int                  fd;
+    pthread_mutex_t      lock;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr, *cq_ptr;
+    size_t               sq_size, cq_size, sqes_size;
+    unsigned             entries;
+    unsigned             queued;    /* prepared, not yet submitted */
+    unsigned             inflight;  /* submitted, not yet reaped */
+    struct evcore_source complete;  /* attached rings only */
+    struct uring_stats   stats;
+};
+
+/* Returns -1 with errno set if the kernel has no io_uring for us, callers
+   carry on with blocking calls then */
+extern int uring_init (struct uring *, unsigned);
+
+/* Reap every completion in the event loop through an eventfd */
+extern int uring_attach (struct uring *, struct evcore *);
+
+/* Everything in flight must have completed */
+extern void uring_free (struct uring *);
+
+/* Queue a read or write (opcode) of len bytes at buf on fd at its current
+   position, with IOSQE_* flags. Returns -1 if the ring is full. */
+extern int uring_prep (struct uring *, struct uring_op *, int, int, void *,
+                       size_t, unsigned);
+
+/* Hand the queued operations to the kernel in one system call */
+extern int uring_submit (struct uring *);
+
+/* Submit what is queued and wait until nothing is in flight, running the
+   completions. Not for rings attached to a running loop. */
+extern int uring_run (struct uring *);
+
+/* Writes to a descriptor that return at once and complete in the order
+   they were made, whatever piles up meanwhile goes out in one write */
+struct uring_file {
+    struct uring   *ring;
+    int             fd;
+    pthread_mutex_t lock;
+    struct uring_op op;
+    char           *buf;        /* in flight */
+    size_t          len, done, cap;
+    char           *next;       /* waiting for the write in flight */
+    size_t          next_len, next_cap;
+    bool            busy;
+    uint64_t        dropped;    /* bytes */
+};
+
+extern int uring_file_init (struct uring_file *, struct uring *, int);
+
+extern ssize_t uring_file_write (struct uring_file *, const void *, size_t);
+
+/* Stdio stream over the file, closing it leaves the file open */
+extern FILE *uring_file_stream (struct uring_file *);
+
+/* The ring must have been run empty */
+extern void uring_file_free (struct uring_file *);
+
+#endif /* _URING_H_ */
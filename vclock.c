@@ -0,0 +1,101 @@
+/*
+ *  vclock.c
+ *    Clock the slave runs on, the system clocks or a virtual time that
+ *    only moves when the event loop has nothing left to do
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdatomic.h>
+
+#include "vclock.h"
+#include "common.h"
+
+bool vclock_enabled;
+
+static atomic_int_least64_t mono;
+static int64_t real_offset;     /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+
+void
+vclock_start (void)
+{
+    int64_t now_mono = clock_ns (CLOCK_MONOTONIC);
+
+    real_offset = clock_ns (CLOCK_REALTIME) - now_mono;
+    atomic_store (&mono, now_mono);
+    vclock_enabled = true;
+}
+
+int64_t
+vclock_now (clockid_t clk)
+{
+    int64_t now = atomic_load (&mono);
+
+    return clk == CLOCK_REALTIME ? now + real_offset : now;
+}
+
+void
+vclock_advance (int64_t t)
+{
+    int64_t now = atomic_load (&mono);
+
+    while (t > now && !atomic_compare_exchange_weak (&mono, &now, t))
+        ;
+}
+
+int64_t
+vclock_system_ns (clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime (clk, &ts);
+    return (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void
+vclock_sleep (int64_t ns)
+{
+    struct timespec ts;
+
+    if (vclock_enabled)
+      {
+        vclock_advance (atomic_load (&mono) + ns);
+        return;
+      }
+
+    ts.tv_sec = ns / NSEC_PER_SEC;
+    ts.tv_nsec = ns % NSEC_PER_SEC;
+    nanosleep (&ts, NULL);
+}
+
+void
+vclock_sleep_until (int64_t t)
+{
+    struct timespec ts;
+
+    if (vclock_enabled)
+      {
+        vclock_advance (t);
+        return;
+      }
+
+    ts.tv_sec = t / NSEC_PER_SEC;
+    ts.tv_nsec = t % NSEC_PER_SEC;
+    clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
@@ -0,0 +1,60 @@
+/*
+ *  vclock.h
+ *    Clock the slave runs on, the system clocks or a virtual time that
+ *    only moves when the event loop has nothing left to do
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _VCLOCK_H_
+#define _VCLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * All clock reads go through clock_ns and all sleeps through vclock_sleep
+ * and vclock_sleep_until. Once vclock_start is called, CLOCK_MONOTONIC
+ * and CLOCK_REALTIME stand still until the event loop advances them to the
+ * next timer (see evcore_dispatch) or a sleep moves them forward, so hours
+ * of schedule run as fast as the code does. Virtual time assumes that only
+ * the event loop thread sleeps.
+ */
+extern bool vclock_enabled;
+
+/* Switch to virtual time starting at the current system time, must be
+   called before any thread is created */
+extern void vclock_start (void);
+
+extern int64_t vclock_now (clockid_t);
+
+/* Move virtual CLOCK_MONOTONIC forward to t, it never goes back */
+extern void vclock_advance (int64_t);
+
+/* The system clock whatever the mode, to time a run in virtual time */
+extern int64_t vclock_system_ns (clockid_t);
+
+/* Sleep for ns nanoseconds */
+extern void vclock_sleep (int64_t);
+
+/* Sleep until CLOCK_MONOTONIC reaches t */
+extern void vclock_sleep_until (int64_t);
+
+#endif /* _VCLOCK_H_ */